@@ -4,6 +4,8 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <iostream>
 #include <fstream>
 #include <math.h>
@@ -73,11 +75,303 @@ static void render(std::ostream& stream, Real d)
 	}
 }
 
+/* What to say about a program once it's been compiled. */
+
+struct Reporting
+{
+    bool stats;
+    string trace;
+    bool retained;
+    bool promoted;
+};
+
+/* Writes out the compilation statistics, and how much memory the program
+ * keeps hold of, if they were asked for. */
+
+template <typename CompiledProgram>
+static void report(const CompiledProgram& program, const Reporting& reporting)
+{
+    if (reporting.stats)
+        program.stats().write(std::cerr);
+
+    if (!reporting.trace.empty())
+    {
+        std::ofstream f(reporting.trace.c_str());
+        program.stats().writeTrace(f);
+    }
+
+    if (reporting.retained)
+        std::cerr << "retained: " << program.retainedBytes() << "\n";
+}
+
+/* Says whether a tiered program had switched to its optimised code by the
+ * end of the run, if that was asked for. */
+
+template <typename CompiledProgram>
+static void report_promotion(const CompiledProgram& program,
+        const Reporting& reporting)
+{
+    if (reporting.promoted)
+        std::cerr << "promoted: " << (program.promoted() ? "yes" : "no") << "\n";
+}
+
+/* Reads everything, then processes it all in one call. */
+
+template <typename Real, typename BatchFunction>
+static void process_batch(BatchFunction* func)
+{
+	vector<Real> in;
+	Real d;
+	while (readnumber(d))
+		in.push_back(d);
+
+	vector<Real> out(in.size());
+	if (!in.empty())
+		func(in.size(), &in[0], &out[0]);
+
+	for (unsigned i = 0; i < out.size(); i++)
+	{
+		render(std::cout, out[i]);
+		std::cout << "\n";
+	}
+}
+
+/* Like process_batch(), but the input is stored as a T and decoded by the
+ * script. */
+
+template <typename T, typename Real, typename StoredBatchFunction>
+static void process_stored_batch(StoredBatchFunction* func)
+{
+	vector<T> in;
+	double d;
+	while (readnumber(d))
+		in.push_back((T) d);
+
+	vector<Real> out(in.size());
+	if (!in.empty())
+		func(in.size(), &in[0], &out[0]);
+
+	for (unsigned i = 0; i < out.size(); i++)
+	{
+		render(std::cout, out[i]);
+		std::cout << "\n";
+	}
+}
+
+/* Like process_batch(), but the script encodes the output as a T. */
+
+template <typename T, typename Real, typename QuantisedBatchFunction>
+static void process_quantised_batch(QuantisedBatchFunction* func)
+{
+	vector<Real> in;
+	Real d;
+	while (readnumber(d))
+		in.push_back(d);
+
+	vector<T> out(in.size());
+	if (!in.empty())
+		func(in.size(), &in[0], &out[0]);
+
+	for (unsigned i = 0; i < out.size(); i++)
+		std::cout << (long) out[i] << "\n";
+}
+
+/* Reads everything into an array of structs, then processes it all in place
+ * in one call. */
+
+struct Record
+{
+	double in;
+	int tag;
+	float out;
+	int rank;
+	int whole;
+};
+
+/* If integer is set, tag is an input, and rank (an int) and whole (a real)
+ * are outputs too. */
+
+template <typename RecordFunction>
+static void process_records(RecordFunction* func, bool integer)
+{
+	vector<Record> records;
+	double d;
+	while (readnumber(d))
+	{
+		Record r;
+		r.in = d;
+		r.tag = records.size();
+		r.out = 0;
+		r.rank = 0;
+		r.whole = 0;
+		records.push_back(r);
+	}
+
+	if (!records.empty())
+		func(records.size(), &records[0]);
+
+	for (unsigned i = 0; i < records.size(); i++)
+	{
+		render(std::cout, records[i].out);
+		if (integer)
+			std::cout << " " << records[i].rank << " " << records[i].whole;
+		std::cout << "\n";
+	}
+}
+
+/* Reads everything, then reduces it to a single value in one call. */
+
+template <typename Real, typename ReduceFunction>
+static void process_reduction(ReduceFunction* func)
+{
+	vector<Real> in;
+	Real d;
+	while (readnumber(d))
+		in.push_back(d);
+
+	Real result;
+	func(in.size(), in.empty() ? NULL : &in[0], &result);
+
+	render(std::cout, result);
+	std::cout << "\n";
+}
+
+#ifdef CALCULON_THREADS
+/* The same as process_batch(), but with the rows spread across the threads
+ * of a BatchExecutor. */
+
+template <typename Real, typename BatchFunction, typename Executor>
+static void process_batch(BatchFunction* func, Executor& executor)
+{
+	vector<Real> in;
+	Real d;
+	while (readnumber(d))
+		in.push_back(d);
+
+	vector<Real> out(in.size());
+	if (!in.empty())
+		executor.run(func, in.size(), &in[0], &out[0]);
+
+	for (unsigned i = 0; i < out.size(); i++)
+	{
+		render(std::cout, out[i]);
+		std::cout << "\n";
+	}
+}
+
+/* The same as process_reduction(), but with the rows spread across the
+ * threads of a BatchExecutor. */
+
+template <typename Real, typename ReduceFunction, typename Executor>
+static void process_reduction(ReduceFunction* func, Executor& executor,
+		const vector<Calculon::CompileOptions::Reduction>& reductions)
+{
+	vector<Real> in;
+	Real d;
+	while (readnumber(d))
+		in.push_back(d);
+
+	Real result;
+	executor.reduce(reductions, func, in.size(),
+			in.empty() ? NULL : &in[0], &result);
+
+	render(std::cout, result);
+	std::cout << "\n";
+}
+#endif
+
+/* Reads rows of vectors, then processes them all in one call with the
+ * Columns layout: each element of the input and output vectors has an array
+ * of its own. The batch function's type depends on how many arrays there
+ * are, so it's cast to the right one here. */
+
+template <typename Real>
+static void process_columns(void (*func)(), unsigned ivsize, unsigned ovsize)
+{
+	vector< vector<Real> > columns(ivsize + ovsize);
+	for (;;)
+	{
+		Real d;
+		unsigned i = 0;
+		while ((i < ivsize) && readnumber(d))
+			columns[i++].push_back(d);
+		if (i == ivsize)
+			continue;
+
+		if (i != 0)
+			std::cerr << "filter: found partial row, aborting\n";
+		break;
+	}
+
+	size_t count = columns[ivsize - 1].size();
+	if (count == 0)
+		return;
+
+	vector<Real*> a;
+	for (unsigned i = 0; i < columns.size(); i++)
+	{
+		columns[i].resize(count);
+		a.push_back(&columns[i][0]);
+	}
+
+	typedef Real* P;
+	switch (a.size())
+	{
+		case 2:
+			((void (*)(size_t, P, P)) func)(count, a[0], a[1]);
+			break;
+
+		case 3:
+			((void (*)(size_t, P, P, P)) func)(count, a[0], a[1], a[2]);
+			break;
+
+		case 4:
+			((void (*)(size_t, P, P, P, P)) func)(count, a[0], a[1], a[2],
+					a[3]);
+			break;
+
+		case 5:
+			((void (*)(size_t, P, P, P, P, P)) func)(count, a[0], a[1], a[2],
+					a[3], a[4]);
+			break;
+
+		case 6:
+			((void (*)(size_t, P, P, P, P, P, P)) func)(count, a[0], a[1],
+					a[2], a[3], a[4], a[5]);
+			break;
+
+		case 7:
+			((void (*)(size_t, P, P, P, P, P, P, P)) func)(count, a[0], a[1],
+					a[2], a[3], a[4], a[5], a[6]);
+			break;
+
+		default:
+			((void (*)(size_t, P, P, P, P, P, P, P, P)) func)(count, a[0],
+					a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+			break;
+	}
+
+	for (size_t row = 0; row < count; row++)
+	{
+		for (unsigned i = ivsize; i < columns.size(); i++)
+		{
+			render(std::cout, columns[i][row]);
+			std::cout << " ";
+		}
+		std::cout << "\n";
+	}
+}
+
 template <typename Settings>
 static void process_data(std::istream& codestream, const string& typesignature,
-        bool dump, const map<string, double>& realvariables,
+        bool dump, const Reporting& reporting, unsigned threads,
+        bool batch, bool lanes,
+        bool records, bool integer, bool reduce, const string& exportname,
+        const vector<string>& stages,
+        const map<string, double>& realvariables,
         const map<string, vector<double> >& vectorvariables,
-        const map<string, string>& typealiases)
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
 {
     typedef Calculon::Instance<Settings> Compiler;
     typedef typename Compiler::Real Real;
@@ -99,19 +393,268 @@ static void process_data(std::istream& codestream, const string& typesignature,
 		}
 
 		typedef void TranslateFunction(Real in, Real* out);
-		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
-				typesignature, typealiases);
+		typedef void BatchFunction(size_t count, const Real* in, Real* out);
+		typedef void RecordFunction(size_t count, Record* records);
+		typedef void ReduceFunction(size_t count, const Real* in, Real* result);
+		typedef void StoredBatchFunction(size_t count, const void* in, Real* out);
+		typedef void QuantisedBatchFunction(size_t count, const Real* in, void* out);
+
+		if (!exportname.empty())
+		{
+			typename Compiler::Library library(symbols, codestream,
+					typealiases, options);
+			if (dump)
+				library.dump();
+			report(library, reporting);
+
+			vector<string> names;
+			boost::algorithm::split(names, exportname,
+					boost::algorithm::is_any_of(","));
+
+			vector<TranslateFunction*> funcs;
+			for (vector<string>::const_iterator i = names.begin(),
+					e = names.end(); i != e; i++)
+				funcs.push_back(library.template get<TranslateFunction>(*i));
+
+			Real in;
+			while (readnumber(in))
+			{
+				for (unsigned i = 0; i < funcs.size(); i++)
+				{
+					Real out;
+					funcs[i](in, &out);
+					if (i != 0)
+						std::cout << " ";
+					render(std::cout, out);
+				}
+				std::cout << "\n";
+			}
+			return;
+		}
+
+		if (records)
+		{
+			Calculon::CompileOptions recordoptions = options;
+			recordoptions.batchLayout = Calculon::CompileOptions::Records;
+			recordoptions.record = Calculon::RecordLayout(sizeof(Record));
+			recordoptions.record.bind("in", offsetof(Record, in),
+					Calculon::RecordLayout::Double);
+			recordoptions.record.bind("out", offsetof(Record, out),
+					Calculon::RecordLayout::Float);
+			if (integer)
+			{
+				recordoptions.record.bind("tag", offsetof(Record, tag),
+						Calculon::RecordLayout::Int32);
+				recordoptions.record.bind("rank", offsetof(Record, rank),
+						Calculon::RecordLayout::Int32);
+				recordoptions.record.bind("whole", offsetof(Record, whole),
+						Calculon::RecordLayout::Int32);
+			}
+
+			typename Compiler::template Program<TranslateFunction, RecordFunction>
+					func(symbols, codestream, typesignature, typealiases,
+						recordoptions);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			process_records(func.batch(), integer);
+			return;
+		}
+
+		if (reduce)
+		{
+			typename Compiler::template Program<TranslateFunction, ReduceFunction>
+					func(symbols, codestream, typesignature, typealiases, options);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+#ifdef CALCULON_THREADS
+			if (threads)
+			{
+				typename Compiler::BatchExecutor executor(threads, 1);
+				process_reduction<Real>(func.batch(), executor,
+						options.reductions);
+				return;
+			}
+#endif
+
+			process_reduction<Real>(func.batch());
+			return;
+		}
+
+		map<string, Calculon::Storage>::const_iterator storage =
+				options.storage.find("in");
+		if (storage != options.storage.end())
+		{
+			typename Compiler::template Program<TranslateFunction, StoredBatchFunction>
+					func(symbols, codestream, typesignature, typealiases, options);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			switch (storage->second.type)
+			{
+				case Calculon::Storage::UInt8:
+					process_stored_batch<uint8_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::UInt16:
+					process_stored_batch<uint16_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Int16:
+					process_stored_batch<int16_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Half:
+					process_stored_batch<uint16_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Float:
+					process_stored_batch<float, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Double:
+					process_stored_batch<double, Real>(func.batch());
+					break;
+
+				default:
+					process_stored_batch<int32_t, Real>(func.batch());
+					break;
+			}
+			return;
+		}
+
+		storage = options.storage.find("out");
+		if (storage != options.storage.end())
+		{
+			typename Compiler::template Program<TranslateFunction, QuantisedBatchFunction>
+					func(symbols, codestream, typesignature, typealiases, options);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			switch (storage->second.type)
+			{
+				case Calculon::Storage::UInt8:
+					process_quantised_batch<uint8_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::UInt16:
+					process_quantised_batch<uint16_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Int16:
+					process_quantised_batch<int16_t, Real>(func.batch());
+					break;
+
+				case Calculon::Storage::Half:
+					process_quantised_batch<uint16_t, Real>(func.batch());
+					break;
+
+				default:
+					process_quantised_batch<int32_t, Real>(func.batch());
+					break;
+			}
+			return;
+		}
+
+		if (!stages.empty())
+		{
+			/* The script's output feeds the first extra stage, and so on;
+			 * they all get fused into one function. */
+
+			Calculon::Pipeline pipeline;
+			pipeline.add(string(std::istreambuf_iterator<char>(codestream),
+						std::istreambuf_iterator<char>()),
+					typesignature);
+			for (vector<string>::const_iterator i = stages.begin(),
+					e = stages.end(); i != e; i++)
+				pipeline.add(*i, "(out: real): (out: real)");
+
+			typename Compiler::template Program<TranslateFunction, BatchFunction>
+					func(symbols, pipeline, typesignature, typealiases, options);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			if (batch)
+			{
+				process_batch<Real>(func.batch());
+				return;
+			}
+
+			Real in;
+			while (readnumber(in))
+			{
+				Real out;
+				func(in, &out);
+				render(std::cout, out);
+				std::cout << "\n";
+			}
+			return;
+		}
+
+		if (lanes)
+		{
+			typename Compiler::template Program<TranslateFunction, BatchFunction, 4>
+					func(symbols, codestream, typesignature, typealiases, options);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			process_batch<Real>(func.batch());
+			return;
+		}
+
+#ifdef CALCULON_THREADS
+		if (threads)
+		{
+			/* Compile in the background, and then spread the batch across
+			 * the threads. */
+
+			typedef typename Compiler::template Program<TranslateFunction,
+					BatchFunction> BatchProgram;
+			typename Compiler::CompileService service(threads);
+			typename Compiler::template Future<BatchProgram> future =
+					service.template compileAsync<BatchProgram>(symbols,
+						string(std::istreambuf_iterator<char>(codestream),
+							std::istreambuf_iterator<char>()),
+						typesignature, typealiases, options);
+
+			BatchProgram& func = future.get();
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			typename Compiler::BatchExecutor executor(threads, 1);
+			process_batch<Real>(func.batch(), executor);
+			return;
+		}
+#endif
+
+		typename Compiler::template Program<TranslateFunction, BatchFunction>
+				func(symbols, codestream, typesignature, typealiases, options);
 		if (dump)
 			func.dump();
+		report(func, reporting);
 
-		Real in;
-		while (readnumber(in))
+		if (batch)
+			process_batch<Real>(func.batch());
+		else
 		{
-			Real out;
-			func(in, &out);
-			render(std::cout, out);
-			std::cout << "\n";
+			Real in;
+			while (readnumber(in))
+			{
+				Real out;
+				func(in, &out);
+				render(std::cout, out);
+				std::cout << "\n";
+			}
 		}
+		report_promotion(func, reporting);
 	}
 	catch (const typename Compiler::CompilationException& e)
 	{
@@ -124,10 +667,12 @@ static void process_data(std::istream& codestream, const string& typesignature,
 
 template <typename Settings>
 static void process_data_rows(std::istream& codestream, const string& typesignature,
-        bool dump, unsigned ivsize, unsigned ovsize,
+        bool dump, const Reporting& reporting, bool columns,
+        unsigned ivsize, unsigned ovsize,
         const map<string, double>& realvariables,
         const map<string, vector<double> >& vectorvariables,
-        const map<string, string>& typealiases)
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
 {
     typedef Calculon::Instance<Settings> Compiler;
     typedef typename Compiler::Real Real;
@@ -150,10 +695,29 @@ static void process_data_rows(std::istream& codestream, const string& typesignat
 		}
 
 		typedef void TranslateFunction(Real* in, Real* out);
+
+		if (columns)
+		{
+			Calculon::CompileOptions columnoptions = options;
+			columnoptions.batchLayout = Calculon::CompileOptions::Columns;
+
+			typedef void ColumnFunction();
+			typename Compiler::template Program<TranslateFunction, ColumnFunction>
+					func(symbols, codestream, typesignature, typealiases,
+						columnoptions);
+			if (dump)
+				func.dump();
+			report(func, reporting);
+
+			process_columns<Real>(func.batch(), ivsize, ovsize);
+			return;
+		}
+
 		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
-				typesignature, typealiases);
+				typesignature, typealiases, options);
 		if (dump)
 			func.dump();
+		report(func, reporting);
 
 		BigVector istorage;
 		Real* in = &istorage.m[0];
@@ -191,9 +755,269 @@ static void process_data_rows(std::istream& codestream, const string& typesignat
 	}
 }
 
+/* Evaluates the script over a grid whose coordinates are the integers from
+ * 0 up to the width and height, and writes out the results a row at a
+ * time. No input is read. */
+
+template <typename Settings>
+static void process_grid(std::istream& codestream,
+        bool dump, const Reporting& reporting, unsigned threads,
+        unsigned width, unsigned height, unsigned tile,
+        const map<string, double>& realvariables,
+        const map<string, vector<double> >& vectorvariables,
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+    typedef typename Compiler::Real Real;
+
+    typename Compiler::StandardSymbolTable symbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		for (map<string, vector<double> >::const_iterator i = vectorvariables.begin(),
+				e = vectorvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		Calculon::CompileOptions gridoptions = options;
+		gridoptions.batchLayout = Calculon::CompileOptions::Grid;
+
+		typedef void TranslateFunction(Real x, Real y, Real* out);
+		typename Compiler::template Program<TranslateFunction,
+				typename Compiler::GridFunction>
+				func(symbols, codestream, "(x: real, y: real): (out: real)",
+					typealiases, gridoptions);
+		if (dump)
+			func.dump();
+		report(func, reporting);
+
+		typename Compiler::Grid grid(0, 0, width, height, width, height);
+		if (tile)
+			grid.setTileSize(tile, tile);
+
+		vector<Real> out(width * height);
+		void* outputs[] = { out.empty() ? NULL : &out[0] };
+#ifdef CALCULON_THREADS
+		if (threads)
+		{
+			typename Compiler::BatchExecutor executor(threads);
+			executor.runGrid(grid, func.batch(), outputs);
+		}
+		else
+#endif
+			grid.evaluate(func.batch(), outputs);
+
+		for (unsigned y = 0; y < height; y++)
+		{
+			for (unsigned x = 0; x < width; x++)
+			{
+				render(std::cout, out[y*width + x]);
+				std::cout << " ";
+			}
+			std::cout << "\n";
+		}
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
+/* Two externals which do the same thing from different addresses. */
+
+template <typename Real>
+static Real scale_a(Real x)
+{
+	return x * 10;
+}
+
+template <typename Real>
+static Real scale_b(Real x)
+{
+	return x * 10;
+}
+
+/* Compiles the script three times with shareCode set, and runs all three on
+ * each number. The first two have identical symbol tables; the third's
+ * scale() is at a different address, so it mustn't share their code. */
+
+template <typename Settings>
+static void process_share(std::istream& codestream, const string& typesignature,
+        const map<string, double>& realvariables,
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+    typedef typename Compiler::Real Real;
+
+    typename Compiler::StandardSymbolTable symbols;
+    typename Compiler::StandardSymbolTable othersymbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+			othersymbols.add(i->first, i->second);
+		}
+
+		symbols.add("scale", "(real): real", scale_a<Real>);
+		othersymbols.add("scale", "(real): real", scale_b<Real>);
+
+		string code((std::istreambuf_iterator<char>(codestream)),
+				std::istreambuf_iterator<char>());
+		std::stringstream s1(code), s2(code), s3(code);
+
+		Calculon::CompileOptions shareoptions = options;
+		shareoptions.shareCode = true;
+
+		typedef void TranslateFunction(Real in, Real* out);
+		typedef typename Compiler::template Program<TranslateFunction> Program;
+		Program a(symbols, s1, typesignature, typealiases, shareoptions);
+		Program b(symbols, s2, typesignature, typealiases, shareoptions);
+		Program c(othersymbols, s3, typesignature, typealiases, shareoptions);
+
+		Real in;
+		while (readnumber(in))
+		{
+			Real out;
+			a(in, &out);
+			render(std::cout, out);
+			std::cout << " ";
+			b(in, &out);
+			render(std::cout, out);
+			std::cout << " ";
+			c(in, &out);
+			render(std::cout, out);
+			std::cout << "\n";
+		}
+
+		TranslateFunction* fa = a;
+		TranslateFunction* fb = b;
+		TranslateFunction* fc = c;
+		std::cout << "same externals: "
+				<< ((fa == fb) ? "shared" : "not shared") << "\n"
+				<< "different external addresses: "
+				<< ((fa == fc) ? "shared" : "not shared") << "\n";
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
+/* Compiles the script several times into one Session and runs all the
+ * copies on each number. Then the odd-numbered copies are destroyed, one
+ * more is compiled into the space they leave and run over the numbers
+ * again, and the rest are destroyed newest first, so nothing is released
+ * in the order it was created. */
+
+template <typename Settings>
+static void process_session(std::istream& codestream, const string& typesignature,
+        unsigned count,
+        const map<string, double>& realvariables,
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+    typedef typename Compiler::Real Real;
+
+    typename Compiler::StandardSymbolTable symbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		string code((std::istreambuf_iterator<char>(codestream)),
+				std::istreambuf_iterator<char>());
+
+		vector<Real> data;
+		Real d;
+		while (readnumber(d))
+			data.push_back(d);
+
+		typedef void TranslateFunction(Real in, Real* out);
+		typedef typename Compiler::template Program<TranslateFunction> Program;
+		typename Compiler::Session session(options);
+
+		vector<Program*> programs;
+		for (unsigned i = 0; i < count; i++)
+			programs.push_back(new Program(session, symbols, code,
+					typesignature, typealiases, options));
+
+		for (unsigned i = 0; i < data.size(); i++)
+		{
+			for (unsigned j = 0; j < programs.size(); j++)
+			{
+				Real out;
+				(*programs[j])(data[i], &out);
+				if (j != 0)
+					std::cout << " ";
+				render(std::cout, out);
+			}
+			std::cout << "\n";
+		}
+
+		vector<Program*> survivors;
+		for (unsigned i = 0; i < programs.size(); i++)
+		{
+			if (i & 1)
+				delete programs[i];
+			else
+				survivors.push_back(programs[i]);
+		}
+
+		survivors.push_back(new Program(session, symbols, code,
+				typesignature, typealiases, options));
+
+		std::cout << "after release:\n";
+		for (unsigned i = 0; i < data.size(); i++)
+		{
+			Real out;
+			(*survivors.back())(data[i], &out);
+			render(std::cout, out);
+			std::cout << "\n";
+		}
+
+		while (!survivors.empty())
+		{
+			delete survivors.back();
+			survivors.pop_back();
+		}
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
 int main(int argc, const char* argv[])
 {
     string precision = "double";
+    string profile = "max-throughput";
+    string isa = "native";
 
     po::options_description options("Allowed options");
     options.add_options()
@@ -207,6 +1031,62 @@ int main(int argc, const char* argv[])
                 "specifies whether to use double or float precision")
         ("dump,d",
                 "dump LLVM bitcode after compilation")
+        ("stats",
+                "print compilation statistics to stderr")
+        ("trace", po::value<string>(),
+                "write a Chrome trace of the compilation to this file")
+        ("batch,b",
+                "read all input and process it as a single batch")
+        ("lanes,l",
+                "like --batch, but compile the script to work on four rows at once")
+        ("records,r",
+                "like --batch, but with the data in an array of structs")
+        ("columns",
+                "read all the vector rows and process them as a single batch, an array per element")
+        ("reduce", po::value<string>(),
+                "reduce all the input to one value: sum, min, max, count or mean")
+        ("grid,g", po::value<string>(),
+                "evaluate f(x, y) over a WIDTHxHEIGHT grid instead of reading input")
+        ("tile", po::value<unsigned>(),
+                "the size of the tiles --grid uses")
+        ("cache,c", po::value<string>(),
+                "cache compiled code in this directory")
+        ("compact",
+                "discard the IR once the machine code has been generated")
+        ("retained",
+                "print how many bytes the compiled program keeps hold of to stderr")
+        ("profile,P", po::value(&profile),
+                "optimisation profile: max-throughput, fast-compile or strict-ieee")
+        ("isa", po::value(&isa),
+                "instruction set: native, dispatch, sse2, avx or avx2")
+        ("tier", po::value<unsigned>(),
+                "compile quickly first, and optimise after this many calls")
+        ("promoted",
+                "after the run, say on stderr whether a tiered program was promoted")
+        ("interpret",
+                "run the script with the interpreter instead of compiling it")
+        ("share",
+                "compile the script three times with shareCode, and say which copies share code")
+        ("session", po::value<unsigned>(),
+                "compile the script this many times into one Session, and run every copy")
+        ("export,e", po::value<string>(),
+                "compile the script as a library and run these comma-separated exports")
+        ("input-type", po::value<string>(),
+                "with --batch, store the input as u8, u16, i16, i32, f16 (given as its bits), f32 or f64")
+        ("input-scale", po::value<double>(),
+                "what to multiply the stored input by to get the real value")
+        ("output-type", po::value<string>(),
+                "with --batch, round and saturate the output to u8, u16, i16, i32 or f16 (written as its bits)")
+        ("output-scale", po::value<double>(),
+                "what to multiply the stored output by to get the real value")
+        ("int",
+                "make the stored input or output an int; with --records, add int fields tag, rank and whole")
+#ifdef CALCULON_THREADS
+        ("threads", po::value<unsigned>(),
+                "run --batch, --grid or --reduce on this many threads, compiling in the background")
+#endif
+        ("then", po::value< vector<string> >(),
+                "a literal script which transforms out further; the stages are compiled together")
         ("define,D", po::value< vector<string> >(),
                 "defines a global real variable")
         ("vector,V", po::value< vector<string> >(),
@@ -354,6 +1234,143 @@ int main(int argc, const char* argv[])
         codestream = new std::stringstream(script);
     }
     bool dump = (vm.count("dump") > 0);
+    Reporting reporting;
+    reporting.stats = (vm.count("stats") > 0);
+    if (vm.count("trace"))
+        reporting.trace = vm["trace"].as<string>();
+    reporting.retained = (vm.count("retained") > 0);
+    reporting.promoted = (vm.count("promoted") > 0);
+    bool batch = (vm.count("batch") > 0);
+    bool lanes = (vm.count("lanes") > 0);
+    bool records = (vm.count("records") > 0);
+    bool integer = (vm.count("int") > 0);
+    string exportname;
+    if (vm.count("export"))
+        exportname = vm["export"].as<string>();
+
+    Calculon::CompileOptions compileoptions;
+    if (profile == "max-throughput")
+        compileoptions.setProfile(Calculon::CompileOptions::MaxThroughput);
+    else if (profile == "fast-compile")
+        compileoptions.setProfile(Calculon::CompileOptions::FastCompile);
+    else if (profile == "strict-ieee")
+        compileoptions.setProfile(Calculon::CompileOptions::StrictIEEE);
+    else
+    {
+        std::cerr << "filter: unknown optimisation profile\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if (isa == "native")
+        compileoptions.instructionSet = Calculon::CompileOptions::Native;
+    else if (isa == "dispatch")
+        compileoptions.instructionSet = Calculon::CompileOptions::Dispatch;
+    else if (isa == "sse2")
+        compileoptions.instructionSet = Calculon::CompileOptions::SSE2;
+    else if (isa == "avx")
+        compileoptions.instructionSet = Calculon::CompileOptions::AVX;
+    else if (isa == "avx2")
+        compileoptions.instructionSet = Calculon::CompileOptions::AVX2;
+    else
+    {
+        std::cerr << "filter: unknown instruction set\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if (vm.count("cache"))
+        compileoptions.cacheDirectory = vm["cache"].as<string>();
+    compileoptions.compact = (vm.count("compact") > 0);
+    if (vm.count("tier"))
+        compileoptions.tierThreshold = vm["tier"].as<unsigned>();
+    if (vm.count("interpret"))
+        compileoptions.backend = Calculon::CompileOptions::Interpreter;
+
+    bool reduce = (vm.count("reduce") > 0);
+    if (reduce)
+    {
+        const string& reduction = vm["reduce"].as<string>();
+        Calculon::CompileOptions::Reduction r;
+        if (reduction == "sum")
+            r = Calculon::CompileOptions::Sum;
+        else if (reduction == "min")
+            r = Calculon::CompileOptions::Min;
+        else if (reduction == "max")
+            r = Calculon::CompileOptions::Max;
+        else if (reduction == "count")
+            r = Calculon::CompileOptions::Count;
+        else if (reduction == "mean")
+            r = Calculon::CompileOptions::Mean;
+        else
+        {
+            std::cerr << "filter: unknown reduction\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+
+        compileoptions.batchLayout = Calculon::CompileOptions::Reduce;
+        compileoptions.reductions.push_back(r);
+    }
+
+    const char* storedparameters[] = { "input", "output" };
+    for (unsigned i = 0; i < 2; i++)
+    {
+        const string parameter = storedparameters[i];
+        if (!vm.count(parameter + "-type"))
+            continue;
+
+        const string& type = vm[parameter + "-type"].as<string>();
+        Calculon::Storage::Type t;
+        if (type == "u8")
+            t = Calculon::Storage::UInt8;
+        else if (type == "u16")
+            t = Calculon::Storage::UInt16;
+        else if (type == "i16")
+            t = Calculon::Storage::Int16;
+        else if (type == "i32")
+            t = Calculon::Storage::Int32;
+        else if (type == "f16")
+            t = Calculon::Storage::Half;
+        else if ((type == "f32") && (i == 0))
+            t = Calculon::Storage::Float;
+        else if ((type == "f64") && (i == 0))
+            t = Calculon::Storage::Double;
+        else
+        {
+            std::cerr << "filter: unknown " << parameter << " type\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+
+        double scale = 1;
+        if (vm.count(parameter + "-scale"))
+            scale = vm[parameter + "-scale"].as<double>();
+        compileoptions.store((i == 0) ? "in" : "out", t, scale);
+
+        if (!vm.count("batch") || vm.count("lanes") || vm.count("records") ||
+                reduce || vm.count("then"))
+        {
+            std::cerr << "filter: --" << parameter << "-type only works with --batch on its own\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+
+    if (vm.count("input-type") && vm.count("output-type"))
+    {
+        std::cerr << "filter: --input-type and --output-type can't be used together\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if (integer && !records && !vm.count("input-type") &&
+            !vm.count("output-type"))
+    {
+        std::cerr << "filter: --int only works with --input-type, --output-type or --records\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
 
     unsigned ivsize = 0;
     if (vm.count("ivector"))
@@ -370,6 +1387,88 @@ int main(int argc, const char* argv[])
         exit(1);
     }
 
+    if ((batch || lanes || records || reduce) && (ivsize != 0))
+    {
+        std::cerr << "filter: --batch, --lanes, --records and --reduce only work on streams of numbers\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if ((batch || lanes || records || reduce) && vm.count("interpret"))
+    {
+        std::cerr << "filter: --batch, --lanes, --records and --reduce need compiled code, not --interpret\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    bool columns = (vm.count("columns") > 0);
+    if (columns && ((ivsize == 0) || (ivsize > 4) || (ovsize > 4) ||
+            batch || lanes || records || reduce || vm.count("interpret")))
+    {
+        std::cerr << "filter: --columns only works on its own, with --ivector and --ovector\n"
+                     "of up to 4 elements\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if ((lanes + records + reduce) > 1)
+    {
+        std::cerr << "filter: only one of --lanes, --records and --reduce can be used\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if (!exportname.empty() &&
+            (batch || lanes || records || reduce || vm.count("interpret") ||
+                (ivsize != 0)))
+    {
+        std::cerr << "filter: --export only works on streams of numbers, with compiled code\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    vector<string> stages;
+    if (vm.count("then") > 0)
+        stages = vm["then"].as< vector<string> >();
+
+    if (!stages.empty() &&
+            (lanes || records || reduce || vm.count("interpret") ||
+                (ivsize != 0) || !exportname.empty() || vm.count("grid")))
+    {
+        std::cerr << "filter: --then only works on streams of numbers, with compiled code,\n"
+                     "one row at a time or with --batch\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    unsigned gridwidth = 0;
+    unsigned gridheight = 0;
+    bool grid = (vm.count("grid") > 0);
+    if (grid)
+    {
+        const string& size = vm["grid"].as<string>();
+        char x;
+        std::stringstream s(size);
+        if (!(s >> gridwidth >> x >> gridheight) || (x != 'x') || !s.eof())
+        {
+            std::cerr << "filter: malformed grid size (use --grid WIDTHxHEIGHT)\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+
+        if (batch || lanes || records || reduce || vm.count("interpret") ||
+                (ivsize != 0) || !exportname.empty())
+        {
+            std::cerr << "filter: --grid can't be used with other ways of processing data\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+
+    unsigned tile = 0;
+    if (vm.count("tile"))
+        tile = vm["tile"].as<unsigned>();
+
     if ((precision != "float") && (precision != "double"))
     {
         std::cerr << "filter: precision must be 'double' or 'float'\n"
@@ -387,27 +1486,124 @@ int main(int argc, const char* argv[])
         typesignature = s.str();
     }
 
-    if (ivsize == 0)
+    if (integer)
+    {
+        if (records)
+            typesignature = "(in: real, tag: int): (out: real, rank: int, whole: real)";
+        else if (vm.count("input-type"))
+            typesignature = "(in: int): (out: real)";
+        else
+            typesignature = "(in: real): (out: int)";
+    }
+
+    bool share = (vm.count("share") > 0);
+    if (share && (batch || lanes || records || reduce || grid ||
+            vm.count("interpret") || vm.count("tier") || (ivsize != 0) ||
+            !exportname.empty() || !stages.empty() || vm.count("vector")))
+    {
+        std::cerr << "filter: --share only works on streams of numbers, one row at a time,\n"
+                     "with compiled code\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    unsigned sessioncount = 0;
+    if (vm.count("session"))
+    {
+        sessioncount = vm["session"].as<unsigned>();
+        if ((sessioncount == 0) || share || batch || lanes || records ||
+                reduce || grid || vm.count("interpret") || vm.count("tier") ||
+                (ivsize != 0) || !exportname.empty() || !stages.empty() ||
+                vm.count("vector"))
+        {
+            std::cerr << "filter: --session needs a number of programs, and only works on streams of\n"
+                         "numbers, one row at a time, with compiled code\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+
+    unsigned threads = 0;
+#ifdef CALCULON_THREADS
+    if (vm.count("threads"))
+    {
+        threads = vm["threads"].as<unsigned>();
+        if ((threads == 0) || ((batch + grid + reduce) != 1) || lanes ||
+                records || vm.count("input-type") || vm.count("output-type") ||
+                !stages.empty())
+        {
+            std::cerr << "filter: --threads needs a number of threads, and one of --batch, --grid\n"
+                         "or --reduce on its own\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+#endif
+
+    if (sessioncount)
+    {
+        /* Data is a simple stream of numbers, run through several programs
+         * sharing a session. */
+        if (precision == "double")
+            process_session<Calculon::RealIsDouble>(*codestream, typesignature,
+                    sessioncount, realvariables, typealiases, compileoptions);
+        else
+            process_session<Calculon::RealIsFloat>(*codestream, typesignature,
+                    sessioncount, realvariables, typealiases, compileoptions);
+    }
+    else if (share)
+    {
+        /* Data is a simple stream of numbers, run through three programs. */
+        if (precision == "double")
+            process_share<Calculon::RealIsDouble>(*codestream, typesignature,
+                    realvariables, typealiases, compileoptions);
+        else
+            process_share<Calculon::RealIsFloat>(*codestream, typesignature,
+                    realvariables, typealiases, compileoptions);
+    }
+    else if (grid)
+    {
+        /* There is no data; the script makes its own. */
+        if (precision == "double")
+            process_grid<Calculon::RealIsDouble>(*codestream,
+                    dump, reporting, threads, gridwidth, gridheight, tile,
+                    realvariables, vectorvariables, typealiases,
+                    compileoptions);
+        else
+            process_grid<Calculon::RealIsFloat>(*codestream,
+                    dump, reporting, threads, gridwidth, gridheight, tile,
+                    realvariables, vectorvariables, typealiases,
+                    compileoptions);
+    }
+    else if (ivsize == 0)
     {
         /* Data is a simple stream of numbers. */
         if (precision == "double")
             process_data<Calculon::RealIsDouble>(*codestream, typesignature,
-                    dump, realvariables, vectorvariables, typealiases);
+                    dump, reporting, threads, batch, lanes, records, integer,
+                    reduce, exportname, stages, realvariables,
+                    vectorvariables, typealiases,
+                    compileoptions);
         else
             process_data<Calculon::RealIsFloat>(*codestream, typesignature,
-                    dump, realvariables, vectorvariables, typealiases);
+                    dump, reporting, threads, batch, lanes, records, integer,
+                    reduce, exportname, stages, realvariables,
+                    vectorvariables, typealiases,
+                    compileoptions);
     }
     else
     {
         /* Data is a stream of rows. */
         if (precision == "double")
             process_data_rows<Calculon::RealIsDouble>(*codestream,
-                    typesignature, dump, ivsize, ovsize,
-                    realvariables, vectorvariables, typealiases);
+                    typesignature, dump, reporting, columns, ivsize, ovsize,
+                    realvariables, vectorvariables, typealiases,
+                    compileoptions);
         else
             process_data_rows<Calculon::RealIsFloat>(*codestream,
-                    typesignature, dump, ivsize, ovsize,
-                    realvariables, vectorvariables, typealiases);
+                    typesignature, dump, reporting, columns, ivsize, ovsize,
+                    realvariables, vectorvariables, typealiases,
+                    compileoptions);
     }
 
     return 0;
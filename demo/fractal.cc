@@ -7,11 +7,15 @@
 #include <iostream>
 #include <fstream>
 #include <math.h>
+#include <stdint.h>
+#include <vector>
 #include <boost/program_options.hpp>
 
 #include "calculon.h"
 
 using std::string;
+using std::map;
+using std::vector;
 namespace po = boost::program_options;
 
 typedef Calculon::Instance<Calculon::RealIsDouble> Compiler;
@@ -66,34 +70,35 @@ int main(int argc, const char* argv[])
 
 	bool dump = (vm.count("dump") > 0);
 
-	/* Load the Calculon function to generate the pixels. */
+	/* Load the Calculon function to generate the pixels. It's compiled
+	 * into a grid kernel, which works out each pixel's coordinates
+	 * itself and writes the intensity straight out as a 16-bit sample. */
 
-	typedef Real FractalFunction(Real r, Real i, Real* intensity);
+	typedef void FractalFunction(Real r, Real i, Real* intensity);
+	Calculon::CompileOptions compileoptions;
+	compileoptions.batchLayout = Calculon::CompileOptions::Grid;
+	compileoptions.store("intensity", Calculon::Storage::UInt16, 1.0/65535);
 	std::ifstream code(scriptfilename.c_str());
-	Compiler::Program<FractalFunction> func(symbols, code, "(r:real, i:real): (intensity:real)");
+	Compiler::Program<FractalFunction, Compiler::GridFunction> func(symbols,
+			code, "(r:real, i:real): (intensity:real)",
+			map<string, string>(), compileoptions);
 	if (dump)
 		func.dump();
 
+	/* Render the whole image, a tile at a time. */
+
+	vector<uint16_t> intensities(width * height);
+	void* outputs[] = { &intensities[0] };
+	Compiler::Grid grid(minr, mini, maxr, maxi, width, height);
+	grid.evaluate(func.batch(), outputs);
+
 	/* Open the output file. */
 
 	std::ofstream outputfile(outputfilename.c_str());
 	outputfile << "P2\n" << width << "\n" << height << "\n" << "65535\n";
 
-	Real rw = maxr - minr;
-	Real rh = maxi - mini;
-
-	for (Real y = 0; y < height; y++)
-	{
-		for (Real x = 0; x < width; x++)
-		{
-			Real r = minr + rw*(x/width);
-			Real i = mini + rh*(y/height);
-			Real intensity;
-
-			func(r, i, &intensity);
-			outputfile << (int)(intensity * 65535.0) << "\n";
-		}
-	}
+	for (unsigned i = 0; i < intensities.size(); i++)
+		outputfile << intensities[i] << "\n";
 
 	return 0;
 }
@@ -16,12 +16,26 @@
 #include <set>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
 #include <cassert>
 #include <cctype>
 #include <memory>
+#include <iterator>
+#include <algorithm>
 #include <boost/aligned_storage.hpp>
 #include <boost/static_assert.hpp>
 #include <boost/algorithm/string/split.hpp>
+#include <boost/type_traits/is_void.hpp>
+#include <boost/type_traits/function_traits.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+
+#if defined(CALCULON_THREADS)
+#include <deque>
+#include <boost/thread.hpp>
+#endif
 
 #define __STDC_LIMIT_MACROS
 #define __STDC_CONSTANT_MACROS
@@ -29,13 +43,28 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JIT.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/PassManager.h"
 #include "llvm/Analysis/Verifier.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TimeValue.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/Atomic.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
@@ -93,6 +122,470 @@ namespace Calculon
 
 	#include "calculon_allocator.h"
 
+	/* How a batch function's array of values is stored, if it isn't simply
+	 * an array of the parameter's own type. Values are converted to reals as
+	 * stored*scale + offset as they're loaded, and back again as they're
+	 * stored, in which case integers are rounded to nearest and saturate
+	 * (with NaNs becoming the lowest value), and halves saturate at
+	 * +/-65504. Half is IEEE half precision, and the rest are the obvious C
+	 * types. Booleans can only be stored as integers, with anything nonzero
+	 * meaning true on the way in and 1 on the way out; they ignore the
+	 * scale and offset. */
+
+	struct Storage
+	{
+		enum Type
+		{
+			Native,
+			Float,
+			Double,
+			Half,
+			UInt8,
+			UInt16,
+			Int16,
+			Int32
+		};
+
+		Type type;
+		double scale;
+		double offset;
+
+		Storage(Type type = Native, double scale = 1, double offset = 0):
+			type(type),
+			scale(scale),
+			offset(offset)
+		{
+		}
+
+		bool isInteger() const
+		{
+			return (type == UInt8) || (type == UInt16) || (type == Int16) ||
+					(type == Int32);
+		}
+
+		void describe(std::ostream& s) const
+		{
+			std::stringstream n;
+			n.precision(17);
+			n << scale << " " << offset;
+			s << (int) type << " " << n.str();
+		}
+	};
+
+	/* Describes a C struct which a Records batch function works on in place:
+	 * how big each record is, and which field each of the script's
+	 * parameters lives in. Vectors occupy consecutive fields of the same
+	 * type, starting at the given offset. Values are converted to and from
+	 * reals as they're loaded and stored; booleans must be bound to Int32
+	 * fields, which are zero for false and one (or anything nonzero, on
+	 * input) for true. */
+
+	struct RecordLayout
+	{
+		enum Type
+		{
+			Float,
+			Double,
+			Int32
+		};
+
+		struct Field
+		{
+			size_t offset;
+			Type type;
+
+			size_t size() const
+			{
+				switch (type)
+				{
+					case Float:  return 4;
+					case Double: return 8;
+					case Int32:  return 4;
+				}
+				return 0;
+			}
+		};
+
+		size_t stride;
+		map<string, Field> fields;
+
+		RecordLayout(size_t stride = 0):
+			stride(stride)
+		{
+		}
+
+		/* Binds a script parameter (input or output) to a field. */
+
+		void bind(const string& name, size_t offset, Type type)
+		{
+			Field& field = fields[name];
+			field.offset = offset;
+			field.type = type;
+		}
+
+		void describe(std::ostream& s) const
+		{
+			s << "record " << stride << "\n";
+			for (map<string, Field>::const_iterator i = fields.begin(),
+					e = fields.end(); i != e; i++)
+			{
+				s << "field " << i->first << " " << i->second.offset << " "
+				  << (int) i->second.type << "\n";
+			}
+		}
+	};
+
+	/* A chain of scripts to be compiled into a single Program. Each stage's
+	 * inputs are wired, by name, to the outputs of the latest earlier stage
+	 * which has one of that name, or else to the Program's own inputs; the
+	 * Program's outputs are found the same way. Nothing passes through
+	 * memory between the stages. */
+
+	struct Pipeline
+	{
+		struct Stage
+		{
+			string code;
+			string signature;
+		};
+
+		vector<Stage> stages;
+
+		Pipeline& add(const string& code, const string& signature)
+		{
+			Stage stage;
+			stage.code = code;
+			stage.signature = signature;
+			stages.push_back(stage);
+			return *this;
+		}
+
+		void describe(std::ostream& s) const
+		{
+			for (unsigned i = 0; i < stages.size(); i++)
+			{
+				s << "stage " << stages[i].signature << "\n"
+				  << stages[i].code.size() << "\n"
+				  << stages[i].code << "\n";
+			}
+		}
+	};
+
+	/* Options controlling how a Program is compiled. Start with a profile,
+	 * then override individual settings as required. */
+
+	struct CompileOptions
+	{
+		enum Profile
+		{
+			/* Spend as long as it takes to make the code fast. */
+			MaxThroughput,
+
+			/* Make compilation fast, for scripts which will only be run a
+			 * few times. */
+			FastCompile,
+
+			/* Optimise, but preserve IEEE floating point semantics
+			 * exactly. */
+			StrictIEEE
+		};
+
+		/* Which instructions the generated code may use. Native uses
+		 * everything the host CPU supports, which means cached code can only
+		 * be reused on the same kind of CPU. The others target a fixed
+		 * baseline which many CPUs share; Dispatch picks the best baseline
+		 * the host supports. (The baselines only apply to x86; elsewhere
+		 * they all mean Native.) */
+
+		enum InstructionSet
+		{
+			Native,
+			Dispatch,
+			SSE2,
+			AVX,
+			AVX2
+		};
+
+		/* How the program is run. The interpreter doesn't generate any
+		 * machine code at all, which makes compilation very much cheaper
+		 * but the program itself much slower; it's meant for scripts which
+		 * will only be run a few times. Interpreted programs have no
+		 * function pointers, so they have to be called through
+		 * Program::operator(). None of the code generation settings apply
+		 * to them. */
+
+		enum Backend
+		{
+			JIT,
+			Interpreter
+		};
+
+		/* How a batch function's arrays are laid out. With Rows, there's one
+		 * array per parameter, so a vector*3 parameter is an array of
+		 * Vector<3>s. With Columns, each element of a vector gets an array
+		 * of its own: the same parameter becomes three arrays of reals, for
+		 * x, y and z, in that order. Reals and booleans get one array either
+		 * way. Lane-parallel batches can't have vectors, so they're the same
+		 * in both layouts. With Records, the batch function takes a single
+		 * pointer to an array of C structs described by record, reading the
+		 * inputs from their fields and writing the outputs back in place;
+		 * lane-parallel batches can't use it. With Grid, the batch
+		 * function is a grid kernel, which generates the script's inputs
+		 * as the coordinates of the points of a tile of a grid; see
+		 * GridFunction. With Reduce, inputs are as for Rows, but instead
+		 * of an array per output the batch function takes a single array
+		 * of reals, one per output, into which it writes each output
+		 * reduced over the whole batch as described by reductions. */
+
+		enum BatchLayout
+		{
+			Rows,
+			Columns,
+			Records,
+			Grid,
+			Reduce
+		};
+
+		/* How an output of a Reduce batch function is reduced. Count is the
+		 * number of rows for which the output was true or nonzero (which
+		 * NaN is); Mean is NaN for an empty batch. Min and Max skip NaNs. */
+
+		enum Reduction
+		{
+			Sum,
+			Min,
+			Max,
+			Count,
+			Mean
+		};
+
+		/* IR optimisation level (0-3), and the inliner threshold; if the
+		 * latter is 0, only functions which must be inlined are. */
+
+		unsigned optLevel;
+		int inlineThreshold;
+		bool vectorize;
+
+		/* Code generator settings. */
+
+		llvm::CodeGenOpt::Level codeGenOptLevel;
+		bool unsafeFPMath;
+		bool lessPreciseFPMAD;
+		llvm::FPOpFusion::FPOpFusionMode fpOpFusion;
+
+		/* The target CPU. If cpu is set it's passed straight to LLVM and
+		 * instructionSet is ignored. */
+
+		InstructionSet instructionSet;
+		string cpu;
+
+		/* If set, compiled machine code is cached in this directory (which
+		 * must already exist) and reused by later compilations of the same
+		 * script, even from other processes. */
+
+		string cacheDirectory;
+
+		/* If set, the IR is thrown away as soon as the machine code has been
+		 * generated, leaving only the code itself. (dump() won't show much
+		 * afterwards.) */
+
+		bool compact;
+
+		/* If nonzero, the program is first compiled with as little
+		 * optimisation as possible, and recompiled with these options once
+		 * it's been called this many times (on another thread, if
+		 * CALCULON_THREADS is defined). See Program::promote(). Tiered
+		 * programs must have their own session. */
+
+		unsigned tierThreshold;
+
+		Backend backend;
+
+		/* If set, Programs compiled from the same script with the same
+		 * signature, type aliases, symbols and options share a single copy
+		 * of the compiled code, which stays around until the last of them
+		 * is destroyed; only the first one actually gets compiled. This
+		 * only applies to Programs which have their own session and aren't
+		 * tiered. */
+
+		bool shareCode;
+
+		BatchLayout batchLayout;
+		RecordLayout record;
+
+		/* For Reduce, how each of the script's outputs is reduced, in the
+		 * same order as the outputs. Vectors can't be reduced. */
+
+		vector<Reduction> reductions;
+
+		/* How the batch function's arrays are stored, by parameter name;
+		 * parameters which aren't mentioned are arrays of their own type. A
+		 * stored vector*N parameter's array has N values per row (or, with
+		 * Columns, each element's array is stored this way). Reduce batch
+		 * functions only have arrays for their inputs, and grid kernels for
+		 * their outputs. Lane-parallel and Records batches can't use it. */
+
+		map<string, Storage> storage;
+
+		void store(const string& name, Storage::Type type, double scale = 1,
+				double offset = 0)
+		{
+			storage[name] = Storage(type, scale, offset);
+		}
+
+		CompileOptions(Profile profile = MaxThroughput):
+			instructionSet(Native),
+			compact(false),
+			tierThreshold(0),
+			backend(JIT),
+			shareCode(false),
+			batchLayout(Rows)
+		{
+			setProfile(profile);
+		}
+
+		void setProfile(Profile profile)
+		{
+			switch (profile)
+			{
+				case MaxThroughput:
+					optLevel = 3;
+					inlineThreshold = 275;
+					vectorize = true;
+					codeGenOptLevel = llvm::CodeGenOpt::Aggressive;
+					unsafeFPMath = true;
+					lessPreciseFPMAD = true;
+					fpOpFusion = llvm::FPOpFusion::Fast;
+					break;
+
+				case FastCompile:
+					optLevel = 1;
+					inlineThreshold = 0;
+					vectorize = false;
+					codeGenOptLevel = llvm::CodeGenOpt::None;
+					unsafeFPMath = true;
+					lessPreciseFPMAD = true;
+					fpOpFusion = llvm::FPOpFusion::Fast;
+					break;
+
+				case StrictIEEE:
+					optLevel = 3;
+					inlineThreshold = 275;
+					vectorize = true;
+					codeGenOptLevel = llvm::CodeGenOpt::Aggressive;
+					unsafeFPMath = false;
+					lessPreciseFPMAD = false;
+					fpOpFusion = llvm::FPOpFusion::Strict;
+					break;
+			}
+		}
+
+		/* Returns the LLVM name of the CPU to generate code for. */
+
+		string targetCPU() const
+		{
+			if (!cpu.empty())
+				return cpu;
+
+			string triple = llvm::sys::getProcessTriple();
+			bool x86 = (triple.compare(0, 6, "x86_64") == 0) ||
+					((triple.size() > 3) && (triple[0] == 'i') &&
+						(triple.compare(2, 2, "86") == 0));
+			if (!x86)
+				return llvm::sys::getHostCPUName();
+
+			switch (instructionSet)
+			{
+				case Native:   return llvm::sys::getHostCPUName();
+				case Dispatch: break;
+				case SSE2:     return "x86-64";
+				case AVX:      return "corei7-avx";
+				case AVX2:     return "core-avx2";
+			}
+
+			switch (hostInstructionSet())
+			{
+				case AVX2:     return "core-avx2";
+				case AVX:      return "corei7-avx";
+				default:       return "x86-64";
+			}
+		}
+
+		/* Works out the best baseline instruction set the host supports,
+		 * from the CPU name LLVM detects. (LLVM only reports AVX CPUs if the
+		 * OS saves the AVX registers.) */
+
+		static InstructionSet hostInstructionSet()
+		{
+			static const char* const avx2cpus[] =
+				{ "core-avx2", NULL };
+			static const char* const avxcpus[] =
+				{ "corei7-avx", "core-avx-i", "btver2", "bdver1", "bdver2",
+				  "bdver3", NULL };
+
+			string host = llvm::sys::getHostCPUName();
+			for (int i = 0; avx2cpus[i]; i++)
+				if (host == avx2cpus[i])
+					return AVX2;
+			for (int i = 0; avxcpus[i]; i++)
+				if (host == avxcpus[i])
+					return AVX;
+			return SSE2;
+		}
+
+		/* Writes out the settings which affect the generated code. */
+
+		void describe(std::ostream& s) const
+		{
+			s << "opt " << optLevel << " " << inlineThreshold << " "
+			  << vectorize << "\n"
+			  << "codegen " << (int) codeGenOptLevel << " " << unsafeFPMath << " "
+			  << lessPreciseFPMAD << " " << (int) fpOpFusion << "\n"
+			  << "cpu " << targetCPU() << "\n"
+			  << "layout " << (int) batchLayout << "\n";
+			if (batchLayout == Records)
+				record.describe(s);
+			if (batchLayout == Reduce)
+			{
+				s << "reductions";
+				for (unsigned i = 0; i < reductions.size(); i++)
+					s << " " << (int) reductions[i];
+				s << "\n";
+			}
+
+			for (map<string, Storage>::const_iterator i = storage.begin(),
+					e = storage.end(); i != e; i++)
+			{
+				s << "storage " << i->first << " ";
+				i->second.describe(s);
+				s << "\n";
+			}
+		}
+	};
+
+	/* Sets up LLVM's global state. This happens automatically the first
+	 * time anything is compiled, and it's safe to call from any thread, but
+	 * LLVM wants it done before other threads start using it; so programs
+	 * which compile from several threads should call it first. */
+
+	inline void initialize()
+	{
+		static llvm::sys::Mutex lock;
+		static bool initialized = false;
+
+		llvm::sys::ScopedLock guard(lock);
+		if (!initialized)
+		{
+			llvm::llvm_start_multithreaded();
+			llvm::InitializeNativeTarget();
+			llvm::InitializeNativeTargetAsmPrinter();
+			llvm::sys::DynamicLibrary::LoadLibraryPermanently(NULL);
+			initialized = true;
+		}
+	}
+
+	#include "calculon_stats.h"
+
 	namespace Impl
 	{
 		template <class S, int size>
@@ -193,6 +686,45 @@ namespace Calculon
 				};
 			};
 		};
+
+		/* Runs the optimisation pipeline over a module: the function passes
+		 * over each of the given entrypoints, then the module passes
+		 * (including the inliner) over the lot. Programs, Libraries and the
+		 * ahead-of-time compiler all go through here, so the JIT and object
+		 * file outputs can't drift apart. */
+
+		inline void optimise(llvm::Module* module,
+				const vector<llvm::Function*>& functions,
+				const CompileOptions& compileoptions, CompileStats* stats)
+		{
+			llvm::FunctionPassManager fpm(module);
+			llvm::PassManager mpm;
+			llvm::PassManagerBuilder pmb;
+			pmb.OptLevel = compileoptions.optLevel;
+			pmb.LoopVectorize = compileoptions.vectorize;
+			pmb.populateFunctionPassManager(fpm);
+
+			if (compileoptions.inlineThreshold > 0)
+				pmb.Inliner = llvm::createFunctionInliningPass(
+						compileoptions.inlineThreshold);
+			else
+				pmb.Inliner = llvm::createAlwaysInlinerPass();
+			pmb.populateModulePassManager(mpm);
+
+			{
+				CompileStats::Timer timer(stats, "function passes");
+				fpm.doInitialization();
+				for (vector<llvm::Function*>::const_iterator i = functions.begin(),
+						e = functions.end(); i != e; i++)
+				{
+					llvm::verifyFunction(**i);
+					fpm.run(**i);
+				}
+			}
+
+			CompileStats::Timer timer(stats, "module passes");
+			mpm.run(*module);
+		}
 	}
 
 	template <class S>
@@ -246,17 +778,43 @@ namespace Calculon
 			llvm::Type* doubleType;
 			llvm::Type* floatType;
 			Type* booleanType;
+			Type* integerType;
+			unsigned lanes;
+			CompileStats* stats;
 
 			CompilerState(llvm::LLVMContext& context, llvm::Module* module,
-					llvm::ExecutionEngine* engine):
+					llvm::ExecutionEngine* engine, unsigned lanes):
 				context(context),
 				module(module),
 				builder(context),
 				engine(engine),
 				types(NULL),
 				intType(NULL),
-				realType(NULL), doubleType(NULL), floatType(NULL)
+				realType(NULL), doubleType(NULL), floatType(NULL),
+				booleanType(NULL), integerType(NULL),
+				lanes(lanes),
+				stats(NULL)
+			{
+			}
+
+			/* In lane-parallel code every scalar value is really a vector
+			 * with one element per lane. */
+
+			llvm::Type* laneType(llvm::Type* t)
+			{
+				if (lanes > 1)
+					return llvm::VectorType::get(t, lanes);
+				return t;
+			}
+
+			/* Returns a scalar i1 which is true if any lane in the mask is
+			 * set. */
+
+			llvm::Value* anyLane(llvm::Value* mask)
 			{
+				llvm::Type* t = llvm::IntegerType::get(context, lanes);
+				return builder.CreateICmpNE(builder.CreateBitCast(mask, t),
+						llvm::ConstantInt::get(t, 0));
 			}
 		};
 
@@ -268,135 +826,1099 @@ namespace Calculon
 		#include "calculon_intrinsics.h"
 	private:
 		#include "calculon_compiler.h"
+		#include "calculon_interpreter.h"
+		#include "calculon_cache.h"
+
+	public:
+		#include "calculon_session.h"
 
 	public:
-		template <typename FuncType>
+		/* FuncType is the C type of the script's entrypoint. If BatchFuncType
+		 * is given, a companion function of that type is also generated which
+		 * runs the script over an entire batch of rows in one call; see
+		 * batch(). If lanes is greater than 1, the batch function is compiled
+		 * from a lane-parallel version of the script which works on that many
+		 * rows at once. */
+
+		template <typename FuncType, typename BatchFuncType = void, int lanes = 1>
 		class Program
 		{
+			BOOST_STATIC_ASSERT(lanes >= 1);
+
 		private:
-			llvm::LLVMContext _context;
+			typedef boost::function_traits<FuncType> Traits;
+
+			auto_ptr<Session> _ownsession;
+			auto_ptr<llvm::LLVMContext> _owncontext;
+			llvm::LLVMContext* _context;
 			SymbolTable& _symbols;
 			llvm::Module* _module;
 			llvm::ExecutionEngine* _engine;
+			bool _ownsengine;
 			llvm::Function* _function;
+			llvm::Function* _batchfunction;
 			FuncType* _funcptr;
+			BatchFuncType* _batchptr;
+			auto_ptr<ObjectFileCache> _cache;
+			auto_ptr<Interpreter> _interpreter;
+			boost::shared_ptr<Program> _shared;
+			vector<llvm::Function*> _compiled;
+			size_t _codesize;
+			CompileStats _stats;
+
+			/* Tiered compilation: the source and settings needed to compile
+			 * the optimised version, and where the dispatchers find it. */
+
+			string _source;
+			string _signature;
+			map<string, string> _typealiases;
+			CompileOptions _options;
+			llvm::Module* _promotedmodule;
+			llvm::ExecutionEngine* _promotedengine;
+#if defined(CALCULON_THREADS)
+			auto_ptr<boost::thread> _promoter;
+#endif
+			void* volatile _entry;
+			void* volatile _batchentry;
+			volatile llvm::sys::cas_flag _calls;
+			llvm::sys::Mutex _promotelock;
+			bool _promoting;
+			volatile bool _promoted;
+
+			/* If this program is a pipeline, the stages; the code it was
+			 * given is then just a description of them. */
+
+			Pipeline _pipeline;
 
 		public:
 			typedef typename S::Real Real;
 
 		public:
 			Program(SymbolTable& symbols, const string& code, const string& signature,
-						const map<string, string>& typealiases):
+						const map<string, string>& typealiases,
+						const CompileOptions& options = CompileOptions()):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
 			{
 				std::istringstream stream(code);
-				init(stream, signature, typealiases);
+				init(NULL, stream, signature, typealiases, options);
 			}
 
 			Program(SymbolTable& symbols, const string& code, const string& signature):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
 			{
 				std::istringstream stream(code);
 				map<string, string> typealiases;
-				init(stream, signature, typealiases);
+				init(NULL, stream, signature, typealiases, CompileOptions());
 			}
 
 			Program(SymbolTable& symbols, std::istream& code, const string& signature,
-						const map<string, string>& typealiases):
+						const map<string, string>& typealiases,
+						const CompileOptions& options = CompileOptions()):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
 			{
-				init(code, signature, typealiases);
+				init(NULL, code, signature, typealiases, options);
 			}
 
 			Program(SymbolTable& symbols, std::istream& code, const string& signature):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
 			{
 				map<string, string> typealiases;
-				init(code, signature, typealiases);
+				init(NULL, code, signature, typealiases, CompileOptions());
+			}
+
+			/* These compile a whole pipeline into a single function with
+			 * the given signature. */
+
+			Program(SymbolTable& symbols, const Pipeline& pipeline,
+						const string& signature,
+						const map<string, string>& typealiases = map<string, string>(),
+						const CompileOptions& options = CompileOptions()):
+					_symbols(symbols),
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_pipeline(pipeline)
+			{
+				std::stringstream stream;
+				pipeline.describe(stream);
+				init(NULL, stream, signature, typealiases, options);
+			}
+
+			Program(Session& session, SymbolTable& symbols,
+						const Pipeline& pipeline, const string& signature,
+						const map<string, string>& typealiases = map<string, string>(),
+						const CompileOptions& options = CompileOptions()):
+					_symbols(symbols),
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_pipeline(pipeline)
+			{
+				std::stringstream stream;
+				pipeline.describe(stream);
+				init(&session, stream, signature, typealiases, options);
+			}
+
+			/* These compile the program into an existing session. */
+
+			Program(Session& session, SymbolTable& symbols, const string& code,
+						const string& signature,
+						const map<string, string>& typealiases = map<string, string>(),
+						const CompileOptions& options = CompileOptions()):
+					_symbols(symbols),
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
+			{
+				std::istringstream stream(code);
+				init(&session, stream, signature, typealiases, options);
+			}
+
+			Program(Session& session, SymbolTable& symbols, std::istream& code,
+						const string& signature,
+						const map<string, string>& typealiases = map<string, string>(),
+						const CompileOptions& options = CompileOptions()):
+					_symbols(symbols),
+					_batchfunction(NULL),
+					_funcptr(NULL),
+					_batchptr(NULL)
+			{
+				init(&session, code, signature, typealiases, options);
 			}
 
 			~Program()
 			{
+#if defined(CALCULON_THREADS)
+				if (_promoter.get())
+					_promoter->join();
+#endif
+				release();
 			}
 
+			/* Interpreted programs have no machine code, so this returns NULL
+			 * for them; operator() works for both. */
+
 			operator FuncType* () const
 			{
 				return _funcptr;
 			}
 
+			template <class A1>
+			void operator () (A1 a1) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				if (_funcptr)
+					_funcptr(p1);
+				else
+				{
+					void* args[] = { &p1 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2>
+			void operator () (A1 a1, A2 a2) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				if (_funcptr)
+					_funcptr(p1, p2);
+				else
+				{
+					void* args[] = { &p1, &p2 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3>
+			void operator () (A1 a1, A2 a2, A3 a3) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				if (_funcptr)
+					_funcptr(p1, p2, p3);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3, class A4>
+			void operator () (A1 a1, A2 a2, A3 a3, A4 a4) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				typename Traits::arg4_type p4 = a4;
+				if (_funcptr)
+					_funcptr(p1, p2, p3, p4);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3, &p4 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3, class A4, class A5>
+			void operator () (A1 a1, A2 a2, A3 a3, A4 a4, A5 a5) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				typename Traits::arg4_type p4 = a4;
+				typename Traits::arg5_type p5 = a5;
+				if (_funcptr)
+					_funcptr(p1, p2, p3, p4, p5);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3, &p4, &p5 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3, class A4, class A5, class A6>
+			void operator () (A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				typename Traits::arg4_type p4 = a4;
+				typename Traits::arg5_type p5 = a5;
+				typename Traits::arg6_type p6 = a6;
+				if (_funcptr)
+					_funcptr(p1, p2, p3, p4, p5, p6);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3, &p4, &p5, &p6 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3, class A4, class A5, class A6, class A7>
+			void operator () (A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				typename Traits::arg4_type p4 = a4;
+				typename Traits::arg5_type p5 = a5;
+				typename Traits::arg6_type p6 = a6;
+				typename Traits::arg7_type p7 = a7;
+				if (_funcptr)
+					_funcptr(p1, p2, p3, p4, p5, p6, p7);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3, &p4, &p5, &p6, &p7 };
+					interpreter().run(args);
+				}
+			}
+
+			template <class A1, class A2, class A3, class A4, class A5, class A6, class A7, class A8>
+			void operator () (A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6, A7 a7, A8 a8) const
+			{
+				typename Traits::arg1_type p1 = a1;
+				typename Traits::arg2_type p2 = a2;
+				typename Traits::arg3_type p3 = a3;
+				typename Traits::arg4_type p4 = a4;
+				typename Traits::arg5_type p5 = a5;
+				typename Traits::arg6_type p6 = a6;
+				typename Traits::arg7_type p7 = a7;
+				typename Traits::arg8_type p8 = a8;
+				if (_funcptr)
+					_funcptr(p1, p2, p3, p4, p5, p6, p7, p8);
+				else
+				{
+					void* args[] = { &p1, &p2, &p3, &p4, &p5, &p6, &p7, &p8 };
+					interpreter().run(args);
+				}
+			}
+
+			/* Returns the batch function, which takes the number of rows
+			 * followed by one array per script parameter (or, with the
+			 * Columns layout, per vector element), in the same order as the
+			 * entrypoint's parameters; with the Records layout, it takes the
+			 * number of records and a pointer to the first. Interpreted
+			 * programs don't have one. */
+
+			BatchFuncType* batch() const
+			{
+				return _batchptr;
+			}
+
+			/* For tiered programs, compiles the optimised version now if
+			 * that hasn't happened yet; calls made from then on use it. This
+			 * can be called while other threads are calling the program.
+			 * (Otherwise it's started by the call which reaches the
+			 * threshold.) The baseline's engine generates code as cheaply as
+			 * it can, so the optimised version gets an engine of its own,
+			 * with the real code generator settings. */
+
+			void promote()
+			{
+				if (_shared)
+				{
+					_shared->promote();
+					return;
+				}
+
+				llvm::sys::ScopedLock guard(_promotelock);
+				if (_promoting)
+					return;
+				_promoting = true;
+
+				_promotedmodule = new llvm::Module("Calculon Function", *_context);
+				llvm::EngineBuilder builder(_promotedmodule);
+				_promotedengine = Session::createEngine(builder, _options);
+
+				std::istringstream codestream(_source);
+				build(_promotedmodule, _promotedengine, codestream, _source,
+						_signature, _typealiases, _options, NULL);
+				generate_machine_code(_promotedmodule, _options, NULL);
+
+				void* funcptr;
+				void* batchptr;
+				emit_machine_code(_promotedmodule, _promotedengine, funcptr,
+						batchptr, NULL);
+				finish(_promotedmodule, _options);
+
+				/* Make sure the code is visible to other threads before the
+				 * pointers to it are. */
+
+				llvm::sys::MemoryFence();
+				_batchentry = batchptr;
+				_entry = funcptr;
+				llvm::sys::MemoryFence();
+				_promoted = true;
+			}
+
+			bool promoted() const
+			{
+				if (_shared)
+					return _shared->promoted();
+				return _promoted;
+			}
+
 			void dump()
 			{
-				_module->dump();
+				if (_shared)
+					_shared->dump();
+				if (_module)
+					_module->dump();
+				if (_promotedmodule)
+					_promotedmodule->dump();
+			}
+
+			/* Describes the initial compilation (tiered programs' promotions
+			 * aren't included). Programs which share code share the stats of
+			 * whichever compiled it. */
+
+			const CompileStats& stats() const
+			{
+				if (_shared)
+					return _shared->stats();
+				return _stats;
+			}
+
+			/* Returns (approximately) how much memory this program is
+			 * holding on to: its machine code, plus its IR unless it was
+			 * compiled in compact mode. Shared code is counted by every
+			 * Program which shares it. */
+
+			size_t retainedBytes() const
+			{
+				if (_shared)
+					return _shared->retainedBytes();
+
+				size_t bytes = _codesize;
+				if (_module)
+					bytes += Impl::irBytes(_module);
+				if (_promotedmodule)
+					bytes += Impl::irBytes(_promotedmodule);
+				if (_interpreter.get())
+					bytes += _interpreter->size();
+				return bytes;
 			}
 
 		private:
-			void init(std::istream& codestream, const string& signature,
-					const map<string, string>& typealiases)
-			{
-				_module = new llvm::Module("Calculon Function", _context);
-
-				llvm::InitializeNativeTarget();
-
-				llvm::TargetOptions options;
-//				options.PrintMachineCode = true;
-				options.UnsafeFPMath = true;
-				options.RealignStack = true;
-				options.LessPreciseFPMADOption = true;
-				options.GuaranteedTailCallOpt = true;
-				options.AllowFPOpFusion = llvm::FPOpFusion::Fast;
-
-				string s;
-				_engine = llvm::EngineBuilder(_module)
-					.setErrorStr(&s)
-					.setOptLevel(llvm::CodeGenOpt::Aggressive)
-					.setTargetOptions(options)
-					.create();
+			const Interpreter& interpreter() const
+			{
+				if (_shared)
+					return _shared->interpreter();
+				return *_interpreter;
+			}
+
+			void init(Session* session, std::istream& codestream,
+					const string& signature, const map<string, string>& typealiases,
+					const CompileOptions& compileoptions)
+			{
+				_module = NULL;
+				_engine = NULL;
+				_ownsengine = false;
+				_codesize = 0;
+				_promotedmodule = NULL;
+				_promotedengine = NULL;
+				_entry = _batchentry = NULL;
+				_calls = 0;
+				_promoting = _promoted = true;
+				_stats.start();
+
+				if (!_pipeline.stages.empty() &&
+						(compileoptions.backend == CompileOptions::Interpreter))
+					throw CompilationException("pipelines can't be interpreted");
+
+				if (!session && compileoptions.shareCode &&
+						(compileoptions.tierThreshold == 0))
+				{
+					share(codestream, signature, typealiases, compileoptions);
+					return;
+				}
+
+				/* The interpreter doesn't need an engine, so it doesn't need a
+				 * session either; just somewhere to put the IR. */
+
+				bool interpreted = (compileoptions.backend == CompileOptions::Interpreter);
+				if (interpreted && !session)
+				{
+					_owncontext.reset(new llvm::LLVMContext());
+					_context = _owncontext.get();
+				}
+				else
+				{
+					if (!session)
+					{
+						/* A tiered program's own engine generates the
+						 * baseline code, so it should do it quickly. */
+
+						CompileOptions sessionoptions = compileoptions;
+						if (isTiered(compileoptions))
+							sessionoptions.codeGenOptLevel = llvm::CodeGenOpt::None;
+
+						CompileStats::Timer timer(&_stats, "session");
+						_ownsession.reset(new Session(sessionoptions));
+						session = _ownsession.get();
+					}
+					_context = &session->context();
+				}
+				_module = new llvm::Module("Calculon Function", *_context);
+
+				try
+				{
+					if (interpreted)
+						interpret(codestream, signature, typealiases,
+								compileoptions);
+					else
+						compile(session, codestream, signature, typealiases,
+								compileoptions);
+				}
+				catch (...)
+				{
+					release();
+					throw;
+				}
+			}
+
+			/* Programs which share code are kept in a registry (one for each
+			 * type of Program) until the last reference to them goes away. */
+
+			struct Registry
+			{
+				llvm::sys::Mutex lock;
+				map<string, boost::weak_ptr<Program> > programs;
+			};
+
+			static Registry& registry()
+			{
+				/* Never destroyed, as Programs may outlive it otherwise. */
+
+				static Registry* registry = new Registry();
+				return *registry;
+			}
+
+			struct Unregister
+			{
+				string key;
+
+				Unregister(const string& key):
+					key(key)
+				{
+				}
+
+				void operator () (Program* program)
+				{
+					{
+						Registry& r = registry();
+						llvm::sys::ScopedLock guard(r.lock);
+						typename map<string, boost::weak_ptr<Program> >::iterator i =
+								r.programs.find(key);
+						if ((i != r.programs.end()) && i->second.expired())
+							r.programs.erase(i);
+					}
+
+					delete program;
+				}
+			};
+
+			/* Finds an identical program to share code with, compiling it
+			 * if there isn't one yet. Two threads may compile the same
+			 * script at once; only the first to finish gets shared. */
+
+			void share(std::istream& codestream, const string& signature,
+					const map<string, string>& typealiases,
+					const CompileOptions& compileoptions)
+			{
+				string code((std::istreambuf_iterator<char>(codestream)),
+						std::istreambuf_iterator<char>());
+
+				std::stringstream s;
+				s << cacheKey(code, signature, typealiases, compileoptions, true)
+				  << "\nbackend " << compileoptions.backend
+				  << " compact " << compileoptions.compact
+				  << " cache " << compileoptions.cacheDirectory << "\n";
+				string key = s.str();
+
+				Registry& r = registry();
+				{
+					llvm::sys::ScopedLock guard(r.lock);
+					typename map<string, boost::weak_ptr<Program> >::iterator i =
+							r.programs.find(key);
+					if (i != r.programs.end())
+						_shared = i->second.lock();
+				}
+
+				if (!_shared)
+				{
+					CompileOptions options = compileoptions;
+					options.shareCode = false;
+					Program* p = _pipeline.stages.empty() ?
+							new Program(_symbols, code, signature, typealiases,
+									options) :
+							new Program(_symbols, _pipeline, signature,
+									typealiases, options);
+					boost::shared_ptr<Program> program(p, Unregister(key));
+
+					llvm::sys::ScopedLock guard(r.lock);
+					boost::weak_ptr<Program>& entry = r.programs[key];
+					_shared = entry.lock();
+					if (!_shared)
+					{
+						entry = program;
+						_shared = program;
+					}
+				}
+
+				_funcptr = _shared->_funcptr;
+				_batchptr = _shared->_batchptr;
+			}
+
+			void release()
+			{
+				/* This also deletes the promoted module. */
+				delete _promotedengine;
+				_promotedengine = NULL;
+				_promotedmodule = NULL;
+
 				if (!_engine)
-					throw CompilationException(s);
-				_engine->DisableLazyCompilation();
-	//			_engine->DisableSymbolSearching();
+				{
+					delete _module;
+					return;
+				}
+
+				if (_ownsengine)
+				{
+					/* This also deletes the module. */
+					delete _engine;
+					return;
+				}
+
+				/* Give the machine code and the modules back; the session
+				 * lives on. */
+
+				for (typename vector<llvm::Function*>::const_iterator i = _compiled.begin(),
+						e = _compiled.end(); i != e; i++)
+				{
+					_engine->freeMachineCodeForFunction(*i);
+				}
+				_engine->removeModule(_module);
+				delete _module;
+			}
+
+			/* Interpreted programs keep nothing but the bytecode. */
+
+			void interpret(std::istream& codestream, const string& signature,
+					const map<string, string>& typealiases,
+					const CompileOptions& compileoptions)
+			{
+				build(_module, NULL, codestream, "", signature, typealiases,
+						compileoptions, &_stats);
+				_stats.irInstructions = Impl::irInstructions(_module);
+
+				{
+					CompileStats::Timer timer(&_stats, "bytecode");
+					_interpreter.reset(new Interpreter(_function, _symbols));
+				}
+				_stats.codeBytes = _interpreter->size();
 
-				Compiler compiler(_context, _module, _engine, typealiases);
+				delete _module;
+				_module = NULL;
+				_function = NULL;
 
-				/* Compile the program. */
+				if (_owncontext.get())
+				{
+					_owncontext.reset();
+					_context = NULL;
+				}
+			}
+
+			void compile(Session* session, std::istream& codestream,
+					const string& signature, const map<string, string>& typealiases,
+					const CompileOptions& compileoptions)
+			{
+				/* The lane-parallel batch function is compiled separately from
+				 * the same source, the cache needs the source for its key, and
+				 * tiered programs compile it again later; so we may need to
+				 * keep a copy. Cached code is already optimised, so tiering
+				 * doesn't apply to it. */
+
+				bool lanebatch = !boost::is_void<BatchFuncType>::value && (lanes > 1);
+				bool cached = !compileoptions.cacheDirectory.empty();
+				bool tiered = isTiered(compileoptions);
+				string code;
+
+				/* Promotion compiles into the engine on whichever thread
+				 * makes the call which reaches the threshold, which is only
+				 * safe if nothing else can be using the engine. */
+
+				if (tiered && (session != _ownsession.get()))
+					throw CompilationException(
+						"tiered programs can't be compiled into a shared session");
+
+				if (lanebatch || cached || tiered)
+					code.assign(std::istreambuf_iterator<char>(codestream),
+							std::istreambuf_iterator<char>());
+
+				/* Caching relies on MCJIT, which (unlike the old JIT) produces
+				 * an object file; but it can only handle one module, so a
+				 * cached program always gets its own engine. Otherwise we just
+				 * add our module to the session's. */
+
+				if (cached)
+				{
+					_cache.reset(new ObjectFileCache(compileoptions.cacheDirectory,
+							cacheKey(code, signature, typealiases, compileoptions,
+								false)));
+
+					llvm::EngineBuilder builder(_module);
+					builder.setUseMCJIT(true);
+					builder.setJITMemoryManager(new CacheMemoryManager(_symbols));
+					_engine = Session::createEngine(builder, compileoptions);
+					_ownsengine = true;
+				}
+				else
+				{
+					_engine = session->engine();
+					_engine->addModule(_module);
+				}
+
+				if (_cache.get())
+				{
+					_engine->setObjectCache(_cache.get());
+					if (_cache->hit())
+					{
+						load_cached_machine_code();
+						_stats.codeBytes = _codesize;
+						finish(_module, compileoptions);
+						return;
+					}
+				}
+
+				std::istringstream codecopy(code);
+				build(_module, _engine,
+						(lanebatch || cached || tiered) ? codecopy : codestream,
+						code, signature, typealiases, compileoptions, &_stats);
+				_stats.irInstructions = Impl::irInstructions(_module);
+
+				if (tiered)
+				{
+					/* The baseline tier gets no IR optimisation, and the
+					 * engine was created with no code generator optimisation
+					 * either (see init()). */
+
+					CompileOptions baseline = compileoptions;
+					baseline.optLevel = 0;
+					baseline.inlineThreshold = 0;
+					baseline.vectorize = false;
+					generate_machine_code(_module, baseline, &_stats);
+
+					_source = code;
+					_signature = signature;
+					_typealiases = typealiases;
+					_options = compileoptions;
+					_promoting = _promoted = false;
+
+					_function = create_dispatcher(_function, &_entry);
+					if (_batchfunction)
+						_batchfunction = create_dispatcher(_batchfunction,
+								&_batchentry);
+				}
+				else
+					generate_machine_code(_module, compileoptions, &_stats);
+				_stats.optimisedIRInstructions = Impl::irInstructions(_module);
+
+				void* funcptr;
+				void* batchptr;
+				emit_machine_code(_module, _engine, funcptr, batchptr, &_stats);
+				_funcptr = (FuncType*) funcptr;
+				_batchptr = (BatchFuncType*) batchptr;
+				_stats.codeBytes = _codesize;
+				finish(_module, compileoptions);
+			}
+
+			/* Compiles the script into IR in the given module, which will be
+			 * run by the given engine, setting _function and _batchfunction.
+			 * code is only used for the lane-parallel batch function. Without
+			 * an engine (i.e. when interpreting) there's no batch function.
+			 * Timings go into stats if it's not NULL. */
+
+			void build(llvm::Module* module, llvm::ExecutionEngine* engine,
+					std::istream& codestream,
+					const string& code, const string& signature,
+					const map<string, string>& typealiases,
+					const CompileOptions& compileoptions, CompileStats* stats)
+			{
+				bool batch = !boost::is_void<BatchFuncType>::value && engine;
+				bool lanebatch = batch && (lanes > 1);
+
+				{
+					Compiler compiler(*_context, module, engine, typealiases);
+					compiler.stats = stats;
+
+					std::istringstream signaturestream(signature);
+					ToplevelSymbol* f = _pipeline.stages.empty() ?
+							compiler.compile(signaturestream, codestream,
+									&_symbols) :
+							compiler.compilePipeline(signaturestream,
+									_pipeline, &_symbols);
+					_function = f->function;
+
+					if (batch && !lanebatch)
+					{
+						CompileStats::Timer timer(stats, "batch");
+						_batchfunction = compiler.compileBatch(f, compileoptions);
+					}
+				}
+
+				if (lanebatch)
+				{
+					Compiler lanecompiler(*_context, module, engine,
+							typealiases, lanes);
+					lanecompiler.stats = stats;
+
+					std::istringstream signaturestream(signature);
+					std::istringstream codecopy(code);
+					ToplevelSymbol* f = _pipeline.stages.empty() ?
+							lanecompiler.compile(signaturestream, codecopy,
+									&_symbols) :
+							lanecompiler.compilePipeline(signaturestream,
+									_pipeline, &_symbols);
+
+					CompileStats::Timer timer(stats, "batch");
+					_batchfunction = lanecompiler.compileBatch(f, compileoptions);
+				}
+			}
+
+			/* Wraps an entrypoint of a tiered program. Once the optimised
+			 * version exists, *entry points at it and the dispatcher just
+			 * calls it; until then, it counts calls and runs the baseline
+			 * code, first promoting the program if the threshold has just
+			 * been reached. */
+
+			llvm::Function* create_dispatcher(llvm::Function* baseline,
+					void* volatile* entry)
+			{
+				llvm::FunctionType* ft = baseline->getFunctionType();
+				llvm::Function* f = llvm::Function::Create(ft,
+						llvm::Function::ExternalLinkage,
+						baseline->getName().str() + "Dispatcher", _module);
+
+				vector<llvm::Value*> args;
+				for (llvm::Function::arg_iterator i = f->arg_begin(),
+						e = f->arg_end(); i != e; i++)
+					args.push_back(i);
+
+				llvm::IRBuilder<> builder(*_context);
+				llvm::Type* inttype = builder.getInt32Ty();
+				llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(*_context,
+						"", f);
+				llvm::BasicBlock* optimisedblock = llvm::BasicBlock::Create(*_context,
+						"optimised", f);
+				llvm::BasicBlock* countblock = llvm::BasicBlock::Create(*_context,
+						"count", f);
+				llvm::BasicBlock* promoteblock = llvm::BasicBlock::Create(*_context,
+						"promote", f);
+				llvm::BasicBlock* baselineblock = llvm::BasicBlock::Create(*_context,
+						"baseline", f);
+
+				builder.SetInsertPoint(entryblock);
+				llvm::Value* optimised = builder.CreateLoad(
+						address(entry, llvm::PointerType::getUnqual(ft)), true);
+				builder.CreateCondBr(builder.CreateIsNotNull(optimised),
+						optimisedblock, countblock);
+
+				builder.SetInsertPoint(optimisedblock);
+				forward(builder, builder.CreateCall(optimised, args));
+
+				builder.SetInsertPoint(countblock);
+				llvm::Value* calls = builder.CreateAtomicRMW(
+						llvm::AtomicRMWInst::Add,
+						address((const void*) &_calls, inttype),
+						llvm::ConstantInt::get(inttype, 1),
+						llvm::Monotonic);
+				builder.CreateCondBr(
+						builder.CreateICmpEQ(calls, llvm::ConstantInt::get(
+								inttype, _options.tierThreshold - 1)),
+						promoteblock, baselineblock);
+
+				builder.SetInsertPoint(promoteblock);
+				llvm::Type* voidptrtype = builder.getInt8PtrTy();
+				llvm::FunctionType* promotetype = llvm::FunctionType::get(
+						builder.getVoidTy(), voidptrtype, false);
+				builder.CreateCall(
+						address((const void*) &promote_callback, promotetype),
+						address(this, builder.getInt8Ty()));
+				builder.CreateBr(baselineblock);
+
+				builder.SetInsertPoint(baselineblock);
+				forward(builder, builder.CreateCall(baseline, args));
+
+				llvm::verifyFunction(*f);
+				return f;
+			}
+
+			void forward(llvm::IRBuilder<>& builder, llvm::Value* result)
+			{
+				if (result->getType()->isVoidTy())
+					builder.CreateRetVoid();
+				else
+					builder.CreateRet(result);
+			}
+
+			/* A constant pointer to something in this process. Tiered code
+			 * is never cached, so it can refer to things by address. */
+
+			llvm::Constant* address(const volatile void* p, llvm::Type* type)
+			{
+				llvm::Type* intptrtype = llvm::Type::getIntNTy(*_context,
+						sizeof(void*) * 8);
+				return llvm::ConstantExpr::getIntToPtr(
+						llvm::ConstantInt::get(intptrtype, (uintptr_t) p),
+						llvm::PointerType::getUnqual(type));
+			}
+
+			/* Called by the dispatchers. With CALCULON_THREADS, promotion
+			 * happens on a thread of its own, so the call which reaches the
+			 * threshold doesn't have to wait for it; otherwise it happens
+			 * during that call. */
+
+			static void promote_callback(void* program)
+			{
+				Program* p = (Program*) program;
+#if defined(CALCULON_THREADS)
+				llvm::sys::ScopedLock guard(p->_promotelock);
+				if (p->_promoting || p->_promoter.get())
+					return;
+				try
+				{
+					p->_promoter.reset(new boost::thread(
+							&Program::promote_quietly, p));
+					return;
+				}
+				catch (...)
+				{
+				}
+#endif
+				p->promote_quietly();
+			}
 
-				std::istringstream signaturestream(signature);
-				ToplevelSymbol* f = compiler.compile(signaturestream, codestream,
-						&_symbols);
-				_function = f->function;
+			/* This is underneath generated code (or at the top of a thread),
+			 * so exceptions mustn't escape. If promotion fails, the program
+			 * just carries on using the baseline code. */
 
+			void promote_quietly()
+			{
+				try
+				{
+					promote();
+				}
+				catch (...)
+				{
+				}
+			}
 
-				generate_machine_code();
+			static bool isTiered(const CompileOptions& compileoptions)
+			{
+				return (compileoptions.tierThreshold > 0) &&
+						compileoptions.cacheDirectory.empty();
+			}
+
+			/* Once we have machine code, nothing else is needed to run the
+			 * program. In compact mode, throw it all away. The function
+			 * objects themselves have to stay, as the JIT uses them to keep
+			 * track of the machine code. */
+
+			void finish(llvm::Module* module, const CompileOptions& compileoptions)
+			{
+				if (!compileoptions.compact)
+					return;
+
+				for (llvm::Module::iterator i = module->begin(),
+						e = module->end(); i != e; i++)
+				{
+					i->deleteBody();
+				}
+
+				if (_cache.get())
+				{
+					_engine->setObjectCache(NULL);
+					_cache.reset();
+				}
+			}
+
+			/* Everything which can affect the generated code goes into the
+			 * cache key. */
+
+			string cacheKey(const string& code, const string& signature,
+					const map<string, string>& typealiases,
+					const CompileOptions& compileoptions, bool addresses)
+			{
+				std::stringstream s;
+				s << "llvm " << CALCULON_LLVM << "\n"
+				  << "target " << llvm::sys::getProcessTriple() << "\n"
+				  << "real " << S::chooseDoubleOrFloat("double", "float") << "\n"
+				  << "batch " << !boost::is_void<BatchFuncType>::value << "\n"
+				  << "lanes " << lanes << "\n"
+				  << "signature " << signature << "\n";
+				compileoptions.describe(s);
+
+				for (map<string, string>::const_iterator i = typealiases.begin(),
+						e = typealiases.end(); i != e; i++)
+				{
+					s << "alias " << i->first << "=" << i->second << "\n";
+				}
+
+				s << "symbols\n";
+				_symbols.describe(s, addresses);
+
+				s << "code\n" << code;
+				return s.str();
+			}
+
+			/* On a cache hit MCJIT ignores the module's contents and loads the
+			 * object file instead; it only needs the entrypoints to exist so
+			 * that it can look them up by name. */
+
+			void load_cached_machine_code()
+			{
+				_function = cached_entrypoint("Entrypoint");
+				if (!boost::is_void<BatchFuncType>::value)
+					_batchfunction = cached_entrypoint("BatchEntrypoint");
+
+				void* funcptr;
+				void* batchptr;
+				emit_machine_code(_module, _engine, funcptr, batchptr, &_stats);
+				_funcptr = (FuncType*) funcptr;
+				_batchptr = (BatchFuncType*) batchptr;
+			}
+
+			llvm::Function* cached_entrypoint(const char* name)
+			{
+				llvm::FunctionType* ft = llvm::FunctionType::get(
+						llvm::Type::getVoidTy(*_context), false);
+				llvm::Function* f = llvm::Function::Create(ft,
+						llvm::Function::ExternalLinkage, name, _module);
+
+				llvm::IRBuilder<> builder(llvm::BasicBlock::Create(*_context, "", f));
+				builder.CreateRetVoid();
+				return f;
 			}
 
 		private:
 
-			void generate_machine_code()
+			void generate_machine_code(llvm::Module* module,
+					const CompileOptions& compileoptions, CompileStats* stats)
 			{
-				//_module->dump();
-				llvm::verifyFunction(*_function);
+				//module->dump();
+				vector<llvm::Function*> functions;
+				functions.push_back(_function);
+				if (_batchfunction)
+					functions.push_back(_batchfunction);
 
-				llvm::FunctionPassManager fpm(_module);
-				llvm::PassManager mpm;
-				llvm::PassManagerBuilder pmb;
-				pmb.OptLevel = 3;
-				pmb.populateFunctionPassManager(fpm);
+				Impl::optimise(module, functions, compileoptions, stats);
+			}
 
-				pmb.Inliner = llvm::createFunctionInliningPass(275);
-				pmb.populateModulePassManager(mpm);
+			/* Generates machine code for _function and _batchfunction (and
+			 * anything they call) with the given engine. A promoted module
+			 * has an engine of its own, which frees its code, so only code
+			 * from _engine is remembered for release(). */
 
-				fpm.doInitialization();
-				fpm.run(*_function);
-				mpm.run(*_module);
+			void emit_machine_code(llvm::Module* module,
+					llvm::ExecutionEngine* engine, void*& funcptr,
+					void*& batchptr, CompileStats* stats)
+			{
+				CompileStats::Timer timer(stats, "emit");
+				Impl::CodeSizeListener listener;
+				engine->RegisterJITEventListener(&listener);
+
+				/* MCJIT generates all the code up front. */
+
+				if (_cache.get())
+					engine->finalizeObject();
+
+				if (engine == _engine)
+					for (llvm::Module::iterator i = module->begin(),
+							e = module->end(); i != e; i++)
+					{
+						if (!i->isDeclaration())
+							_compiled.push_back(i);
+					}
+
+				funcptr = engine->getPointerToFunction(_function);
+				assert(funcptr);
 
-				_funcptr = (FuncType*) _engine->getPointerToFunction(_function);
-				assert(_funcptr);
+				batchptr = NULL;
+				if (_batchfunction)
+				{
+					batchptr = engine->getPointerToFunction(_batchfunction);
+					assert(batchptr);
+				}
+
+				engine->UnregisterJITEventListener(&listener);
+				_codesize += listener.size;
 			}
 		};
+
+		#include "calculon_grid.h"
+		#include "calculon_library.h"
+		#include "calculon_aot.h"
+
+#if defined(CALCULON_THREADS)
+	public:
+		#include "calculon_threads.h"
+		#include "calculon_executor.h"
+#endif
 	};
 }
 
@@ -0,0 +1,264 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_AOT_H
+#define CALCULON_AOT_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Compiles scripts ahead of time into a relocatable (position independent)
+ * object file, which can be linked into a program or a shared library that
+ * doesn't use LLVM at all. Each script becomes a C function with the name
+ * you give it and exactly the same ABI as the entrypoint of the equivalent
+ * Program; libraries contribute all their exports, under their own names.
+ *
+ * External functions registered in the symbol table are called by their
+ * registered names, so whatever the object is linked with must provide
+ * them; write() also produces a manifest listing every symbol the object
+ * needs. Global variables are baked into the code as constants.
+ *
+ * The code is generated for the CPU selected by the CompileOptions, so pick
+ * an instruction set (or a cpu) which suits wherever the object is going to
+ * be deployed rather than Native. There are no batch functions. */
+
+class ObjectCompiler
+{
+	SymbolTable& _symbols;
+	CompileOptions _options;
+	llvm::LLVMContext _context;
+	auto_ptr<llvm::Module> _module;
+	auto_ptr<llvm::TargetMachine> _target;
+	vector<llvm::Function*> _entrypoints;
+	map<string, ExternalFunctionSymbol*> _externals;
+
+public:
+	ObjectCompiler(SymbolTable& symbols,
+				const CompileOptions& options = CompileOptions()):
+			_symbols(symbols),
+			_options(options)
+	{
+		Calculon::initialize();
+
+		_module.reset(new llvm::Module("Calculon Object", _context));
+
+		/* Use the same target machine as the JIT would, except that the
+		 * code has to work in a shared library. */
+
+		llvm::EngineBuilder builder(_module.get());
+		Session::configure(builder, _options);
+		builder
+			.setRelocationModel(llvm::Reloc::PIC_)
+			.setCodeModel(llvm::CodeModel::Default);
+		_target.reset(builder.selectTarget());
+		if (!_target.get())
+			throw CompilationException("no target machine for this host");
+
+		_module->setTargetTriple(_target->getTargetTriple());
+		_module->setDataLayout(
+				_target->getDataLayout()->getStringRepresentation());
+	}
+
+	/* Adds a script whose entrypoint will be called name. */
+
+	void addProgram(const string& name, std::istream& code,
+			const string& signature,
+			const map<string, string>& typealiases = map<string, string>())
+	{
+		Compiler compiler(_context, _module.get(), NULL, typealiases);
+
+		std::istringstream signaturestream(signature);
+		ToplevelSymbol* f = compiler.compile(signaturestream, code, &_symbols);
+		export_function(f->function, name);
+	}
+
+	void addProgram(const string& name, const string& code,
+			const string& signature,
+			const map<string, string>& typealiases = map<string, string>())
+	{
+		std::istringstream stream(code);
+		addProgram(name, stream, signature, typealiases);
+	}
+
+	/* Adds all the exports of a library script (see Library). */
+
+	void addLibrary(std::istream& code,
+			const map<string, string>& typealiases = map<string, string>())
+	{
+		Compiler compiler(_context, _module.get(), NULL, typealiases);
+
+		vector<ToplevelSymbol*> exports = compiler.compileLibrary(code,
+				&_symbols);
+		for (typename vector<ToplevelSymbol*>::const_iterator i = exports.begin(),
+				e = exports.end(); i != e; i++)
+			export_function((*i)->function, (*i)->name);
+	}
+
+	void addLibrary(const string& code,
+			const map<string, string>& typealiases = map<string, string>())
+	{
+		std::istringstream stream(code);
+		addLibrary(stream, typealiases);
+	}
+
+	void dump()
+	{
+		_module->dump();
+	}
+
+	/* Optimises everything, writes the object file to objectstream and the
+	 * manifest to manifeststream. The manifest has one line for each
+	 * undefined symbol in the object: its name, followed by its Calculon
+	 * signature if it's a registered external function. (The rest will be
+	 * things like libm functions.) This can only be done once. */
+
+	void write(std::ostream& objectstream, std::ostream& manifeststream)
+	{
+		if (_entrypoints.empty())
+			throw CompilationException("there's nothing to compile");
+
+		optimise();
+
+		llvm::SmallVector<char, 4096> buffer;
+		{
+			llvm::raw_svector_ostream os(buffer);
+			llvm::formatted_raw_ostream fos(os);
+
+			llvm::PassManager pm;
+			pm.add(new llvm::DataLayout(*_target->getDataLayout()));
+			if (_target->addPassesToEmitFile(pm, fos,
+					llvm::TargetMachine::CGFT_ObjectFile))
+				throw CompilationException("this target can't write object files");
+			pm.run(*_module);
+		}
+
+		objectstream.write(buffer.data(), buffer.size());
+		write_manifest(buffer, manifeststream);
+		_entrypoints.clear();
+	}
+
+private:
+	/* Entrypoints have to keep the names they're given, as that's how
+	 * they'll be linked to. */
+
+	void export_function(llvm::Function* f, const string& name)
+	{
+		f->setName(name);
+		if (f->getName() != name)
+		{
+			std::stringstream s;
+			s << "there's already something called '" << name
+			  << "' in this object file";
+			throw CompilationException(s.str());
+		}
+
+		_entrypoints.push_back(f);
+	}
+
+	/* Calls to registered external functions go through declarations with
+	 * mangled names (see ExternalFunctionSymbol), which the JIT maps to
+	 * addresses. Here they're linked by name instead. */
+
+	void link_externals()
+	{
+		string prefix = ExternalFunctionSymbol::mangledName("");
+
+		vector<llvm::Function*> declarations;
+		for (llvm::Module::iterator i = _module->begin(),
+				e = _module->end(); i != e; i++)
+		{
+			if (i->isDeclaration() &&
+					i->getName().startswith(prefix))
+				declarations.push_back(i);
+		}
+
+		for (typename vector<llvm::Function*>::const_iterator i = declarations.begin(),
+				e = declarations.end(); i != e; i++)
+		{
+			llvm::Function* f = *i;
+			string name = f->getName().substr(prefix.size()).str();
+
+			Symbol* symbol = _symbols.resolve(name);
+			if (symbol && symbol->isExternalFunction())
+				_externals[name] = symbol->isExternalFunction();
+
+			/* Something else (probably an intrinsic) may have already
+			 * declared a function with that name. */
+
+			llvm::Function* existing = _module->getFunction(name);
+			if (existing)
+			{
+				f->replaceAllUsesWith(
+						llvm::ConstantExpr::getBitCast(existing, f->getType()));
+				f->eraseFromParent();
+			}
+			else
+				f->setName(name);
+		}
+	}
+
+	void optimise()
+	{
+		link_externals();
+		Impl::optimise(_module.get(), _entrypoints, _options, NULL);
+	}
+
+	void write_manifest(const llvm::SmallVectorImpl<char>& buffer,
+			std::ostream& s)
+	{
+		auto_ptr<llvm::object::ObjectFile> object(
+				llvm::object::ObjectFile::createObjectFile(
+					llvm::MemoryBuffer::getMemBuffer(
+						llvm::StringRef(buffer.data(), buffer.size()),
+						"", false)));
+		if (!object.get())
+			throw CompilationException("couldn't read back the object file");
+
+		set<string> names;
+		llvm::error_code ec;
+		for (llvm::object::symbol_iterator i = object->begin_symbols(),
+				e = object->end_symbols(); i != e; i.increment(ec))
+		{
+			if (ec)
+				throw CompilationException(ec.message());
+
+			uint32_t flags;
+			llvm::StringRef name;
+			if (i->getFlags(flags) || i->getName(name))
+				throw CompilationException("couldn't read the object's symbols");
+
+			if ((flags & llvm::object::SymbolRef::SF_Undefined) &&
+					!name.empty())
+				names.insert(name.str());
+		}
+
+		for (set<string>::const_iterator i = names.begin(),
+				e = names.end(); i != e; i++)
+		{
+			s << *i;
+
+			/* Some platforms put an underscore in front of C symbols. */
+
+			typename map<string, ExternalFunctionSymbol*>::const_iterator
+					external = _externals.find(*i);
+			if ((external == _externals.end()) && ((*i)[0] == '_'))
+				external = _externals.find(i->substr(1));
+
+			if (external != _externals.end())
+			{
+				s << " ";
+				external->second->describe(s, false);
+			}
+			else
+				s << "\n";
+		}
+	}
+
+	ObjectCompiler(const ObjectCompiler&);
+	ObjectCompiler& operator = (const ObjectCompiler&);
+};
+
+#endif
@@ -11,6 +11,7 @@
 #endif
 
 class ASTFrame;
+struct ASTConstant;
 
 struct ASTNode : public Object
 {
@@ -29,6 +30,11 @@ struct ASTNode : public Object
 
 	virtual llvm::Value* codegen(Compiler& compiler) = 0;
 
+	virtual ASTConstant* isConstant()
+	{
+		return NULL;
+	}
+
 	llvm::Value* codegen_to_type(Compiler& compiler, Type* type)
 	{
 		llvm::Value* v = codegen(compiler);
@@ -54,6 +60,34 @@ struct ASTNode : public Object
 		return codegen_to_type(compiler, compiler.booleanType);
 	}
 
+	/* v is the value this node generated. Numbers in scripts are always
+	 * reals, but a literal with a whole value in range can stand in for an
+	 * int (this is what makes 'n + 1' work); if this node is one, it's
+	 * returned as an int. Anything else is returned unchanged, even if it
+	 * happens to be constant. */
+
+	virtual llvm::Value* convertConstantToInt(Compiler& compiler,
+			llvm::Value* v)
+	{
+		return v;
+	}
+
+	/* If any of the values is an int, or a vector of ints, literals among
+	 * the nodes which generated the others are converted to ints too. */
+
+	static void convertConstantsToInt(Compiler& compiler,
+			const vector<ASTNode*>& nodes, vector<llvm::Value*>& values)
+	{
+		bool integer = false;
+		for (unsigned i = 0; i < values.size(); i++)
+			integer = integer ||
+					values[i]->getType()->getScalarType()->isIntegerTy(32);
+
+		if (integer)
+			for (unsigned i = 0; i < values.size(); i++)
+				values[i] = nodes[i]->convertConstantToInt(compiler, values[i]);
+	}
+
 	virtual void resolveVariables(Compiler& compiler)
 	{
 	}
@@ -79,10 +113,25 @@ struct ASTConstant : public ASTNode
 	{
 	}
 
+	ASTConstant* isConstant()
+	{
+		return this;
+	}
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
 		return llvm::ConstantFP::get(compiler.realType->llvm, value);
 	}
+
+	llvm::Value* convertConstantToInt(Compiler& compiler, llvm::Value* v)
+	{
+		if ((value != floor(value)) ||
+				(value < -2147483648.0) || (value > 2147483647.0))
+			return v;
+
+		return llvm::ConstantInt::get(compiler.integerType->llvm,
+				(uint64_t) (int64_t) value, true);
+	}
 };
 
 struct ASTBoolean : public ASTNode
@@ -144,10 +193,12 @@ struct ASTVariable : public ASTNode
 	}
 };
 
+/* A vector literal is a vector of ints if any of its elements is an int,
+ * and of reals otherwise. */
+
 struct ASTVector : public ASTNode
 {
 	vector<ASTNode*> elements;
-	string typenm;
 
 	ASTVector(const Position& position, const vector<ASTNode*>& elements):
 		ASTNode(position),
@@ -155,21 +206,35 @@ struct ASTVector : public ASTNode
 	{
 		for (unsigned i = 0; i < elements.size(); i++)
 			elements[i]->parent = this;
-
-		std::stringstream s;
-		s << "vector*" << elements.size();
-		typenm = s.str();
 	}
 
 	llvm::Value* codegen(Compiler& compiler)
 	{
-		VectorType* type = compiler.types->find(typenm)->asVector();
+		vector<llvm::Value*> values;
+		for (unsigned i = 0; i < elements.size(); i++)
+			values.push_back(elements[i]->codegen(compiler));
+		convertConstantsToInt(compiler, elements, values);
+
+		bool integer = false;
+		for (unsigned i = 0; i < values.size(); i++)
+			integer = integer || (values[i]->getType() == compiler.integerType->llvm);
+
+		std::stringstream typenm;
+		typenm << (integer ? "int*" : "vector*") << elements.size();
+		VectorType* type = compiler.types->find(typenm.str())->asVector();
 		llvm::Value* v = llvm::UndefValue::get(type->llvm);
 
-		for (unsigned i = 0; i < elements.size(); i++)
+		for (unsigned i = 0; i < values.size(); i++)
 		{
-			llvm::Value* e = elements[i]->codegen_to_real(compiler);
-			v = type->setElement(v, i, e);
+			Type* t = compiler.types->find(values[i]->getType());
+			if (!t->equals(type->element))
+			{
+				std::stringstream s;
+				s << "type mismatch: expected a " << type->element->name
+				  << ", but got a " << t->name;
+				throw TypeException(s.str(), elements[i]);
+			}
+			v = type->setElement(v, i, values[i]);
 		}
 
 		return v;
@@ -186,7 +251,6 @@ struct ASTVectorSplat : public ASTNode
 {
 	ASTNode* value;
 	unsigned size;
-	string typenm;
 
 	ASTVectorSplat(const Position& position, ASTNode* value, unsigned size):
 		ASTNode(position),
@@ -194,18 +258,26 @@ struct ASTVectorSplat : public ASTNode
 		size(size)
 	{
 		value->parent = this;
-
-		std::stringstream s;
-		s << "vector*" << size;
-		typenm = s.str();
 	}
 
 	llvm::Value* codegen(Compiler& compiler)
 	{
-		VectorType* type = compiler.types->find(typenm)->asVector();
+		llvm::Value* e = value->codegen(compiler);
+		bool integer = (e->getType() == compiler.integerType->llvm);
+		if (!integer && !compiler.types->find(e->getType())->equals(
+				compiler.realType))
+		{
+			std::stringstream s;
+			s << "type mismatch: expected a real or int, but got a "
+			  << compiler.types->find(e->getType())->name;
+			throw TypeException(s.str(), value);
+		}
+
+		std::stringstream typenm;
+		typenm << (integer ? "int*" : "vector*") << size;
+		VectorType* type = compiler.types->find(typenm.str())->asVector();
 		llvm::Value* v = llvm::UndefValue::get(type->llvm);
 
-		llvm::Value* e = value->codegen_to_real(compiler);
 		for (unsigned i = 0; i < size; i++)
 			v = type->setElement(v, i, e);
 
@@ -273,8 +345,10 @@ struct ASTDefineVariable : public ASTFrame
 
 	llvm::Value* codegen(Compiler& compiler)
 	{
+		FunctionSymbol* tailfunction = compiler.tailFunction;
+		compiler.tailFunction = NULL;
 		llvm::Value* v = value->codegen(compiler);
-		_symbol->value = v;
+		compiler.tailFunction = tailfunction;
 
 		if (!v)
 		{
@@ -283,6 +357,10 @@ struct ASTDefineVariable : public ASTFrame
 			throw TypeException(s.str(), this);
 		}
 
+		if (type && type->isInteger())
+			v = value->convertConstantToInt(compiler, v);
+		_symbol->value = v;
+
 		if (!type)
 		{
 			/* Now we have a value for this variable, we can find out what
@@ -352,6 +430,7 @@ struct ASTFunctionBody : public ASTFrame
 
 		const vector<VariableSymbol*>& arguments = function->arguments;
 		vector<llvm::Type*> llvmtypes;
+		llvm::Value* mask = NULL;
 
 		/* Normal parameters... */
 
@@ -374,6 +453,11 @@ struct ASTFunctionBody : public ASTFrame
 			}
 		}
 
+		/* ...and, in lane-parallel code, the mask of live lanes. */
+
+		if (compiler.lanes > 1)
+			llvmtypes.push_back(compiler.booleanType->llvm);
+
 		llvm::Type* returntype = function->returntype->llvm;
 		llvm::FunctionType* ft = llvm::FunctionType::get(
 				returntype, llvmtypes, false);
@@ -423,6 +507,14 @@ struct ASTFunctionBody : public ASTFrame
 				li++;
 			}
 
+			if (compiler.lanes > 1)
+			{
+				assert(vi != f->arg_end());
+				vi->setName("mask");
+				mask = vi;
+				vi++;
+			}
+
 			assert(vi == f->arg_end());
 		}
 
@@ -435,8 +527,114 @@ struct ASTFunctionBody : public ASTFrame
 		llvm::BasicBlock::iterator bi = compiler.builder.GetInsertPoint();
 		compiler.builder.SetInsertPoint(toplevel);
 
+		if (compiler.lanes > 1)
+			codegen_lanes(compiler, f, mask);
+		else
+		{
+			llvm::Value* v = body->codegen(compiler);
+			compiler.builder.CreateRet(v);
+			checkReturnType(compiler, v);
+		}
+
+		compiler.builder.SetInsertPoint(bb, bi);
+
+		return f;
+	}
+
+	/* In lane-parallel code a function evaluates all the live lanes at
+	 * once. Tail calls back to the function itself don't recurse; instead
+	 * the body is wrapped in a loop, and lanes which made a tail call go
+	 * round again with their new arguments until every lane has produced
+	 * a result. */
+
+	void codegen_lanes(Compiler& compiler, llvm::Function* f, llvm::Value* mask)
+	{
+		const vector<VariableSymbol*>& arguments = function->arguments;
+		llvm::Type* returntype = function->returntype->llvm;
+		llvm::Type* masktype = compiler.booleanType->llvm;
+
+		llvm::BasicBlock* entryblock = compiler.builder.GetInsertBlock();
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(
+				compiler.context, "loop", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(
+				compiler.context, "exit", f);
+
+		/* If no lanes are live, don't do anything at all; this is what
+		 * stops ordinary recursion from running forever. */
+
+		compiler.builder.CreateCondBr(compiler.anyLane(mask),
+				loopblock, exitblock);
+
+		compiler.builder.SetInsertPoint(loopblock);
+		llvm::PHINode* live = compiler.builder.CreatePHI(masktype, 2);
+		live->addIncoming(mask, entryblock);
+		llvm::PHINode* result = compiler.builder.CreatePHI(returntype, 2);
+		result->addIncoming(llvm::UndefValue::get(returntype), entryblock);
+
+		vector<llvm::PHINode*> phis;
+		for (typename vector<VariableSymbol*>::const_iterator i = arguments.begin(),
+				e = arguments.end(); i != e; i++)
+		{
+			VariableSymbol* symbol = *i;
+			llvm::PHINode* phi = compiler.builder.CreatePHI(
+					symbol->value->getType(), 2);
+			phi->addIncoming(symbol->value, entryblock);
+			symbol->value = phi;
+			phis.push_back(phi);
+		}
+
+		llvm::Value* oldmask = compiler.mask;
+		FunctionSymbol* oldtailfunction = compiler.tailFunction;
+		vector<TailCall>* oldtailcalls = compiler.tailCalls;
+
+		vector<TailCall> tailcalls;
+		compiler.mask = live;
+		compiler.tailFunction = function;
+		compiler.tailCalls = &tailcalls;
+
 		llvm::Value* v = body->codegen(compiler);
-		compiler.builder.CreateRet(v);
+
+		compiler.mask = oldmask;
+		compiler.tailFunction = oldtailfunction;
+		compiler.tailCalls = oldtailcalls;
+		checkReturnType(compiler, v);
+
+		/* Work out which lanes want to go round again, and with what. */
+
+		llvm::Value* again = llvm::ConstantInt::getFalse(masktype);
+		vector<llvm::Value*> next(phis.begin(), phis.end());
+		for (typename vector<TailCall>::const_iterator i = tailcalls.begin(),
+				e = tailcalls.end(); i != e; i++)
+		{
+			again = compiler.builder.CreateOr(again, i->mask);
+			for (unsigned j = 0; j < next.size(); j++)
+				next[j] = compiler.builder.CreateSelect(i->mask,
+						i->arguments[j], next[j]);
+		}
+
+		llvm::Value* finished = compiler.builder.CreateAnd(live,
+				compiler.builder.CreateNot(again));
+		llvm::Value* r = compiler.builder.CreateSelect(finished, v, result);
+
+		llvm::BasicBlock* latchblock = compiler.builder.GetInsertBlock();
+		live->addIncoming(again, latchblock);
+		result->addIncoming(r, latchblock);
+		for (unsigned j = 0; j < phis.size(); j++)
+			phis[j]->addIncoming(next[j], latchblock);
+
+		compiler.builder.CreateCondBr(compiler.anyLane(again),
+				loopblock, exitblock);
+
+		compiler.builder.SetInsertPoint(exitblock);
+		llvm::PHINode* retval = compiler.builder.CreatePHI(returntype, 2);
+		retval->addIncoming(llvm::UndefValue::get(returntype), entryblock);
+		retval->addIncoming(r, latchblock);
+		compiler.builder.CreateRet(retval);
+	}
+
+	void checkReturnType(Compiler& compiler, llvm::Value* v)
+	{
+		llvm::Type* returntype = function->returntype->llvm;
 		if (v->getType() != returntype)
 		{
 			std::stringstream s;
@@ -447,10 +645,6 @@ struct ASTFunctionBody : public ASTFrame
 
 			throw TypeException(s.str(), this);
 		}
-
-		compiler.builder.SetInsertPoint(bb, bi);
-
-		return f;
 	}
 };
 
@@ -491,6 +685,90 @@ struct ASTToplevel : public ASTFunctionBody
 	}
 };
 
+/* The root of a library script. The function definitions are scoped like a
+ * chain of 'let's, with the exports inside the innermost one; each export is
+ * a toplevel function of its own, and the definitions have no enclosing
+ * function, so they can't refer to any of the exports' variables. */
+
+struct ASTLibrary : public ASTFrame
+{
+	vector<ASTFunctionBody*> definitions;
+	vector<ASTToplevel*> exports;
+
+	using ASTFrame::symbolTable;
+
+	ASTLibrary(const Position& position, SymbolTable* st):
+		ASTFrame(position)
+	{
+		symbolTable = st;
+	}
+
+	void addDefinition(ASTFunctionBody* definition)
+	{
+		definition->parent = this;
+		definitions.push_back(definition);
+	}
+
+	void addExport(ASTToplevel* toplevel)
+	{
+		toplevel->parent = this;
+		exports.push_back(toplevel);
+	}
+
+	FunctionSymbol* getFunction()
+	{
+		return NULL;
+	}
+
+	void resolveVariables(Compiler& compiler)
+	{
+		for (typename vector<ASTFunctionBody*>::const_iterator i = definitions.begin(),
+				e = definitions.end(); i != e; i++)
+		{
+			ASTFunctionBody* definition = *i;
+			symbolTable = compiler.retain(new SingletonSymbolTable(symbolTable));
+			symbolTable->add(definition->function);
+			definition->resolveVariables(compiler);
+		}
+
+		for (typename vector<ASTToplevel*>::const_iterator i = exports.begin(),
+				e = exports.end(); i != e; i++)
+		{
+			ASTToplevel* toplevel = *i;
+			toplevel->symbolTable = compiler.retain(
+					new MultipleSymbolTable(symbolTable));
+
+			const vector<VariableSymbol*>& arguments = toplevel->toplevel->arguments;
+			for (typename vector<VariableSymbol*>::const_iterator j = arguments.begin(),
+					je = arguments.end(); j != je; j++)
+				toplevel->symbolTable->add(*j);
+
+			toplevel->resolveVariables(compiler);
+		}
+	}
+
+	llvm::Value* codegen(Compiler& compiler)
+	{
+		for (typename vector<ASTFunctionBody*>::const_iterator i = definitions.begin(),
+				e = definitions.end(); i != e; i++)
+			(*i)->codegen(compiler);
+
+		/* The entrypoints' parameters have already been marshalled (see
+		 * Compiler::compileLibrary()); carry on from there. */
+
+		for (typename vector<ASTToplevel*>::const_iterator i = exports.begin(),
+				e = exports.end(); i != e; i++)
+		{
+			ASTToplevel* toplevel = *i;
+			compiler.builder.SetInsertPoint(
+					&toplevel->toplevel->function->getEntryBlock());
+			toplevel->codegen(compiler);
+		}
+
+		return NULL;
+	}
+};
+
 struct ASTReturn : public ASTNode
 {
 	using ASTNode::position;
@@ -540,6 +818,15 @@ struct ASTReturn : public ASTNode
 			}
 
 			llvm::Value* value = insym->isValued()->emitValue(compiler);
+			if (value->getType() != outsym->type->llvm)
+			{
+				std::stringstream s;
+				s << "output value '" << outsym->name << "' should be a "
+				  << outsym->type->name << " but is a "
+				  << compiler.types->find(value->getType())->name;
+				throw CompilationException(position.formatError(s.str()));
+			}
+
 			if (outsym->type->asVector())
 				outsym->type->asVector()->storeToArray(value, ptr);
 			else
@@ -649,7 +936,10 @@ struct ASTFunctionCall : public ASTNode
 	{
 		function->checkParameterCount(compiler, arguments.size());
 
-		/* Formal parameters. */
+		/* Formal parameters. (None of which are in tail position.) */
+
+		FunctionSymbol* tailfunction = compiler.tailFunction;
+		compiler.tailFunction = NULL;
 
 		vector<llvm::Value*> parameters;
 		for (typename vector<ASTNode*>::const_iterator i = arguments.begin(),
@@ -659,9 +949,44 @@ struct ASTFunctionCall : public ASTNode
 			parameters.push_back(v);
 		}
 
-		/* ...followed by imported upvalues. */
+		compiler.tailFunction = tailfunction;
+
+		/* Literals can be passed to int parameters, and used on the other
+		 * side of an operator from an int. */
 
 		FunctionSymbol* callee = function->isFunction();
+		if (callee)
+		{
+			for (unsigned i = 0; i < parameters.size(); i++)
+				if (callee->arguments[i]->type->isInteger())
+					parameters[i] = arguments[i]->convertConstantToInt(compiler,
+							parameters[i]);
+		}
+		else if (function->convertsConstants())
+			convertConstantsToInt(compiler, arguments, parameters);
+
+		/* In lane-parallel code, a tail call to the function we're in gets
+		 * turned into another trip round its loop (see
+		 * ASTFunctionBody::codegen_lanes()). Upvalues can't change, so
+		 * only the formal parameters are needed. */
+
+		if (callee && (callee == tailfunction))
+		{
+			compiler.position = position;
+			for (unsigned i = 0; i < parameters.size(); i++)
+				function->typeCheckParameter(compiler, i+1, parameters[i],
+						callee->arguments[i]->type);
+
+			TailCall tailcall;
+			tailcall.mask = compiler.mask;
+			tailcall.arguments = parameters;
+			compiler.tailCalls->push_back(tailcall);
+
+			return llvm::UndefValue::get(callee->returntype->llvm);
+		}
+
+		/* ...followed by imported upvalues. */
+
 		if (callee)
 		{
 			FunctionSymbol* caller = getFunction();
@@ -675,6 +1000,11 @@ struct ASTFunctionCall : public ASTNode
 					parameters.push_back(s->value);
 				}
 			}
+
+			/* ...and the live lanes. */
+
+			if (compiler.lanes > 1)
+				parameters.push_back(compiler.mask);
 		}
 
 		compiler.position = position;
@@ -705,8 +1035,36 @@ struct ASTCondition : public ASTNode
 		falseval->resolveVariables(compiler);
 	}
 
+	/* Both sides must be the same type, except that a literal can stand
+	 * in for an int. */
+
+	void unify(Compiler& compiler, llvm::Value*& trueresult,
+			llvm::Value*& falseresult)
+	{
+		vector<ASTNode*> nodes;
+		nodes.push_back(trueval);
+		nodes.push_back(falseval);
+
+		vector<llvm::Value*> values;
+		values.push_back(trueresult);
+		values.push_back(falseresult);
+		convertConstantsToInt(compiler, nodes, values);
+		trueresult = values[0];
+		falseresult = values[1];
+
+		if (trueresult->getType() != falseresult->getType())
+		{
+			std::stringstream s;
+			s << "the true and false value of a conditional must be the same type";
+			throw CompilationException(position.formatError(s.str()));
+		}
+	}
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
+		if (compiler.lanes > 1)
+			return codegen_lanes(compiler);
+
 		llvm::Value* cv = condition->codegen_to_boolean(compiler);
 
 		llvm::BasicBlock* bb = compiler.builder.GetInsertBlock();
@@ -737,12 +1095,7 @@ struct ASTCondition : public ASTNode
 			throw CompilationException(position.formatError(s.str()));
 		}
 
-		if (trueresult->getType() != falseresult->getType())
-		{
-			std::stringstream s;
-			s << "the true and false value of a conditional must be the same type";
-			throw CompilationException(position.formatError(s.str()));
-		}
+		unify(compiler, trueresult, falseresult);
 
 		compiler.builder.SetInsertPoint(mergeblock);
 		llvm::PHINode* phi = compiler.builder.CreatePHI(trueresult->getType(), 2);
@@ -750,6 +1103,37 @@ struct ASTCondition : public ASTNode
 		phi->addIncoming(falseresult, falseblock);
 		return phi;
 	}
+
+	/* Lanes may disagree about which way to go, so in lane-parallel code
+	 * both sides are evaluated (each with only its own lanes live) and the
+	 * results are merged. */
+
+	llvm::Value* codegen_lanes(Compiler& compiler)
+	{
+		FunctionSymbol* tailfunction = compiler.tailFunction;
+		compiler.tailFunction = NULL;
+		llvm::Value* cv = condition->codegen_to_boolean(compiler);
+		compiler.tailFunction = tailfunction;
+
+		llvm::Value* mask = compiler.mask;
+		compiler.mask = compiler.builder.CreateAnd(mask, cv);
+		llvm::Value* trueresult = trueval->codegen(compiler);
+		compiler.mask = compiler.builder.CreateAnd(mask,
+				compiler.builder.CreateNot(cv));
+		llvm::Value* falseresult = falseval->codegen(compiler);
+		compiler.mask = mask;
+
+		if (!trueresult || !falseresult)
+		{
+			std::stringstream s;
+			s << "you can't use 'return' inside conditionals";
+			throw CompilationException(position.formatError(s.str()));
+		}
+
+		unify(compiler, trueresult, falseresult);
+
+		return compiler.builder.CreateSelect(cv, trueresult, falseresult);
+	}
 };
 
 
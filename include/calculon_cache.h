@@ -0,0 +1,157 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_CACHE_H
+#define CALCULON_CACHE_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Stores compiled object code on disk, so that compiling the same script
+ * again later (typically in another process) can skip straight to loading
+ * the machine code. Each cache file is named after a hash of the key, which
+ * is a description of everything which went into the compilation; the key
+ * itself is stored at the top of the file so that hash collisions are
+ * detected rather than loading the wrong code. */
+
+class ObjectFileCache : public llvm::ObjectCache
+{
+	string _key;
+	string _filename;
+	auto_ptr<llvm::MemoryBuffer> _object;
+
+	static const char* magic()
+	{
+		return "calculon-object-1\n";
+	}
+
+public:
+	ObjectFileCache(const string& directory, const string& key):
+		_key(key)
+	{
+		/* 64-bit FNV-1a. */
+
+		uint64_t hash = 14695981039346656037ULL;
+		for (string::const_iterator i = key.begin(), e = key.end(); i != e; i++)
+		{
+			hash ^= (unsigned char) *i;
+			hash *= 1099511628211ULL;
+		}
+
+		std::stringstream s;
+		s << directory << "/" << std::hex;
+		s.width(16);
+		s.fill('0');
+		s << hash << ".o";
+		_filename = s.str();
+
+		load();
+	}
+
+	/* Returns true if we have object code for this key. */
+
+	bool hit() const
+	{
+		return _object.get() != NULL;
+	}
+
+	void notifyObjectCompiled(const llvm::Module* module,
+			const llvm::MemoryBuffer* object)
+	{
+		/* Write to a temporary file and rename it into place, so that
+		 * other processes never see a partial file. */
+
+		std::stringstream tmp;
+		tmp << _filename << "." << llvm::sys::Process::GetRandomNumber() << ".tmp";
+		string tmpname = tmp.str();
+
+		{
+			std::ofstream f(tmpname.c_str(), std::ios::out | std::ios::binary);
+			f << magic() << _key.size() << "\n" << _key;
+			f.write(object->getBufferStart(), object->getBufferSize());
+			if (!f)
+			{
+				std::remove(tmpname.c_str());
+				return;
+			}
+		}
+
+		if (std::rename(tmpname.c_str(), _filename.c_str()) != 0)
+			std::remove(tmpname.c_str());
+	}
+
+protected:
+	const llvm::MemoryBuffer* getObject(const llvm::Module* module)
+	{
+		return _object.get();
+	}
+
+private:
+	/* Anything wrong with the file is treated as a miss; it'll be replaced
+	 * once the script has been compiled. */
+
+	void load()
+	{
+		std::ifstream f(_filename.c_str(), std::ios::in | std::ios::binary);
+		if (!f)
+			return;
+
+		string m(strlen(magic()), '\0');
+		f.read(&m[0], m.size());
+		if (!f || (m != magic()))
+			return;
+
+		size_t keysize;
+		f >> keysize;
+		if (!f || (f.get() != '\n') || (keysize != _key.size()))
+			return;
+
+		string key(keysize, '\0');
+		f.read(&key[0], keysize);
+		if (!f || (key != _key))
+			return;
+
+		string data((std::istreambuf_iterator<char>(f)),
+				std::istreambuf_iterator<char>());
+		if (data.empty())
+			return;
+
+		_object.reset(llvm::MemoryBuffer::getMemBufferCopy(data, _filename));
+	}
+};
+
+/* MCJIT resolves undefined symbols in the object code by name. External
+ * functions registered in the symbol table are looked up there; anything
+ * else (such as the C library functions) is left to LLVM. */
+
+class CacheMemoryManager : public llvm::SectionMemoryManager
+{
+	SymbolTable& _symbols;
+
+public:
+	CacheMemoryManager(SymbolTable& symbols):
+		_symbols(symbols)
+	{
+	}
+
+	void* getPointerToNamedFunction(const std::string& name,
+			bool abortOnFailure = true)
+	{
+		string prefix = ExternalFunctionSymbol::mangledName("");
+		string::size_type i = name.find(prefix);
+		if (i != string::npos)
+		{
+			Symbol* symbol = _symbols.resolve(name.substr(i + prefix.size()));
+			if (symbol && symbol->isExternalFunction())
+				return symbol->isExternalFunction()->getPointer();
+		}
+
+		return llvm::SectionMemoryManager::getPointerToNamedFunction(name,
+				abortOnFailure);
+	}
+};
+
+#endif
@@ -16,140 +16,1876 @@ public:
 	using CompilerState::builder;
 	using CompilerState::module;
 	using CompilerState::context;
+	using CompilerState::engine;
+	using CompilerState::lanes;
+	using CompilerState::stats;
+
+	/* Lane-parallel code generation state: the set of lanes which are
+	 * live at the current point in the code, the function whose body is
+	 * being generated if we're in tail position, and the tail calls found
+	 * there so far. */
+
+	struct TailCall
+	{
+		llvm::Value* mask;
+		vector<llvm::Value*> arguments;
+	};
+
+	llvm::Value* mask;
+	FunctionSymbol* tailFunction;
+	vector<TailCall>* tailCalls;
 
 private:
 	class ASTNode;
 	class ASTVariable;
 
-	typedef Lexer L;
-	typedef pair<string, char> Argument;
+	typedef Lexer L;
+	typedef pair<string, char> Argument;
+
+	using CompilerState::retain;
+	using CompilerState::types;
+	using CompilerState::intType;
+public:
+	using CompilerState::realType;
+	using CompilerState::doubleType;
+	using CompilerState::floatType;
+	using CompilerState::booleanType;
+	using CompilerState::integerType;
+private:
+
+	map<string, int> _operatorPrecedence;
+	TypeRegistry _typeRegistry;
+
+	class TypeException : public CompilationException
+	{
+	public:
+		TypeException(const string& what, ASTNode* node):
+			CompilationException(node->position.formatError(what))
+		{
+		}
+	};
+
+	class SymbolException : public CompilationException
+	{
+		static string formatError(const string& id, ASTNode* node)
+		{
+			std::stringstream s;
+			s << "unresolved symbol '" << id << "'";
+			return node->position.formatError(s.str());
+		}
+
+	public:
+		SymbolException(const string& id, ASTNode* node):
+			CompilationException(formatError(id, node))
+		{
+		}
+	};
+
+	class OperatorException : public CompilationException
+	{
+		static string formatError(const string& id, ASTNode* node)
+		{
+			std::stringstream s;
+			s << "unknown operator '" << id << "'";
+			return node->position.formatError(s.str());
+		}
+
+	public:
+		OperatorException(const string& id, ASTNode* node):
+			CompilationException(formatError(id, node))
+		{
+		}
+	};
+
+	class IntrinsicTypeException : public CompilationException
+	{
+		static string formatError(const string& id, char type, ASTNode* node)
+		{
+			std::stringstream s;
+			s << "wrong type applied to '" << id << "'";
+			return node->position.formatError(s.str());
+		}
+
+	public:
+		IntrinsicTypeException(const string& id, char type, ASTNode* node):
+			CompilationException(formatError(id, type, node))
+		{
+		}
+	};
+
+public:
+	Compiler(llvm::LLVMContext& context, llvm::Module* module,
+			llvm::ExecutionEngine* engine, const map<string, string>& typealiases,
+			unsigned lanes = 1):
+		CompilerState(context, module, engine, lanes),
+		mask(NULL),
+		tailFunction(NULL),
+		tailCalls(NULL),
+		_typeRegistry(*this, typealiases)
+	{
+		types = &_typeRegistry;
+
+		intType = llvm::IntegerType::get(context, 32);
+		realType = types->find("real");
+		doubleType = llvm::Type::getDoubleTy(context);
+		floatType = llvm::Type::getFloatTy(context);
+		booleanType = types->find("boolean");
+		integerType = types->find("int");
+
+		_operatorPrecedence["and"] = 5;
+		_operatorPrecedence["or"] = 5;
+		_operatorPrecedence["<"] = 10;
+		_operatorPrecedence["<="] = 10;
+		_operatorPrecedence[">"] = 10;
+		_operatorPrecedence[">="] = 10;
+		_operatorPrecedence["=="] = 10;
+		_operatorPrecedence["!="] = 10;
+		_operatorPrecedence["|"] = 12;
+		_operatorPrecedence["^"] = 13;
+		_operatorPrecedence["&"] = 14;
+		_operatorPrecedence["<<"] = 15;
+		_operatorPrecedence[">>"] = 15;
+		_operatorPrecedence["+"] = 20;
+		_operatorPrecedence["-"] = 20;
+		_operatorPrecedence["*"] = 30;
+		_operatorPrecedence["/"] = 30;
+		_operatorPrecedence["@"] = 30;
+		_operatorPrecedence["%"] = 30;
+	}
+
+public:
+	ToplevelSymbol* compile(std::istream& signaturestream, std::istream& codestream,
+			SymbolTable* globals)
+	{
+		vector<VariableSymbol*> arguments;
+		vector<VariableSymbol*> returns;
+		MultipleSymbolTable symboltable(globals);
+		ToplevelSymbol* toplevelsymbol;
+		ASTToplevel* ast;
+
+		{
+			CompileStats::Timer timer(stats, "parse");
+
+			L signaturelexer(signaturestream);
+			parse_toplevelsignature(signaturelexer, arguments, returns);
+			expect_eof(signaturelexer);
+
+			/* Create the special symbol which represents the toplevel
+			 * function. */
+
+			toplevelsymbol = retain(new ToplevelSymbol("<toplevel>",
+					arguments, returns));
+
+			/* Compile the code to an AST. */
+
+			L codelexer(codestream);
+			ast = parse_toplevel(codelexer, toplevelsymbol, &symboltable);
+
+			/* Ensure we've reached the end of the file. */
+
+			expect(codelexer, L::ENDOFFILE);
+		}
+
+		/* Create the interface function from this signature. */
+
+		createEntrypoint(toplevelsymbol,
+				(lanes > 1) ? "LaneEntrypoint" : "Entrypoint");
+
+		for (unsigned i=0; i<arguments.size(); i++)
+			symboltable.add(arguments[i]);
+
+		/* Generate the IR code. In lane-parallel code, every lane starts off
+		 * live. */
+
+		if (lanes > 1)
+			mask = llvm::ConstantInt::getTrue(booleanType->llvm);
+
+		{
+			CompileStats::Timer timer(stats, "resolve");
+			ast->resolveVariables(*this);
+		}
+
+		CompileStats::Timer timer(stats, "codegen");
+		ast->codegen(*this);
+
+		return toplevelsymbol;
+	}
+
+	/* Compiles a library script: any number of function definitions, which
+	 * are shared, followed by the exported entrypoints, each of which gets
+	 * its own external function in the module (see exportedName()). */
+
+	vector<ToplevelSymbol*> compileLibrary(std::istream& codestream,
+			SymbolTable* globals)
+	{
+		MultipleSymbolTable symboltable(globals);
+		ASTLibrary* ast;
+
+		{
+			CompileStats::Timer timer(stats, "parse");
+
+			L codelexer(codestream);
+			ast = parse_library(codelexer, &symboltable);
+			expect(codelexer, L::ENDOFFILE);
+		}
+
+		/* The entrypoints are created first so that they get the names they
+		 * asked for; any helper functions with the same name get renamed. */
+
+		for (unsigned i=0; i<ast->exports.size(); i++)
+		{
+			ToplevelSymbol* toplevel = ast->exports[i]->toplevel;
+			createEntrypoint(toplevel, exportedName(toplevel->name));
+		}
+
+		{
+			CompileStats::Timer timer(stats, "resolve");
+			ast->resolveVariables(*this);
+		}
+
+		CompileStats::Timer timer(stats, "codegen");
+		ast->codegen(*this);
+
+		vector<ToplevelSymbol*> exports;
+		for (unsigned i=0; i<ast->exports.size(); i++)
+			exports.push_back(ast->exports[i]->toplevel);
+		return exports;
+	}
+
+	/* Exports can be called anything, including the names of libm
+	 * functions which the generated code calls (or which the JIT would
+	 * otherwise resolve to them), so their functions are prefixed. Library
+	 * looks them up by the name in the script. */
+
+	static string exportedName(const string& name)
+	{
+		return "calculon_export_" + name;
+	}
+
+	/* Compiles each stage of a pipeline as a toplevel function of its own,
+	 * then creates an entrypoint with the given signature which calls them
+	 * in turn. Each stage's inputs come from the latest earlier stage with
+	 * an output of that name, or else from the entrypoint's inputs, and the
+	 * entrypoint's outputs are found the same way. The stages are always
+	 * inlined, which leaves the intermediate values in registers. */
+
+	ToplevelSymbol* compilePipeline(std::istream& signaturestream,
+			const Pipeline& pipeline, SymbolTable* globals)
+	{
+		if (pipeline.stages.empty())
+			throw CompilationException("pipeline has no stages");
+
+		vector<ToplevelSymbol*> stages;
+		for (unsigned i=0; i<pipeline.stages.size(); i++)
+		{
+			std::istringstream stagesignature(pipeline.stages[i].signature);
+			std::istringstream stagecode(pipeline.stages[i].code);
+			ToplevelSymbol* stage = compile(stagesignature, stagecode, globals);
+
+			/* Free up the entrypoint's name for the next one. */
+
+			std::stringstream name;
+			name << "Stage" << i;
+			stage->function->setName(name.str());
+			stage->function->setLinkage(llvm::Function::InternalLinkage);
+			stage->function->addFnAttr(llvm::Attribute::AlwaysInline);
+			stages.push_back(stage);
+		}
+
+		vector<VariableSymbol*> arguments;
+		vector<VariableSymbol*> returns;
+		{
+			CompileStats::Timer timer(stats, "parse");
+
+			L signaturelexer(signaturestream);
+			parse_toplevelsignature(signaturelexer, arguments, returns);
+			expect_eof(signaturelexer);
+		}
+
+		ToplevelSymbol* toplevel = retain(new ToplevelSymbol("<pipeline>",
+				arguments, returns));
+		createEntrypoint(toplevel,
+				(lanes > 1) ? "LaneEntrypoint" : "Entrypoint");
+
+		CompileStats::Timer timer(stats, "pipeline");
+
+		/* Everything is in one basic block, so the temporaries are all in
+		 * the entry block, where the optimiser can promote them. */
+
+		map<string, VariableSymbol*> values;
+		for (unsigned i=0; i<arguments.size(); i++)
+			values[arguments[i]->name] = arguments[i];
+
+		for (unsigned s=0; s<stages.size(); s++)
+		{
+			ToplevelSymbol* stage = stages[s];
+			vector<llvm::Value*> parameters;
+
+			for (unsigned i=0; i<stage->arguments.size(); i++)
+			{
+				VariableSymbol* input = stage->arguments[i];
+				llvm::Value* v = pipelineValue(values, input, s);
+				if (input->type->asVector())
+				{
+					llvm::Value* p = builder.CreateAlloca(input->type->llvm);
+					builder.CreateStore(v, p);
+					v = p;
+				}
+				else if (input->type->llvmx->isFPOrFPVectorTy())
+					v = convertFloat(v, input->type->llvmx);
+				parameters.push_back(v);
+			}
+
+			vector<llvm::Value*> outputs;
+			for (unsigned i=0; i<stage->returns.size(); i++)
+			{
+				Type* type = stage->returns[i]->type;
+				llvm::Value* p = builder.CreateAlloca(
+						type->asVector() ? type->llvm : type->llvmx);
+				outputs.push_back(p);
+				parameters.push_back(p);
+			}
+
+			builder.CreateCall(stage->function, parameters);
+
+			/* Later stages see these outputs instead of any earlier values
+			 * with the same names. */
+
+			for (unsigned i=0; i<stage->returns.size(); i++)
+			{
+				VariableSymbol* output = stage->returns[i];
+				VariableSymbol* symbol = retain(new VariableSymbol(
+						output->name, output->type));
+				symbol->value = builder.CreateLoad(outputs[i]);
+				values[output->name] = symbol;
+			}
+		}
+
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			VariableSymbol* output = returns[i];
+			llvm::Value* v = pipelineValue(values, output, -1);
+			if (!output->type->asVector() &&
+					output->type->llvmx->isFPOrFPVectorTy())
+				v = convertFloat(v, output->type->llvmx);
+			builder.CreateStore(v, output->value);
+		}
+
+		builder.CreateRetVoid();
+		return toplevel;
+	}
+
+	/* Finds the value which a pipeline stage's input (or, if stage is -1,
+	 * the pipeline's output) is wired to. */
+
+	llvm::Value* pipelineValue(const map<string, VariableSymbol*>& values,
+			VariableSymbol* symbol, int stage)
+	{
+		std::stringstream s;
+		map<string, VariableSymbol*>::const_iterator i = values.find(symbol->name);
+		if (i == values.end())
+		{
+			s << "nothing in the pipeline provides '" << symbol->name << "'";
+			if (stage >= 0)
+				s << " for stage " << stage;
+			throw CompilationException(s.str());
+		}
+
+		if (!i->second->type->equals(symbol->type))
+		{
+			s << "'" << symbol->name << "' is a " << i->second->type->name
+			  << " in the pipeline, but a " << symbol->type->name << " is needed";
+			throw CompilationException(s.str());
+		}
+
+		return i->second->value;
+	}
+
+	/* Wraps an already compiled toplevel function in a loop which calls it
+	 * once for each row of a batch. The batch function takes the number of
+	 * rows followed by one array per parameter of the toplevel function;
+	 * because it lives in the same module the toplevel function gets
+	 * inlined into the loop body, which leaves the optimiser free to
+	 * vectorise across rows. */
+
+	llvm::Function* compileBatch(ToplevelSymbol* toplevel,
+			const CompileOptions& options = CompileOptions())
+	{
+		if ((lanes > 1) && (options.batchLayout == CompileOptions::Records))
+			throw CompilationException(
+					"records can't be used in lane-parallel batches");
+		if ((lanes > 1) && (options.batchLayout == CompileOptions::Grid))
+			throw CompilationException(
+					"grids can't be used in lane-parallel batches");
+		if ((lanes > 1) && (options.batchLayout == CompileOptions::Reduce))
+			throw CompilationException(
+					"reductions can't be used in lane-parallel batches");
+		if (!options.storage.empty() &&
+				((lanes > 1) ||
+				 (options.batchLayout == CompileOptions::Records)))
+			throw CompilationException(
+					"storage can't be given for lane-parallel or Records "
+					"batches");
+		if (lanes > 1)
+			return compileLaneBatch(toplevel);
+		if (options.batchLayout == CompileOptions::Columns)
+			return compileColumnBatch(toplevel, options.storage);
+		if (options.batchLayout == CompileOptions::Records)
+			return compileRecordBatch(toplevel, options.record);
+		if (options.batchLayout == CompileOptions::Grid)
+			return compileGridBatch(toplevel, options.storage);
+		if (options.batchLayout == CompileOptions::Reduce)
+			return compileReduceBatch(toplevel, options.reductions,
+					options.storage);
+
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		llvm::Type* sizetype = engine->getDataLayout()->getIntPtrType(context, 0);
+
+		vector<VariableSymbol*> symbols(arguments);
+		symbols.insert(symbols.end(), returns.begin(), returns.end());
+		vector<Storage> storage = batchStorage(options.storage, symbols);
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(sizetype);
+
+		for (unsigned i=0; i<symbols.size(); i++)
+			externaltypes.push_back(arrayType(symbols[i]->type, storage[i]));
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		/* We want the per-row function to vanish into the loop. */
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(context, "loop", f);
+		llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* count = ii++;
+		count->setName("count");
+
+		vector<llvm::Value*> arrays;
+		for (unsigned i=0; i<arguments.size(); i++)
+		{
+			llvm::Value* v = ii++;
+			v->setName(arguments[i]->name);
+			arrays.push_back(v);
+		}
+
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Value* v = ii++;
+			v->setName(returns[i]->name);
+			arrays.push_back(v);
+		}
+
+		builder.SetInsertPoint(entryblock);
+		vector<llvm::Value*> temporaries = batchTemporaries(symbols, storage,
+				arguments.size());
+		builder.CreateBr(loopblock);
+
+		/* Loop header: stop once we've processed every row. */
+
+		builder.SetInsertPoint(loopblock);
+		llvm::PHINode* index = builder.CreatePHI(sizetype, 2, "index");
+		index->addIncoming(llvm::ConstantInt::get(sizetype, 0), entryblock);
+		builder.CreateCondBr(builder.CreateICmpULT(index, count),
+				bodyblock, exitblock);
+
+		/* Loop body: find this row's elements and call the toplevel
+		 * function on them. Vectors and outputs are passed by pointer, so
+		 * unless they're stored as something else we can hand over the
+		 * address of the array element directly. */
+
+		builder.SetInsertPoint(bodyblock);
+		vector<llvm::Value*> parameters;
+		for (unsigned i=0; i<arguments.size(); i++)
+			parameters.push_back(loadInput(arrays[i], index,
+					arguments[i]->type, storage[i], temporaries[i]));
+
+		for (unsigned i=arguments.size(); i<symbols.size(); i++)
+			parameters.push_back(outputPointer(arrays[i], index, storage[i],
+					temporaries[i]));
+
+		builder.CreateCall(toplevel->function, parameters);
+
+		for (unsigned i=arguments.size(); i<symbols.size(); i++)
+			storeOutput(arrays[i], index, symbols[i]->type, storage[i],
+					temporaries[i]);
+
+		llvm::Value* next = builder.CreateAdd(index,
+				llvm::ConstantInt::get(sizetype, 1));
+		index->addIncoming(next, bodyblock);
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(exitblock);
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* The Columns layout version of compileBatch(). Vectors are gathered
+	 * from (and scattered to) one array per element, going through a
+	 * temporary which the optimiser will turn back into registers once the
+	 * toplevel function has been inlined. */
+
+	llvm::Function* compileColumnBatch(ToplevelSymbol* toplevel,
+			const map<string, Storage>& storagemap)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		llvm::Type* sizetype = engine->getDataLayout()->getIntPtrType(context, 0);
+
+		vector<VariableSymbol*> parameters(arguments);
+		parameters.insert(parameters.end(), returns.begin(), returns.end());
+
+		vector<Storage> storage = batchStorage(storagemap, parameters);
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(sizetype);
+
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			Type* type = parameters[i]->type;
+			VectorType* vectortype = type->asVector();
+			if (vectortype)
+			{
+				llvm::Type* t = (storage[i].type == Storage::Native) ?
+						vectortype->element->llvm : storageType(storage[i]);
+				for (unsigned j=0; j<vectortype->size; j++)
+					externaltypes.push_back(t->getPointerTo());
+			}
+			else
+				externaltypes.push_back(arrayType(type, storage[i]));
+		}
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(context, "loop", f);
+		llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* count = ii++;
+		count->setName("count");
+
+		/* columns[i] holds the arrays for parameter i; vectors also get a
+		 * temporary. */
+
+		builder.SetInsertPoint(entryblock);
+		vector<vector<llvm::Value*> > columns(parameters.size());
+		vector<llvm::Value*> temporaries(parameters.size());
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			VariableSymbol* symbol = parameters[i];
+			VectorType* vectortype = symbol->type->asVector();
+			unsigned n = vectortype ? vectortype->size : 1;
+			for (unsigned j=0; j<n; j++)
+			{
+				llvm::Value* v = ii++;
+				v->setName(symbol->name);
+				columns[i].push_back(v);
+			}
+
+			if (vectortype)
+				temporaries[i] = builder.CreateAlloca(vectortype->llvm);
+			else if ((i >= arguments.size()) &&
+					(storage[i].type != Storage::Native))
+				temporaries[i] = builder.CreateAlloca(symbol->type->llvmx);
+		}
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(loopblock);
+		llvm::PHINode* index = builder.CreatePHI(sizetype, 2, "index");
+		index->addIncoming(llvm::ConstantInt::get(sizetype, 0), entryblock);
+		builder.CreateCondBr(builder.CreateICmpULT(index, count),
+				bodyblock, exitblock);
+
+		builder.SetInsertPoint(bodyblock);
+		vector<llvm::Value*> values;
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			VectorType* vectortype = parameters[i]->type->asVector();
+			bool input = (i < arguments.size());
+
+			if (!vectortype)
+			{
+				if (input)
+					values.push_back(decodeValue(builder.CreateLoad(
+							builder.CreateGEP(columns[i][0], index)),
+						storage[i], parameters[i]->type->llvmx));
+				else
+					values.push_back(outputPointer(columns[i][0], index,
+							storage[i], temporaries[i]));
+			}
+			else
+			{
+				if (input)
+				{
+					llvm::Value* v = llvm::UndefValue::get(vectortype->llvm);
+					for (unsigned j=0; j<vectortype->size; j++)
+						v = vectortype->setElement(v, j, decodeValue(
+								builder.CreateLoad(
+									builder.CreateGEP(columns[i][j], index)),
+								storage[i], vectortype->element->llvm));
+					vectortype->storeToArray(v, temporaries[i]);
+				}
+				values.push_back(temporaries[i]);
+			}
+		}
+
+		builder.CreateCall(toplevel->function, values);
+
+		for (unsigned i=arguments.size(); i<parameters.size(); i++)
+		{
+			VectorType* vectortype = parameters[i]->type->asVector();
+			if (!vectortype)
+			{
+				storeOutput(columns[i][0], index, parameters[i]->type,
+						storage[i], temporaries[i]);
+				continue;
+			}
+
+			llvm::Value* v = vectortype->loadFromArray(temporaries[i]);
+			for (unsigned j=0; j<vectortype->size; j++)
+				builder.CreateStore(encodeValue(vectortype->getElement(v, j),
+							storage[i]),
+						builder.CreateGEP(columns[i][j], index));
+		}
+
+		llvm::Value* next = builder.CreateAdd(index,
+				llvm::ConstantInt::get(sizetype, 1));
+		index->addIncoming(next, bodyblock);
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(exitblock);
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* The Records layout version of compileBatch(). Each record's fields
+	 * are loaded and converted to the toplevel function's types; outputs
+	 * go through temporaries and are converted back on the way out. Fields
+	 * which are only partly aligned are accessed with the alignment they
+	 * actually have. */
+
+	llvm::Function* compileRecordBatch(ToplevelSymbol* toplevel,
+			const RecordLayout& layout)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		llvm::Type* sizetype = engine->getDataLayout()->getIntPtrType(context, 0);
+		llvm::Type* bytetype = llvm::Type::getInt8Ty(context);
+
+		vector<VariableSymbol*> parameters(arguments);
+		parameters.insert(parameters.end(), returns.begin(), returns.end());
+
+		vector<const RecordLayout::Field*> fields;
+		for (unsigned i=0; i<parameters.size(); i++)
+			fields.push_back(&recordField(layout, parameters[i]));
+
+		for (map<string, RecordLayout::Field>::const_iterator i =
+				layout.fields.begin(), e = layout.fields.end(); i != e; i++)
+		{
+			bool found = false;
+			for (unsigned j=0; j<parameters.size(); j++)
+				found |= (parameters[j]->name == i->first);
+			if (!found)
+			{
+				std::stringstream s;
+				s << "record field '" << i->first
+				  << "' isn't bound to any parameter";
+				throw CompilationException(s.str());
+			}
+		}
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(sizetype);
+		externaltypes.push_back(bytetype->getPointerTo());
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(context, "loop", f);
+		llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* count = ii++;
+		count->setName("count");
+		llvm::Value* records = ii++;
+		records->setName("records");
+
+		/* Vectors and outputs are passed by pointer, so they need
+		 * somewhere to live. */
+
+		builder.SetInsertPoint(entryblock);
+		vector<llvm::Value*> temporaries(parameters.size());
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			Type* type = parameters[i]->type;
+			if (type->asVector())
+				temporaries[i] = builder.CreateAlloca(type->llvm);
+			else if (i >= arguments.size())
+				temporaries[i] = builder.CreateAlloca(type->llvmx);
+		}
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(loopblock);
+		llvm::PHINode* index = builder.CreatePHI(sizetype, 2, "index");
+		index->addIncoming(llvm::ConstantInt::get(sizetype, 0), entryblock);
+		builder.CreateCondBr(builder.CreateICmpULT(index, count),
+				bodyblock, exitblock);
+
+		builder.SetInsertPoint(bodyblock);
+		llvm::Value* record = builder.CreateGEP(records,
+				builder.CreateMul(index,
+					llvm::ConstantInt::get(sizetype, layout.stride)));
+
+		vector<llvm::Value*> values;
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			Type* type = parameters[i]->type;
+			VectorType* vectortype = type->asVector();
+			bool input = (i < arguments.size());
+
+			if (!input)
+				values.push_back(temporaries[i]);
+			else if (!vectortype)
+				values.push_back(loadField(record, layout.stride, *fields[i],
+						0, type->llvmx));
+			else
+			{
+				llvm::Value* v = llvm::UndefValue::get(vectortype->llvm);
+				for (unsigned j=0; j<vectortype->size; j++)
+					v = vectortype->setElement(v, j, loadField(record,
+							layout.stride, *fields[i], j,
+							vectortype->element->llvm));
+				vectortype->storeToArray(v, temporaries[i]);
+				values.push_back(temporaries[i]);
+			}
+		}
+
+		builder.CreateCall(toplevel->function, values);
+
+		for (unsigned i=arguments.size(); i<parameters.size(); i++)
+		{
+			VectorType* vectortype = parameters[i]->type->asVector();
+			if (!vectortype)
+				storeField(record, layout.stride, *fields[i], 0,
+						builder.CreateLoad(temporaries[i]));
+			else
+			{
+				llvm::Value* v = vectortype->loadFromArray(temporaries[i]);
+				for (unsigned j=0; j<vectortype->size; j++)
+					storeField(record, layout.stride, *fields[i], j,
+							vectortype->getElement(v, j));
+			}
+		}
+
+		llvm::Value* next = builder.CreateAdd(index,
+				llvm::ConstantInt::get(sizetype, 1));
+		index->addIncoming(next, bodyblock);
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(exitblock);
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* The Grid layout version of compileBatch(), which takes a GridTile
+	 * and an array of output arrays. The inputs are either one real per
+	 * dimension or a single vector with an element per dimension, up to
+	 * three. There's one loop per dimension, x innermost, and each input's
+	 * coordinate and output's row offset are worked out in the loop they
+	 * belong to. The outputs may be stored as something other than
+	 * reals. */
+
+	llvm::Function* compileGridBatch(ToplevelSymbol* toplevel,
+			const map<string, Storage>& storagemap)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		llvm::Type* sizetype = engine->getDataLayout()->getIntPtrType(context, 0);
+		llvm::Type* realtype = realType->llvm;
+		vector<Storage> storage = batchStorage(storagemap, returns);
+
+		VectorType* vectortype = NULL;
+		unsigned dimensions = arguments.size();
+		if ((dimensions == 1) && arguments[0]->type->asVector() &&
+				!arguments[0]->type->isInteger())
+		{
+			vectortype = arguments[0]->type->asVector();
+			dimensions = vectortype->size;
+		}
+		else
+		{
+			for (unsigned i=0; i<arguments.size(); i++)
+				if (!arguments[i]->type->llvm->isFloatingPointTy())
+					dimensions = 0;
+		}
+
+		if ((dimensions < 1) || (dimensions > 3))
+			throw CompilationException("grid scripts must take one to three "
+					"real coordinates, or a vector of them");
+
+		/* Matches GridTile. */
+
+		vector<llvm::Type*> fieldtypes;
+		fieldtypes.push_back(llvm::ArrayType::get(realtype, 3));
+		fieldtypes.push_back(llvm::ArrayType::get(realtype, 3));
+		fieldtypes.push_back(llvm::ArrayType::get(sizetype, 3));
+		fieldtypes.push_back(llvm::ArrayType::get(sizetype, 3));
+		fieldtypes.push_back(llvm::ArrayType::get(sizetype, 3));
+		llvm::StructType* tiletype = llvm::StructType::get(context, fieldtypes);
+		llvm::Type* voidptrtype = llvm::Type::getInt8PtrTy(context);
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(tiletype->getPointerTo());
+		externaltypes.push_back(voidptrtype->getPointerTo());
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* tile = ii++;
+		tile->setName("tile");
+		llvm::Value* outputarrays = ii++;
+		outputarrays->setName("outputs");
+
+		builder.SetInsertPoint(entryblock);
+		vector<llvm::Value*> origin, step, begin, end, pitch;
+		for (unsigned d=0; d<dimensions; d++)
+		{
+			origin.push_back(builder.CreateLoad(builder.CreateConstGEP2_32(
+					builder.CreateStructGEP(tile, 0), 0, d)));
+			step.push_back(builder.CreateLoad(builder.CreateConstGEP2_32(
+					builder.CreateStructGEP(tile, 1), 0, d)));
+			begin.push_back(builder.CreateLoad(builder.CreateConstGEP2_32(
+					builder.CreateStructGEP(tile, 2), 0, d)));
+			end.push_back(builder.CreateLoad(builder.CreateConstGEP2_32(
+					builder.CreateStructGEP(tile, 3), 0, d)));
+			pitch.push_back(builder.CreateLoad(builder.CreateConstGEP2_32(
+					builder.CreateStructGEP(tile, 4), 0, d)));
+		}
+
+		vector<llvm::Value*> arrays;
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Value* p = builder.CreateLoad(
+					builder.CreateConstGEP1_32(outputarrays, i));
+			p = builder.CreateBitCast(p, arrayType(returns[i]->type,
+					storage[i]));
+			p->setName(returns[i]->name);
+			arrays.push_back(p);
+		}
+
+		llvm::Value* temporary = NULL;
+		if (vectortype)
+			temporary = builder.CreateAlloca(vectortype->llvm);
+		vector<llvm::Value*> temporaries = batchTemporaries(returns, storage, 0);
+
+		/* Open the loops, outermost first. Each loop's exit goes to the
+		 * next block of the loop outside it. */
+
+		vector<llvm::BasicBlock*> loopblocks(dimensions);
+		vector<llvm::BasicBlock*> nextblocks(dimensions);
+		vector<llvm::PHINode*> indices(dimensions);
+		vector<llvm::Value*> coordinates(dimensions);
+		llvm::Value* offset = llvm::ConstantInt::get(sizetype, 0);
+		for (unsigned d=0; d<dimensions; d++)
+		{
+			loopblocks[d] = llvm::BasicBlock::Create(context, "loop", f);
+			nextblocks[d] = llvm::BasicBlock::Create(context, "next", f);
+		}
+
+		for (int d=dimensions-1; d>=0; d--)
+		{
+			llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context,
+					"body", f);
+			llvm::BasicBlock* outsideblock = builder.GetInsertBlock();
+			builder.CreateBr(loopblocks[d]);
+
+			builder.SetInsertPoint(loopblocks[d]);
+			indices[d] = builder.CreatePHI(sizetype, 2, "index");
+			indices[d]->addIncoming(begin[d], outsideblock);
+			builder.CreateCondBr(builder.CreateICmpULT(indices[d], end[d]),
+					bodyblock,
+					(d == (int)dimensions-1) ? exitblock : nextblocks[d+1]);
+
+			builder.SetInsertPoint(bodyblock);
+			coordinates[d] = builder.CreateFAdd(origin[d],
+					builder.CreateFMul(step[d],
+						builder.CreateUIToFP(indices[d], realtype)));
+			offset = builder.CreateAdd(offset,
+					builder.CreateMul(indices[d], pitch[d]));
+		}
+
+		/* Innermost body: evaluate the point. */
+
+		vector<llvm::Value*> parameters;
+		if (vectortype)
+		{
+			llvm::Value* v = llvm::UndefValue::get(vectortype->llvm);
+			for (unsigned d=0; d<dimensions; d++)
+				v = vectortype->setElement(v, d, coordinates[d]);
+			vectortype->storeToArray(v, temporary);
+			parameters.push_back(temporary);
+		}
+		else
+		{
+			for (unsigned d=0; d<dimensions; d++)
+				parameters.push_back(convertFloat(coordinates[d],
+						arguments[d]->type->llvmx));
+		}
+
+		for (unsigned i=0; i<returns.size(); i++)
+			parameters.push_back(outputPointer(arrays[i], offset, storage[i],
+					temporaries[i]));
+
+		builder.CreateCall(toplevel->function, parameters);
+
+		for (unsigned i=0; i<returns.size(); i++)
+			storeOutput(arrays[i], offset, returns[i]->type, storage[i],
+					temporaries[i]);
+		builder.CreateBr(nextblocks[0]);
+
+		/* Close the loops, innermost first. */
+
+		for (unsigned d=0; d<dimensions; d++)
+		{
+			builder.SetInsertPoint(nextblocks[d]);
+			llvm::Value* next = builder.CreateAdd(indices[d],
+					llvm::ConstantInt::get(sizetype, 1));
+			indices[d]->addIncoming(next, nextblocks[d]);
+			builder.CreateBr(loopblocks[d]);
+		}
+
+		builder.SetInsertPoint(exitblock);
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* The Reduce layout version of compileBatch(). The accumulators are
+	 * carried round the loop in registers, so the outputs never go near
+	 * memory once the toplevel function has been inlined, and the
+	 * optimiser is free to vectorise the reductions. */
+
+	llvm::Function* compileReduceBatch(ToplevelSymbol* toplevel,
+			const vector<CompileOptions::Reduction>& reductions,
+			const map<string, Storage>& storagemap)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		llvm::Type* sizetype = engine->getDataLayout()->getIntPtrType(context, 0);
+		llvm::Type* realtype = realType->llvm;
+		vector<Storage> storage = batchStorage(storagemap, arguments);
+
+		if (reductions.size() != returns.size())
+			throw CompilationException(
+					"there must be one reduction for each output");
+		for (unsigned i=0; i<returns.size(); i++)
+			if (returns[i]->type->asVector())
+			{
+				std::stringstream s;
+				s << "vector output '" << returns[i]->name
+				  << "' can't be reduced";
+				throw CompilationException(s.str());
+			}
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(sizetype);
+		for (unsigned i=0; i<arguments.size(); i++)
+			externaltypes.push_back(arrayType(arguments[i]->type,
+					storage[i]));
+		externaltypes.push_back(realtype->getPointerTo());
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(context, "loop", f);
+		llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* count = ii++;
+		count->setName("count");
+
+		vector<llvm::Value*> arrays;
+		for (unsigned i=0; i<arguments.size(); i++)
+		{
+			llvm::Value* v = ii++;
+			v->setName(arguments[i]->name);
+			arrays.push_back(v);
+		}
+
+		llvm::Value* results = ii++;
+		results->setName("results");
+
+		builder.SetInsertPoint(entryblock);
+		vector<llvm::Value*> temporaries = batchTemporaries(arguments, storage,
+				arguments.size());
+		vector<llvm::Value*> outputs;
+		for (unsigned i=0; i<returns.size(); i++)
+			outputs.push_back(builder.CreateAlloca(returns[i]->type->llvmx));
+		builder.CreateBr(loopblock);
+
+		/* The accumulators start off at the identity of their reduction. */
+
+		builder.SetInsertPoint(loopblock);
+		llvm::PHINode* index = builder.CreatePHI(sizetype, 2, "index");
+		index->addIncoming(llvm::ConstantInt::get(sizetype, 0), entryblock);
+
+		vector<llvm::PHINode*> accumulators;
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::PHINode* phi = builder.CreatePHI(realtype, 2, returns[i]->name);
+			double identity = 0;
+			if (reductions[i] == CompileOptions::Min)
+				identity = std::numeric_limits<double>::infinity();
+			else if (reductions[i] == CompileOptions::Max)
+				identity = -std::numeric_limits<double>::infinity();
+			phi->addIncoming(llvm::ConstantFP::get(realtype, identity),
+					entryblock);
+			accumulators.push_back(phi);
+		}
+
+		builder.CreateCondBr(builder.CreateICmpULT(index, count),
+				bodyblock, exitblock);
+
+		builder.SetInsertPoint(bodyblock);
+		vector<llvm::Value*> parameters;
+		for (unsigned i=0; i<arguments.size(); i++)
+			parameters.push_back(loadInput(arrays[i], index,
+					arguments[i]->type, storage[i], temporaries[i]));
+		parameters.insert(parameters.end(), outputs.begin(), outputs.end());
+
+		builder.CreateCall(toplevel->function, parameters);
+
+		vector<llvm::Value*> accumulated;
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Value* v = builder.CreateLoad(outputs[i]);
+			llvm::Value* acc = accumulators[i];
+			bool boolean = v->getType()->isIntegerTy(1);
+			bool integer = v->getType()->isIntegerTy(32);
+
+			if (reductions[i] == CompileOptions::Count)
+			{
+				if (integer)
+					v = builder.CreateICmpNE(v,
+							llvm::ConstantInt::get(v->getType(), 0));
+				else if (!boolean)
+				{
+					/* Unordered, so NaN counts as nonzero. */
+
+					v = builder.CreateFCmpUNE(v,
+							llvm::ConstantFP::get(v->getType(), 0));
+				}
+				acc = builder.CreateFAdd(acc, builder.CreateUIToFP(v, realtype));
+			}
+			else
+			{
+				if (boolean)
+					v = builder.CreateUIToFP(v, realtype);
+				else if (integer)
+					v = builder.CreateSIToFP(v, realtype);
+				else
+					v = convertFloat(v, realtype);
+
+				switch (reductions[i])
+				{
+					case CompileOptions::Min:
+						acc = builder.CreateSelect(
+								builder.CreateFCmpOLT(v, acc), v, acc);
+						break;
+
+					case CompileOptions::Max:
+						acc = builder.CreateSelect(
+								builder.CreateFCmpOGT(v, acc), v, acc);
+						break;
+
+					default:
+						acc = builder.CreateFAdd(acc, v);
+						break;
+				}
+			}
+			accumulated.push_back(acc);
+		}
+
+		llvm::Value* next = builder.CreateAdd(index,
+				llvm::ConstantInt::get(sizetype, 1));
+		llvm::BasicBlock* latchblock = builder.GetInsertBlock();
+		index->addIncoming(next, latchblock);
+		for (unsigned i=0; i<returns.size(); i++)
+			accumulators[i]->addIncoming(accumulated[i], latchblock);
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(exitblock);
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Value* v = accumulators[i];
+			if (reductions[i] == CompileOptions::Mean)
+				v = builder.CreateFDiv(v, builder.CreateUIToFP(count, realtype));
+			builder.CreateStore(v, builder.CreateConstGEP1_32(results, i));
+		}
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* The lane-parallel version of compileBatch(). Each time round the
+	 * loop a whole group of rows is processed at once, one per lane. When
+	 * there are fewer rows left than lanes the spare lanes are filled with
+	 * copies of the last row; scripts have no side effects, so this just
+	 * computes the same result more than once and writes it back to the
+	 * same place. */
+
+	llvm::Function* compileLaneBatch(ToplevelSymbol* toplevel)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
+		const llvm::DataLayout* dl = engine->getDataLayout();
+		llvm::Type* sizetype = dl->getIntPtrType(context, 0);
+
+		vector<llvm::Type*> externaltypes;
+		externaltypes.push_back(sizetype);
+
+		for (unsigned i=0; i<arguments.size(); i++)
+			externaltypes.push_back(
+					arguments[i]->type->llvmx->getScalarType()->getPointerTo());
+
+		for (unsigned i=0; i<returns.size(); i++)
+			externaltypes.push_back(
+					returns[i]->type->llvmx->getScalarType()->getPointerTo());
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(context),
+				externaltypes, false);
+
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::BasicBlock* entryblock = llvm::BasicBlock::Create(context, "entry", f);
+		llvm::BasicBlock* loopblock = llvm::BasicBlock::Create(context, "loop", f);
+		llvm::BasicBlock* bodyblock = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* fastloadblock = llvm::BasicBlock::Create(context, "fastload", f);
+		llvm::BasicBlock* slowloadblock = llvm::BasicBlock::Create(context, "slowload", f);
+		llvm::BasicBlock* computeblock = llvm::BasicBlock::Create(context, "compute", f);
+		llvm::BasicBlock* faststoreblock = llvm::BasicBlock::Create(context, "faststore", f);
+		llvm::BasicBlock* slowstoreblock = llvm::BasicBlock::Create(context, "slowstore", f);
+		llvm::BasicBlock* nextblock = llvm::BasicBlock::Create(context, "next", f);
+		llvm::BasicBlock* exitblock = llvm::BasicBlock::Create(context, "exit", f);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* count = ii++;
+		count->setName("count");
+
+		vector<llvm::Value*> arrays;
+		for (unsigned i=0; i<arguments.size(); i++)
+		{
+			llvm::Value* v = ii++;
+			v->setName(arguments[i]->name);
+			arrays.push_back(v);
+		}
+
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Value* v = ii++;
+			v->setName(returns[i]->name);
+			arrays.push_back(v);
+		}
+
+		/* The toplevel function writes its results here, a lane group at a
+		 * time. */
+
+		builder.SetInsertPoint(entryblock);
+		vector<llvm::Value*> outputs;
+		for (unsigned i=0; i<returns.size(); i++)
+			outputs.push_back(builder.CreateAlloca(returns[i]->type->llvmx));
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(loopblock);
+		llvm::PHINode* index = builder.CreatePHI(sizetype, 2, "index");
+		index->addIncoming(llvm::ConstantInt::get(sizetype, 0), entryblock);
+		builder.CreateCondBr(builder.CreateICmpULT(index, count),
+				bodyblock, exitblock);
+
+		builder.SetInsertPoint(bodyblock);
+		llvm::Value* full = builder.CreateICmpUGE(
+				builder.CreateSub(count, index),
+				llvm::ConstantInt::get(sizetype, lanes));
+		builder.CreateCondBr(full, fastloadblock, slowloadblock);
+
+		/* A full group of rows can be read with a single vector load.
+		 * Booleans are a byte each in memory, but a vector of i1 is packed
+		 * into bits, so they're loaded as bytes and then compared. */
+
+		builder.SetInsertPoint(fastloadblock);
+		vector<llvm::Value*> fastvalues;
+		for (unsigned i=0; i<arguments.size(); i++)
+		{
+			llvm::Type* t = arguments[i]->type->llvmx;
+			llvm::Type* mt = laneMemoryType(t);
+			llvm::Value* p = builder.CreateGEP(arrays[i], index);
+			p = builder.CreateBitCast(p, mt->getPointerTo());
+			llvm::Value* v = builder.CreateAlignedLoad(p,
+					dl->getABITypeAlignment(mt->getScalarType()));
+			if (mt != t)
+				v = builder.CreateICmpNE(v, llvm::Constant::getNullValue(mt));
+			fastvalues.push_back(v);
+		}
+		builder.CreateBr(computeblock);
+
+		/* Otherwise assemble the group a row at a time. */
+
+		builder.SetInsertPoint(slowloadblock);
+		vector<llvm::Value*> slowvalues;
+		for (unsigned i=0; i<arguments.size(); i++)
+			slowvalues.push_back(llvm::UndefValue::get(arguments[i]->type->llvmx));
+
+		for (unsigned lane=0; lane<lanes; lane++)
+		{
+			llvm::Value* row = laneRow(index, count, lane);
+			llvm::Value* l = llvm::ConstantInt::get(intType, lane);
+			for (unsigned i=0; i<arguments.size(); i++)
+			{
+				llvm::Value* v = builder.CreateLoad(
+						builder.CreateGEP(arrays[i], row));
+				slowvalues[i] = builder.CreateInsertElement(slowvalues[i], v, l);
+			}
+		}
+		builder.CreateBr(computeblock);
+
+		builder.SetInsertPoint(computeblock);
+		vector<llvm::Value*> parameters;
+		for (unsigned i=0; i<arguments.size(); i++)
+		{
+			llvm::PHINode* phi = builder.CreatePHI(arguments[i]->type->llvmx, 2);
+			phi->addIncoming(fastvalues[i], fastloadblock);
+			phi->addIncoming(slowvalues[i], slowloadblock);
+			parameters.push_back(phi);
+		}
+
+		for (unsigned i=0; i<returns.size(); i++)
+			parameters.push_back(outputs[i]);
+
+		builder.CreateCall(toplevel->function, parameters);
+		builder.CreateCondBr(full, faststoreblock, slowstoreblock);
+
+		builder.SetInsertPoint(faststoreblock);
+		for (unsigned i=0; i<returns.size(); i++)
+		{
+			llvm::Type* t = returns[i]->type->llvmx;
+			llvm::Type* mt = laneMemoryType(t);
+			llvm::Value* p = builder.CreateGEP(arrays[arguments.size() + i], index);
+			p = builder.CreateBitCast(p, mt->getPointerTo());
+			llvm::Value* v = builder.CreateLoad(outputs[i]);
+			if (mt != t)
+				v = builder.CreateZExt(v, mt);
+			builder.CreateAlignedStore(v, p,
+					dl->getABITypeAlignment(mt->getScalarType()));
+		}
+		builder.CreateBr(nextblock);
+
+		builder.SetInsertPoint(slowstoreblock);
+		for (unsigned lane=0; lane<lanes; lane++)
+		{
+			llvm::Value* row = laneRow(index, count, lane);
+			llvm::Value* l = llvm::ConstantInt::get(intType, lane);
+			for (unsigned i=0; i<returns.size(); i++)
+			{
+				llvm::Value* v = builder.CreateExtractElement(
+						builder.CreateLoad(outputs[i]), l);
+				builder.CreateStore(v,
+						builder.CreateGEP(arrays[arguments.size() + i], row));
+			}
+		}
+		builder.CreateBr(nextblock);
+
+		builder.SetInsertPoint(nextblock);
+		llvm::Value* next = builder.CreateAdd(index,
+				llvm::ConstantInt::get(sizetype, lanes));
+		index->addIncoming(next, nextblock);
+		builder.CreateBr(loopblock);
+
+		builder.SetInsertPoint(exitblock);
+		builder.CreateRetVoid();
+
+		return f;
+	}
+
+	/* How a lane group of a value is laid out in memory: the same as the
+	 * value, except for booleans, which take a byte each. */
+
+	llvm::Type* laneMemoryType(llvm::Type* t)
+	{
+		if (!t->getScalarType()->isIntegerTy(1))
+			return t;
+		return llvm::VectorType::get(llvm::Type::getInt8Ty(context), lanes);
+	}
 
-	using CompilerState::retain;
-	using CompilerState::types;
-	using CompilerState::intType;
-public:
-	using CompilerState::realType;
-	using CompilerState::doubleType;
-	using CompilerState::floatType;
-	using CompilerState::booleanType;
 private:
+	#include "calculon_ast.h"
 
-	map<string, int> _operatorPrecedence;
-	TypeRegistry _typeRegistry;
+private:
+	/* Batch functions take arrays of the external representation of each
+	 * parameter. Vectors are already passed by pointer. */
 
-	class TypeException : public CompilationException
+	llvm::Type* batchArrayType(Type* type)
 	{
-	public:
-		TypeException(const string& what, ASTNode* node):
-			CompilationException(node->position.formatError(what))
+		llvm::Type* t = type->llvmx;
+		if (!t->isPointerTy())
+			t = t->getPointerTo();
+		return t;
+	}
+
+	/* Finds how each parameter's array is stored, checking that it makes
+	 * sense. Only the parameters given have arrays (a Reduce batch
+	 * function has none for its outputs). */
+
+	vector<Storage> batchStorage(const map<string, Storage>& storagemap,
+			const vector<VariableSymbol*>& parameters)
+	{
+		vector<Storage> storage(parameters.size());
+		for (map<string, Storage>::const_iterator i = storagemap.begin(),
+				e = storagemap.end(); i != e; i++)
 		{
+			unsigned j = 0;
+			while ((j < parameters.size()) && (parameters[j]->name != i->first))
+				j++;
+
+			std::stringstream s;
+			if (j == parameters.size())
+				s << "storage is given for '" << i->first
+				  << "', which doesn't have an array";
+			else if (!parameters[j]->type->llvm->isFPOrFPVectorTy() &&
+					!i->second.isInteger() &&
+					(i->second.type != Storage::Native))
+				s << "boolean or int parameter '" << i->first
+				  << "' can only be stored as an integer";
+			else if (parameters[j]->type->isInteger() &&
+					((i->second.scale != 1) || (i->second.offset != 0)))
+				s << "int parameter '" << i->first
+				  << "' can't be stored with a scale or offset";
+			else
+			{
+				storage[j] = i->second;
+				continue;
+			}
+			throw CompilationException(s.str());
 		}
-	};
+		return storage;
+	}
 
-	class SymbolException : public CompilationException
+	/* The type of one stored value. */
+
+	llvm::Type* storageType(const Storage& storage)
 	{
-		static string formatError(const string& id, ASTNode* node)
+		switch (storage.type)
 		{
-			std::stringstream s;
-			s << "unresolved symbol '" << id << "'";
-			return node->position.formatError(s.str());
+			case Storage::Float:  return floatType;
+			case Storage::Double: return doubleType;
+			case Storage::UInt8:  return llvm::Type::getInt8Ty(context);
+			case Storage::Int32:  return intType;
+			default:              return llvm::Type::getInt16Ty(context);
 		}
+	}
 
-	public:
-		SymbolException(const string& id, ASTNode* node):
-			CompilationException(formatError(id, node))
+	llvm::Type* arrayType(Type* type, const Storage& storage)
+	{
+		if (storage.type == Storage::Native)
+			return batchArrayType(type);
+		return storageType(storage)->getPointerTo();
+	}
+
+	/* Stored vector inputs are decoded into a temporary, as the toplevel
+	 * function takes them by pointer, and stored outputs are written to
+	 * one before they're encoded. Parameters from the inputs'th onwards
+	 * are outputs. */
+
+	vector<llvm::Value*> batchTemporaries(const vector<VariableSymbol*>& parameters,
+			const vector<Storage>& storage, unsigned inputs)
+	{
+		vector<llvm::Value*> temporaries(parameters.size());
+		for (unsigned i=0; i<parameters.size(); i++)
 		{
+			Type* type = parameters[i]->type;
+			if (storage[i].type == Storage::Native)
+				continue;
+			if (type->asVector())
+				temporaries[i] = builder.CreateAlloca(type->llvm);
+			else if (i >= inputs)
+				temporaries[i] = builder.CreateAlloca(type->llvmx);
 		}
-	};
+		return temporaries;
+	}
 
-	class OperatorException : public CompilationException
+	/* Fetches a row's value of an input, as the toplevel function wants
+	 * it. Vectors of a stored input are consecutive in its array. */
+
+	llvm::Value* loadInput(llvm::Value* array, llvm::Value* index, Type* type,
+			const Storage& storage, llvm::Value* temporary)
 	{
-		static string formatError(const string& id, ASTNode* node)
+		VectorType* vectortype = type->asVector();
+		if (storage.type == Storage::Native)
 		{
-			std::stringstream s;
-			s << "unknown operator '" << id << "'";
-			return node->position.formatError(s.str());
+			llvm::Value* p = builder.CreateGEP(array, index);
+			return vectortype ? p : builder.CreateLoad(p);
 		}
 
-	public:
-		OperatorException(const string& id, ASTNode* node):
-			CompilationException(formatError(id, node))
+		if (!vectortype)
+			return decodeValue(builder.CreateLoad(
+					builder.CreateGEP(array, index)), storage, type->llvmx);
+
+		llvm::Type* t = index->getType();
+		llvm::Value* first = builder.CreateMul(index,
+				llvm::ConstantInt::get(t, vectortype->size));
+		llvm::Value* v = llvm::UndefValue::get(vectortype->llvm);
+		for (unsigned j=0; j<vectortype->size; j++)
 		{
+			llvm::Value* p = builder.CreateGEP(array,
+					builder.CreateAdd(first, llvm::ConstantInt::get(t, j)));
+			v = vectortype->setElement(v, j, decodeValue(
+					builder.CreateLoad(p), storage, vectortype->element->llvm));
 		}
-	};
+		vectortype->storeToArray(v, temporary);
+		return temporary;
+	}
 
-	class IntrinsicTypeException : public CompilationException
+	/* Where the toplevel function should write a row's value of an
+	 * output, and how it gets from there into the array. */
+
+	llvm::Value* outputPointer(llvm::Value* array, llvm::Value* index,
+			const Storage& storage, llvm::Value* temporary)
 	{
-		static string formatError(const string& id, char type, ASTNode* node)
+		if (storage.type == Storage::Native)
+			return builder.CreateGEP(array, index);
+		return temporary;
+	}
+
+	void storeOutput(llvm::Value* array, llvm::Value* index, Type* type,
+			const Storage& storage, llvm::Value* temporary)
+	{
+		if (storage.type == Storage::Native)
+			return;
+
+		VectorType* vectortype = type->asVector();
+		llvm::Value* v = builder.CreateLoad(temporary);
+		if (!vectortype)
 		{
-			std::stringstream s;
-			s << "wrong type applied to '" << id << "'";
-			return node->position.formatError(s.str());
+			builder.CreateStore(encodeValue(v, storage),
+					builder.CreateGEP(array, index));
+			return;
 		}
 
-	public:
-		IntrinsicTypeException(const string& id, char type, ASTNode* node):
-			CompilationException(formatError(id, type, node))
+		llvm::Type* t = index->getType();
+		llvm::Value* first = builder.CreateMul(index,
+				llvm::ConstantInt::get(t, vectortype->size));
+		for (unsigned j=0; j<vectortype->size; j++)
 		{
+			llvm::Value* p = builder.CreateGEP(array,
+					builder.CreateAdd(first, llvm::ConstantInt::get(t, j)));
+			builder.CreateStore(encodeValue(vectortype->getElement(v, j),
+					storage), p);
 		}
-	};
+	}
 
-public:
-	Compiler(llvm::LLVMContext& context, llvm::Module* module,
-			llvm::ExecutionEngine* engine, const map<string, string>& typealiases):
-		CompilerState(context, module, engine),
-		_typeRegistry(*this, typealiases)
+	/* Converts a stored value to the given type, which is a floating point
+	 * type, an int or a boolean. */
+
+	llvm::Value* decodeValue(llvm::Value* v, const Storage& storage,
+			llvm::Type* type)
 	{
-		types = &_typeRegistry;
+		if (storage.type == Storage::Native)
+			return v;
 
-		intType = llvm::IntegerType::get(context, 32);
-		realType = types->find("real");
-		doubleType = llvm::Type::getDoubleTy(context);
-		floatType = llvm::Type::getFloatTy(context);
-		booleanType = types->find("boolean");
+		if (type->isIntegerTy(1))
+			return builder.CreateICmpNE(v,
+					llvm::ConstantInt::get(v->getType(), 0));
+		if (type->isIntegerTy())
+		{
+			if (storage.type == Storage::Int16)
+				return builder.CreateSExt(v, type);
+			return builder.CreateZExtOrBitCast(v, type);
+		}
 
-		_operatorPrecedence["and"] = 5;
-		_operatorPrecedence["or"] = 5;
-		_operatorPrecedence["<"] = 10;
-		_operatorPrecedence["<="] = 10;
-		_operatorPrecedence[">"] = 10;
-		_operatorPrecedence[">="] = 10;
-		_operatorPrecedence["=="] = 10;
-		_operatorPrecedence["!="] = 10;
-		_operatorPrecedence["+"] = 20;
-		_operatorPrecedence["-"] = 20;
-		_operatorPrecedence["*"] = 30;
-		_operatorPrecedence["/"] = 30;
+		switch (storage.type)
+		{
+			case Storage::UInt8:
+			case Storage::UInt16:
+				v = builder.CreateUIToFP(v, type);
+				break;
+
+			case Storage::Int16:
+			case Storage::Int32:
+				v = builder.CreateSIToFP(v, type);
+				break;
+
+			case Storage::Half:
+				v = convertFloat(decodeHalf(v), type);
+				break;
+
+			default:
+				v = convertFloat(v, type);
+		}
+
+		if (storage.scale != 1)
+			v = builder.CreateFMul(v, llvm::ConstantFP::get(type, storage.scale));
+		if (storage.offset != 0)
+			v = builder.CreateFAdd(v, llvm::ConstantFP::get(type, storage.offset));
+		return v;
 	}
 
-public:
-	ToplevelSymbol* compile(std::istream& signaturestream, std::istream& codestream,
-			SymbolTable* globals)
+	/* Converts a real (or int, or boolean) to how it's stored, the other
+	 * way round from decodeValue(). Reals are rounded to nearest, with
+	 * halves rounded away from zero, and saturate at the limits of their
+	 * type, as ints do; NaNs become the lowest value. Halves saturate at
+	 * +/-65504 rather than overflowing to infinity. Int32s are worked out
+	 * in double precision, as floats can't represent their limits. */
+
+	llvm::Value* encodeValue(llvm::Value* v, const Storage& storage)
 	{
-		vector<VariableSymbol*> arguments;
-		vector<VariableSymbol*> returns;
+		if (storage.type == Storage::Native)
+			return v;
+
+		llvm::Type* t = storageType(storage);
+		if (v->getType()->isIntegerTy(1))
+			return builder.CreateZExt(v, t);
+		if (v->getType()->isIntegerTy())
+			return encodeInt(v, storage);
+
+		if (storage.type == Storage::Int32)
+			v = convertFloat(v, doubleType);
+		llvm::Type* type = v->getType();
+		if (storage.offset != 0)
+			v = builder.CreateFSub(v, llvm::ConstantFP::get(type, storage.offset));
+		if (storage.scale != 1)
+			v = builder.CreateFMul(v, llvm::ConstantFP::get(type,
+					1.0 / storage.scale));
+
+		double lo;
+		double hi;
+		switch (storage.type)
+		{
+			case Storage::Float:
+			case Storage::Double:
+				return convertFloat(v, t);
+
+			case Storage::Half:
+				v = convertFloat(v, floatType);
+				v = clamp(v, -65504.0, 65504.0, false);
+				return encodeHalf(v);
+
+			case Storage::UInt8:  lo = 0;           hi = 255;        break;
+			case Storage::UInt16: lo = 0;           hi = 65535;      break;
+			case Storage::Int16:  lo = -32768;      hi = 32767;      break;
+			default:              lo = -2147483648.0; hi = 2147483647.0; break;
+		}
+
+		v = clamp(v, lo, hi, true);
+
+		/* Adding a half and truncating would round up numbers just below a
+		 * half, as the addition itself rounds; so truncate, and then look
+		 * at what was cut off (which is exact). All the limits fit in an
+		 * int, and rounding can't take the value outside them. */
+
+		llvm::Value* i = builder.CreateFPToSI(v, intType);
+		llvm::Value* fraction = builder.CreateFSub(v,
+				builder.CreateSIToFP(i, type));
+		llvm::Value* one = llvm::ConstantInt::get(intType, 1);
+		i = builder.CreateSelect(
+				builder.CreateFCmpOGE(fraction, llvm::ConstantFP::get(type, 0.5)),
+				builder.CreateAdd(i, one), i);
+		i = builder.CreateSelect(
+				builder.CreateFCmpOLE(fraction, llvm::ConstantFP::get(type, -0.5)),
+				builder.CreateSub(i, one), i);
+		return builder.CreateTrunc(i, t);
+	}
+
+	llvm::Value* encodeInt(llvm::Value* v, const Storage& storage)
+	{
+		int lo;
+		int hi;
+		switch (storage.type)
+		{
+			case Storage::UInt8:  lo = 0;      hi = 255;   break;
+			case Storage::UInt16: lo = 0;      hi = 65535; break;
+			case Storage::Int16:  lo = -32768; hi = 32767; break;
+			default:              return v;
+		}
 
-		L signaturelexer(signaturestream);
-		parse_toplevelsignature(signaturelexer, arguments, returns);
-		expect_eof(signaturelexer);
+		llvm::Type* type = v->getType();
+		llvm::Value* lov = llvm::ConstantInt::get(type, lo, true);
+		llvm::Value* hiv = llvm::ConstantInt::get(type, hi, true);
+		v = builder.CreateSelect(builder.CreateICmpSLT(v, lov), lov, v);
+		v = builder.CreateSelect(builder.CreateICmpSGT(v, hiv), hiv, v);
+		return builder.CreateTrunc(v, storageType(storage));
+	}
 
-		/* Create the special symbol which represents the toplevel function. */
+	/* Limits a value to [lo, hi]. NaNs become lo if nanislo is set, and
+	 * are left alone otherwise. */
 
-		ToplevelSymbol* toplevelsymbol = retain(new ToplevelSymbol("<toplevel>",
-				arguments, returns));
+	llvm::Value* clamp(llvm::Value* v, double lo, double hi, bool nanislo)
+	{
+		llvm::Type* type = v->getType();
+		llvm::Value* lov = llvm::ConstantFP::get(type, lo);
+		llvm::Value* hiv = llvm::ConstantFP::get(type, hi);
 
-		/* Compile the code to an AST. */
+		if (nanislo)
+			v = builder.CreateSelect(builder.CreateFCmpOGT(v, lov), v, lov);
+		else
+			v = builder.CreateSelect(builder.CreateFCmpOLT(v, lov), lov, v);
+		return builder.CreateSelect(builder.CreateFCmpOGT(v, hiv), hiv, v);
+	}
 
-		L codelexer(codestream);
-		MultipleSymbolTable symboltable(globals);
-		ASTToplevel* ast = parse_toplevel(codelexer, toplevelsymbol, &symboltable);
+	/* Narrows a float to the bits of a half, rounding to nearest even,
+	 * again with nothing but integer and float arithmetic. Values too
+	 * small to be normal halves are rounded by the FPU itself, by adding
+	 * a magic number which pushes the bits we want to the bottom of the
+	 * mantissa. The value must already be in range. */
 
-		/* Ensure we've reached the end of the file. */
+	llvm::Value* encodeHalf(llvm::Value* f)
+	{
+		llvm::Value* bits = builder.CreateBitCast(f, intType);
+		llvm::Value* sign = builder.CreateAnd(bits, 0x80000000);
+		llvm::Value* magnitude = builder.CreateXor(bits, sign);
+
+		/* Rebias the exponent, and round. */
+
+		llvm::Value* odd = builder.CreateAnd(builder.CreateLShr(magnitude, 13), 1);
+		llvm::Value* normal = builder.CreateAdd(magnitude,
+				llvm::ConstantInt::get(intType, 0xc8000fff));
+		normal = builder.CreateLShr(builder.CreateAdd(normal, odd), 13);
+
+		llvm::Value* magic = llvm::ConstantFP::get(floatType, 0.5);
+		llvm::Value* small = builder.CreateSub(
+				builder.CreateBitCast(builder.CreateFAdd(
+					builder.CreateBitCast(magnitude, floatType), magic), intType),
+				llvm::ConstantInt::get(intType, 0x3f000000));
+
+		llvm::Value* h = builder.CreateSelect(
+				builder.CreateICmpULT(magnitude,
+					llvm::ConstantInt::get(intType, 113 << 23)),
+				small, normal);
+		h = builder.CreateSelect(
+				builder.CreateICmpUGT(magnitude,
+					llvm::ConstantInt::get(intType, 0x7f800000)),
+				llvm::ConstantInt::get(intType, 0x7e00), h);
+		h = builder.CreateOr(h, builder.CreateLShr(sign, 16));
+		return builder.CreateTrunc(h, llvm::Type::getInt16Ty(context));
+	}
 
-		expect(codelexer, L::ENDOFFILE);
+	/* Widens the bits of a half to a float without help from the CPU (or
+	 * a runtime library). Moving the exponent and mantissa into place and
+	 * multiplying by 2^112 rebiases the exponent, and handles denormals
+	 * too; infinities and NaNs just need their exponent filling in. */
 
-		/* Create the interface function from this signature. */
+	llvm::Value* decodeHalf(llvm::Value* v)
+	{
+		llvm::Value* bits = builder.CreateZExt(v, intType);
+		llvm::Value* sign = builder.CreateShl(builder.CreateAnd(bits, 0x8000), 16);
+		llvm::Value* magnitude = builder.CreateAnd(bits, 0x7fff);
+		llvm::Value* shifted = builder.CreateShl(magnitude, 13);
+
+		llvm::Value* finite = builder.CreateFMul(
+				builder.CreateBitCast(shifted, floatType),
+				llvm::ConstantFP::get(floatType,
+					5192296858534827628530496329220096.0));
+		llvm::Value* special = builder.CreateBitCast(
+				builder.CreateOr(shifted, 0x7f800000), floatType);
+		llvm::Value* f = builder.CreateSelect(
+				builder.CreateICmpUGE(magnitude,
+					llvm::ConstantInt::get(intType, 0x7c00)),
+				special, finite);
+
+		return builder.CreateBitCast(
+				builder.CreateOr(builder.CreateBitCast(f, intType), sign),
+				floatType);
+	}
+
+	/* Finds the field a parameter is bound to, checking that it fits. */
+
+	const RecordLayout::Field& recordField(const RecordLayout& layout,
+			VariableSymbol* symbol)
+	{
+		map<string, RecordLayout::Field>::const_iterator i =
+				layout.fields.find(symbol->name);
+		std::stringstream s;
+		if (i == layout.fields.end())
+			s << "parameter '" << symbol->name
+			  << "' isn't bound to a record field";
+		else
+		{
+			const RecordLayout::Field& field = i->second;
+			VectorType* vectortype = symbol->type->asVector();
+			unsigned elements = vectortype ? vectortype->size : 1;
+
+			if (!symbol->type->llvm->isFPOrFPVectorTy() &&
+					(field.type != RecordLayout::Int32))
+				s << "boolean or int parameter '" << symbol->name
+				  << "' must be bound to an Int32 field";
+			else if ((field.offset + field.size()*elements) > layout.stride)
+				s << "record field for '" << symbol->name
+				  << "' doesn't fit in the record";
+			else
+				return field;
+		}
+		throw CompilationException(s.str());
+	}
+
+	/* Fields are only as aligned as both their offset and the stride
+	 * allow. */
+
+	static unsigned fieldAlignment(size_t offset, size_t stride, size_t size)
+	{
+		unsigned alignment = 1;
+		while ((alignment < size) &&
+				!(offset & alignment) && !(stride & alignment))
+			alignment <<= 1;
+		return alignment;
+	}
+
+	llvm::Value* fieldPointer(llvm::Value* record, const RecordLayout::Field& field,
+			unsigned element)
+	{
+		llvm::Type* t = intType;
+		if (field.type == RecordLayout::Float)
+			t = floatType;
+		else if (field.type == RecordLayout::Double)
+			t = doubleType;
+
+		llvm::Value* p = builder.CreateConstGEP1_64(record,
+				field.offset + field.size()*element);
+		return builder.CreateBitCast(p, t->getPointerTo());
+	}
+
+	/* Loads one element of a field, converting it to the given type, which
+	 * is a floating point type, an int or a boolean. */
+
+	llvm::Value* loadField(llvm::Value* record, size_t stride,
+			const RecordLayout::Field& field, unsigned element, llvm::Type* type)
+	{
+		size_t offset = field.offset + field.size()*element;
+		llvm::Value* v = builder.CreateAlignedLoad(
+				fieldPointer(record, field, element),
+				fieldAlignment(offset, stride, field.size()));
+
+		if (field.type == RecordLayout::Int32)
+		{
+			if (type->isIntegerTy(1))
+				return builder.CreateICmpNE(v,
+						llvm::ConstantInt::get(intType, 0));
+			if (type->isIntegerTy())
+				return v;
+			return builder.CreateSIToFP(v, type);
+		}
+		return convertFloat(v, type);
+	}
+
+	void storeField(llvm::Value* record, size_t stride,
+			const RecordLayout::Field& field, unsigned element, llvm::Value* v)
+	{
+		size_t offset = field.offset + field.size()*element;
+		llvm::Value* p = fieldPointer(record, field, element);
+		llvm::Type* type = p->getType()->getPointerElementType();
+
+		/* Reals are rounded and saturated just as Int32 storage does it. */
+
+		if (field.type == RecordLayout::Int32)
+		{
+			if (v->getType()->isIntegerTy())
+				v = builder.CreateZExtOrBitCast(v, type);
+			else
+				v = encodeValue(v, Storage(Storage::Int32));
+		}
+		else
+			v = convertFloat(v, type);
+
+		builder.CreateAlignedStore(v, p,
+				fieldAlignment(offset, stride, field.size()));
+	}
+
+	llvm::Value* convertFloat(llvm::Value* v, llvm::Type* type)
+	{
+		unsigned from = v->getType()->getPrimitiveSizeInBits();
+		unsigned to = type->getPrimitiveSizeInBits();
+		if (from > to)
+			return builder.CreateFPTrunc(v, type);
+		if (from < to)
+			return builder.CreateFPExt(v, type);
+		return v;
+	}
+
+	/* The row a given lane reads from in a partial group: rows past the end
+	 * of the batch are clamped to the last one. */
+
+	llvm::Value* laneRow(llvm::Value* index, llvm::Value* count, unsigned lane)
+	{
+		llvm::Type* t = index->getType();
+		llvm::Value* row = builder.CreateAdd(index, llvm::ConstantInt::get(t, lane));
+		llvm::Value* last = builder.CreateSub(count, llvm::ConstantInt::get(t, 1));
+		return builder.CreateSelect(builder.CreateICmpULT(row, count), row, last);
+	}
+
+	/* Creates the external function for a toplevel symbol and marshals its
+	 * input parameters to internal types, leaving the builder at the end of
+	 * its entry block. */
 
+	void createEntrypoint(ToplevelSymbol* toplevel, const string& name)
+	{
+		const vector<VariableSymbol*>& arguments = toplevel->arguments;
+		const vector<VariableSymbol*>& returns = toplevel->returns;
 		vector<llvm::Type*> externaltypes;
 
 		for (unsigned i=0; i<arguments.size(); i++)
@@ -171,17 +1907,16 @@ public:
 				llvm::Type::getVoidTy(context),
 				externaltypes, false);
 
-		toplevelsymbol->function = llvm::Function::Create(ft,
-				llvm::Function::ExternalLinkage,
-				"Entrypoint", module);
+		toplevel->function = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage, name, module);
 
 		llvm::BasicBlock* bb = llvm::BasicBlock::Create(context, "entry",
-			toplevelsymbol->function);
+			toplevel->function);
 		builder.SetInsertPoint(bb);
 
-		/* Marshal any input parameters to internal types. */
+		/* Marshal any input parameters to internal types... */
 
-		llvm::Function::arg_iterator ii = toplevelsymbol->function->arg_begin();
+		llvm::Function::arg_iterator ii = toplevel->function->arg_begin();
 		for (unsigned i=0; i<arguments.size(); i++)
 		{
 			llvm::Value* v = ii;
@@ -192,8 +1927,6 @@ public:
 				v = symbol->type->asVector()->loadFromArray(v);
 			symbol->value = v;
 
-			symboltable.add(symbol);
-
 			ii++;
 		}
 
@@ -210,19 +1943,8 @@ public:
 
 			ii++;
 		}
-
-		/* Generate the IR code. */
-
-		ast->resolveVariables(*this);
-		ast->codegen(*this);
-
-		return toplevelsymbol;
 	}
 
-private:
-	#include "calculon_ast.h"
-
-private:
 	void expect(L& lexer, int token)
 	{
 		if (lexer.token() != token)
@@ -519,11 +2241,19 @@ private:
 			Position position = lexer.position();
 			string id = lexer.id();
 
-			if ((id == "-") || (id == "not"))
+			if ((id == "-") || (id == "~") || (id == "not"))
 			{
 				lexer.next();
 
 				ASTNode* value = parse_tight(lexer);
+
+				/* A negative number is a literal in its own right, so it
+				 * can stand in for an int just as a positive one can. */
+
+				ASTConstant* constant = value->isConstant();
+				if ((id == "-") && constant)
+					return retain(new ASTConstant(position, -constant->value));
+
 				vector<ASTNode*> parameters;
 				parameters.push_back(value);
 				return retain(new ASTFunctionCall(position, "method "+id,
@@ -697,6 +2427,72 @@ private:
 		ASTNode* body = parse_expression(lexer);
 		return retain(new ASTToplevel(position, toplevel, body, symboltable));
 	}
+
+	/* Library-level definitions are introduced with 'let ... in', just like
+	 * anywhere else, but only functions may be defined there; they're
+	 * followed by one or more exports. */
+
+	ASTLibrary* parse_library(L& lexer, SymbolTable* symboltable)
+	{
+		Position position = lexer.position();
+		ASTLibrary* library = retain(new ASTLibrary(position, symboltable));
+
+		while ((lexer.token() == L::IDENTIFIER) && (lexer.id() == "let"))
+		{
+			Position position = lexer.position();
+			lexer.next();
+
+			string id;
+			parse_identifier(lexer, id);
+			if (lexer.token() != L::OPENPAREN)
+				lexer.error("only functions can be defined outside an export");
+
+			vector<VariableSymbol*> arguments;
+			Type* returntype;
+			parse_functionsignature(lexer, arguments, returntype);
+
+			FunctionSymbol* f = retain(
+					new FunctionSymbol(id, arguments, returntype));
+
+			expect_operator(lexer, "=");
+			ASTNode* value = parse_expression(lexer);
+			expect_identifier(lexer, "in");
+
+			library->addDefinition(
+					retain(new ASTFunctionBody(position, f, value)));
+		}
+
+		set<string> names;
+		do
+		{
+			Position position = lexer.position();
+			expect_identifier(lexer, "export");
+
+			string id;
+			parse_identifier(lexer, id);
+			if (!names.insert(id).second)
+			{
+				std::stringstream s;
+				s << "'" << id << "' is exported more than once";
+				lexer.error(s.str());
+			}
+
+			vector<VariableSymbol*> arguments;
+			vector<VariableSymbol*> returns;
+			parse_toplevelsignature(lexer, arguments, returns);
+			ToplevelSymbol* toplevel = retain(new ToplevelSymbol(id,
+					arguments, returns));
+
+			expect_operator(lexer, "=");
+			ASTNode* body = parse_expression(lexer);
+
+			library->addExport(
+					retain(new ASTToplevel(position, toplevel, body, NULL)));
+		}
+		while (lexer.token() != L::ENDOFFILE);
+
+		return library;
+	}
 };
 
 #endif
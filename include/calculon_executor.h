@@ -0,0 +1,613 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_EXECUTOR_H
+#define CALCULON_EXECUTOR_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* A BatchExecutor runs batch functions (or anything else which works on a
+ * range of rows) across a pool of threads. Each thread starts off with an
+ * equal share of the rows, which it works through in chunks that get
+ * smaller as it goes; a thread which runs out steals the back half of
+ * whichever other thread has the most left. So rows which are much more
+ * expensive than others don't leave the rest of the threads idle. Each row
+ * is only ever processed once, by a single call, so results always end up
+ * in the same place however the work was divided. Like CompileService, it
+ * needs CALCULON_THREADS. */
+
+class BatchExecutor
+{
+	/* The rows a thread has yet to process, [begin, end). */
+
+	struct Slot
+	{
+		boost::mutex lock;
+		size_t begin;
+		size_t end;
+
+		Slot():
+			begin(0),
+			end(0)
+		{
+		}
+	};
+
+	struct Job
+	{
+		virtual ~Job()
+		{
+		}
+
+		virtual void run(size_t begin, size_t end) = 0;
+	};
+
+	template <class F>
+	struct FunctionJob : public Job
+	{
+		F& f;
+
+		FunctionJob(F& f):
+			f(f)
+		{
+		}
+
+		void run(size_t begin, size_t end)
+		{
+			f(begin, end);
+		}
+	};
+
+	unsigned _threads;
+	size_t _grain;
+	size_t _chunk;
+	Slot* _slots;
+	boost::mutex _runlock;
+	boost::mutex _lock;
+	boost::condition_variable _started;
+	boost::condition_variable _finished;
+	Job* _job;
+	unsigned _generation;
+	unsigned _pending;
+	bool _stopping;
+	boost::thread_group _workers;
+
+public:
+	/* threads is the total number of threads to use, including the one
+	 * which calls run(); by default there's one per core. Rows are handed
+	 * out in multiples of grain (apart from the last few), which should be
+	 * enough rows to be worth the cost of taking a lock; for lane-parallel
+	 * batches, it should also be a multiple of the number of lanes. */
+
+	BatchExecutor(unsigned threads = 0, size_t grain = 64):
+		_threads(threads),
+		_grain(grain ? grain : 1),
+		_chunk(_grain),
+		_job(NULL),
+		_generation(0),
+		_pending(0),
+		_stopping(false)
+	{
+		if (_threads == 0)
+			_threads = boost::thread::hardware_concurrency();
+		if (_threads == 0)
+			_threads = 1;
+
+		_slots = new Slot[_threads];
+		for (unsigned i = 1; i < _threads; i++)
+			_workers.create_thread(Worker(*this, i));
+	}
+
+	~BatchExecutor()
+	{
+		{
+			boost::lock_guard<boost::mutex> guard(_lock);
+			_stopping = true;
+		}
+		_started.notify_all();
+		_workers.join_all();
+		delete[] _slots;
+	}
+
+	unsigned threads() const
+	{
+		return _threads;
+	}
+
+	/* Calls f(begin, end) on various threads until every row in [0, count)
+	 * has been covered exactly once, and returns when they've all finished.
+	 * f is shared between threads, and mustn't throw. Only one batch runs
+	 * at a time; calls from other threads wait their turn. */
+
+	template <class F>
+	void parallelFor(size_t count, F& f)
+	{
+		parallelFor(count, f, _grain);
+	}
+
+	/* The same, with a different grain. */
+
+	template <class F>
+	void parallelFor(size_t count, F& f, size_t grain)
+	{
+		if (grain == 0)
+			grain = 1;
+		if ((_threads == 1) || (count <= grain))
+		{
+			if (count)
+				f(0, count);
+			return;
+		}
+
+		FunctionJob<F> job(f);
+		boost::lock_guard<boost::mutex> runguard(_runlock);
+		_chunk = grain;
+
+		for (unsigned i = 0; i < _threads; i++)
+		{
+			boost::lock_guard<boost::mutex> guard(_slots[i].lock);
+			_slots[i].begin = boundary(count, i);
+			_slots[i].end = boundary(count, i+1);
+		}
+
+		{
+			boost::lock_guard<boost::mutex> guard(_lock);
+			_job = &job;
+			_pending = _threads - 1;
+			_generation++;
+		}
+		_started.notify_all();
+
+		participate(0);
+
+		boost::unique_lock<boost::mutex> guard(_lock);
+		while (_pending)
+			_finished.wait(guard);
+		_job = NULL;
+	}
+
+	/* Runs a batch function over count rows, calling it once per chunk with
+	 * each array advanced to the start of the chunk. The arrays are passed
+	 * as typed pointers, in the same order as the batch function takes
+	 * them, so this works for any layout: with Records there's just the
+	 * one. */
+
+	template <class B, class A1>
+	void run(B* batch, size_t count, A1 a1)
+	{
+		Chunk1<B, A1> chunk = { batch, a1 };
+		parallelFor(count, chunk);
+	}
+
+	template <class B, class A1, class A2>
+	void run(B* batch, size_t count, A1 a1, A2 a2)
+	{
+		Chunk2<B, A1, A2> chunk = { batch, a1, a2 };
+		parallelFor(count, chunk);
+	}
+
+	template <class B, class A1, class A2, class A3>
+	void run(B* batch, size_t count, A1 a1, A2 a2, A3 a3)
+	{
+		Chunk3<B, A1, A2, A3> chunk = { batch, a1, a2, a3 };
+		parallelFor(count, chunk);
+	}
+
+	template <class B, class A1, class A2, class A3, class A4>
+	void run(B* batch, size_t count, A1 a1, A2 a2, A3 a3, A4 a4)
+	{
+		Chunk4<B, A1, A2, A3, A4> chunk = { batch, a1, a2, a3, a4 };
+		parallelFor(count, chunk);
+	}
+
+	template <class B, class A1, class A2, class A3, class A4, class A5>
+	void run(B* batch, size_t count, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5)
+	{
+		Chunk5<B, A1, A2, A3, A4, A5> chunk = { batch, a1, a2, a3, a4, a5 };
+		parallelFor(count, chunk);
+	}
+
+	template <class B, class A1, class A2, class A3, class A4, class A5,
+			class A6>
+	void run(B* batch, size_t count, A1 a1, A2 a2, A3 a3, A4 a4, A5 a5, A6 a6)
+	{
+		Chunk6<B, A1, A2, A3, A4, A5, A6> chunk =
+				{ batch, a1, a2, a3, a4, a5, a6 };
+		parallelFor(count, chunk);
+	}
+
+	/* Evaluates a whole grid with a grid kernel, spreading the tiles
+	 * between the threads. */
+
+	void runGrid(const Grid& grid, GridFunction* kernel, void* const* outputs)
+	{
+		GridChunk chunk = { &grid, kernel, outputs };
+		parallelFor(grid.tiles(), chunk, 1);
+	}
+
+	/* Runs a Reduce batch function over count rows, leaving one result
+	 * per output in results. The rows are cut into at most 256 blocks of
+	 * equal size, whatever the number of threads; each block is reduced
+	 * on its own and the partial results combined in block order, so the
+	 * answer is always the same for a given grain. reductions must be the
+	 * ones the function was compiled with. */
+
+	template <class B>
+	void reduce(const vector<CompileOptions::Reduction>& reductions,
+			B* batch, size_t count, Real* results)
+	{
+		vector<Real> storage;
+		Partials partials(storage, reductions.size(), blockSize(count), count);
+		Chunk1<B, Partials> chunk = { batch, partials };
+		reduceBlocks(reductions, count, chunk, partials, results);
+	}
+
+	template <class B, class A1>
+	void reduce(const vector<CompileOptions::Reduction>& reductions,
+			B* batch, size_t count, A1 a1, Real* results)
+	{
+		vector<Real> storage;
+		Partials partials(storage, reductions.size(), blockSize(count), count);
+		Chunk2<B, A1, Partials> chunk = { batch, a1, partials };
+		reduceBlocks(reductions, count, chunk, partials, results);
+	}
+
+	template <class B, class A1, class A2>
+	void reduce(const vector<CompileOptions::Reduction>& reductions,
+			B* batch, size_t count, A1 a1, A2 a2, Real* results)
+	{
+		vector<Real> storage;
+		Partials partials(storage, reductions.size(), blockSize(count), count);
+		Chunk3<B, A1, A2, Partials> chunk = { batch, a1, a2, partials };
+		reduceBlocks(reductions, count, chunk, partials, results);
+	}
+
+	template <class B, class A1, class A2, class A3>
+	void reduce(const vector<CompileOptions::Reduction>& reductions,
+			B* batch, size_t count, A1 a1, A2 a2, A3 a3, Real* results)
+	{
+		vector<Real> storage;
+		Partials partials(storage, reductions.size(), blockSize(count), count);
+		Chunk4<B, A1, A2, A3, Partials> chunk =
+				{ batch, a1, a2, a3, partials };
+		reduceBlocks(reductions, count, chunk, partials, results);
+	}
+
+	template <class B, class A1, class A2, class A3, class A4>
+	void reduce(const vector<CompileOptions::Reduction>& reductions,
+			B* batch, size_t count, A1 a1, A2 a2, A3 a3, A4 a4, Real* results)
+	{
+		vector<Real> storage;
+		Partials partials(storage, reductions.size(), blockSize(count), count);
+		Chunk5<B, A1, A2, A3, A4, Partials> chunk =
+				{ batch, a1, a2, a3, a4, partials };
+		reduceBlocks(reductions, count, chunk, partials, results);
+	}
+
+private:
+	/* Where each block of a reduction puts its results. Chunks add the
+	 * row they start at to their arrays, so adding a block's first row to
+	 * this gives that block's results. */
+
+	struct Partials
+	{
+		Real* results;
+		size_t outputs;
+		size_t block;
+
+		Partials(vector<Real>& storage, size_t outputs, size_t block,
+				size_t count):
+			outputs(outputs),
+			block(block)
+		{
+			storage.resize(outputs * ((count + block - 1) / block) + 1);
+			results = &storage[0];
+		}
+
+		Real* operator + (size_t row) const
+		{
+			return results + (row / block) * outputs;
+		}
+	};
+
+	size_t blockSize(size_t count) const
+	{
+		size_t groups = (count + _grain - 1) / _grain;
+		size_t blocks = std::max((size_t) 1, std::min(groups, (size_t) 256));
+		return std::max((size_t) 1, (groups + blocks - 1) / blocks * _grain);
+	}
+
+	/* Calls the chunk once per block, however the blocks are shared out. */
+
+	template <class C>
+	struct Blocks
+	{
+		C& chunk;
+		size_t block;
+		size_t count;
+
+		Blocks(C& chunk, size_t block, size_t count):
+			chunk(chunk),
+			block(block),
+			count(count)
+		{
+		}
+
+		void operator () (size_t b, size_t e)
+		{
+			for (size_t i = b; i < e; i++)
+				chunk(i * block, std::min(count, (i+1) * block));
+		}
+	};
+
+	template <class C>
+	void reduceBlocks(const vector<CompileOptions::Reduction>& reductions,
+			size_t count, C& chunk, const Partials& partials, Real* results)
+	{
+		size_t blocks = (count + partials.block - 1) / partials.block;
+		Blocks<C> b(chunk, partials.block, count);
+		parallelFor(blocks, b, 1);
+
+		for (unsigned i = 0; i < reductions.size(); i++)
+		{
+			Real r = 0;
+			if (reductions[i] == CompileOptions::Min)
+				r = std::numeric_limits<Real>::infinity();
+			else if (reductions[i] == CompileOptions::Max)
+				r = -std::numeric_limits<Real>::infinity();
+
+			for (size_t j = 0; j < blocks; j++)
+			{
+				Real v = partials.results[j * partials.outputs + i];
+				switch (reductions[i])
+				{
+					case CompileOptions::Min:
+						if (v < r)
+							r = v;
+						break;
+
+					case CompileOptions::Max:
+						if (v > r)
+							r = v;
+						break;
+
+					case CompileOptions::Mean:
+						r += v * (Real) (std::min(count, (j+1) * partials.block) -
+								j * partials.block);
+						break;
+
+					default:
+						r += v;
+						break;
+				}
+			}
+
+			if (reductions[i] == CompileOptions::Mean)
+				r /= (Real) count;
+			results[i] = r;
+		}
+	}
+
+	struct GridChunk
+	{
+		const Grid* grid;
+		GridFunction* kernel;
+		void* const* outputs;
+
+		void operator () (size_t b, size_t e)
+		{
+			GridTile tile;
+			for (size_t i = b; i < e; i++)
+			{
+				grid->getTile(i, tile);
+				kernel(&tile, outputs);
+			}
+		}
+	};
+
+	template <class B, class A1>
+	struct Chunk1
+	{
+		B* batch; A1 a1;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b);
+		}
+	};
+
+	template <class B, class A1, class A2>
+	struct Chunk2
+	{
+		B* batch; A1 a1; A2 a2;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b, a2+b);
+		}
+	};
+
+	template <class B, class A1, class A2, class A3>
+	struct Chunk3
+	{
+		B* batch; A1 a1; A2 a2; A3 a3;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b, a2+b, a3+b);
+		}
+	};
+
+	template <class B, class A1, class A2, class A3, class A4>
+	struct Chunk4
+	{
+		B* batch; A1 a1; A2 a2; A3 a3; A4 a4;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b, a2+b, a3+b, a4+b);
+		}
+	};
+
+	template <class B, class A1, class A2, class A3, class A4, class A5>
+	struct Chunk5
+	{
+		B* batch; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b, a2+b, a3+b, a4+b, a5+b);
+		}
+	};
+
+	template <class B, class A1, class A2, class A3, class A4, class A5,
+			class A6>
+	struct Chunk6
+	{
+		B* batch; A1 a1; A2 a2; A3 a3; A4 a4; A5 a5; A6 a6;
+
+		void operator () (size_t b, size_t e)
+		{
+			batch(e-b, a1+b, a2+b, a3+b, a4+b, a5+b, a6+b);
+		}
+	};
+
+	/* Where thread i's initial share of the rows starts. Boundaries fall
+	 * on multiples of the grain. */
+
+	size_t boundary(size_t count, unsigned i) const
+	{
+		if (i == _threads)
+			return count;
+		size_t groups = (count + _chunk - 1) / _chunk;
+		return std::min(count, (groups * i / _threads) * _chunk);
+	}
+
+	/* Takes the next chunk from the front of a thread's own rows: an
+	 * eighth of what's left, rounded to the grain, so chunks are big while
+	 * there's plenty of work and small towards the end. */
+
+	bool take(unsigned i, size_t& begin, size_t& end)
+	{
+		Slot& slot = _slots[i];
+		boost::lock_guard<boost::mutex> guard(slot.lock);
+		if (slot.begin >= slot.end)
+			return false;
+
+		size_t n = std::max(_chunk, ((slot.end - slot.begin) / 8) / _chunk * _chunk);
+		begin = slot.begin;
+		end = std::min(slot.end, begin + n);
+		slot.begin = end;
+		return true;
+	}
+
+	/* Moves the back half of the busiest other thread's rows into thread
+	 * i's (empty) slot. Threads with a grain or less left are left to get
+	 * on with it. */
+
+	bool steal(unsigned i)
+	{
+		unsigned victim = i;
+		size_t most = _chunk;
+		for (unsigned j = 0; j < _threads; j++)
+		{
+			if (j == i)
+				continue;
+
+			Slot& slot = _slots[j];
+			boost::lock_guard<boost::mutex> guard(slot.lock);
+			if (slot.end > slot.begin + most)
+			{
+				most = slot.end - slot.begin;
+				victim = j;
+			}
+		}
+		if (victim == i)
+			return false;
+
+		size_t begin, end;
+		{
+			Slot& slot = _slots[victim];
+			boost::lock_guard<boost::mutex> guard(slot.lock);
+			if (slot.end <= slot.begin + _chunk)
+				return true; /* someone got there first; look again */
+
+			size_t middle = slot.begin + (slot.end - slot.begin) / 2;
+			middle = std::max(slot.begin + _chunk, middle / _chunk * _chunk);
+			begin = middle;
+			end = slot.end;
+			slot.end = middle;
+		}
+
+		Slot& slot = _slots[i];
+		boost::lock_guard<boost::mutex> guard(slot.lock);
+		slot.begin = begin;
+		slot.end = end;
+		return true;
+	}
+
+	/* A thread's slot only ever gets refilled by the thread itself, so once
+	 * it's empty and there's nothing worth stealing, it's done. */
+
+	void participate(unsigned i)
+	{
+		for (;;)
+		{
+			size_t begin, end;
+			if (take(i, begin, end))
+				_job->run(begin, end);
+			else if (!steal(i))
+				return;
+		}
+	}
+
+	struct Worker
+	{
+		BatchExecutor& executor;
+		unsigned index;
+
+		Worker(BatchExecutor& executor, unsigned index):
+			executor(executor),
+			index(index)
+		{
+		}
+
+		void operator () ()
+		{
+			executor.worker(index);
+		}
+	};
+
+	void worker(unsigned i)
+	{
+		unsigned generation = 0;
+		for (;;)
+		{
+			{
+				boost::unique_lock<boost::mutex> guard(_lock);
+				while ((_generation == generation) && !_stopping)
+					_started.wait(guard);
+				if (_stopping)
+					return;
+				generation = _generation;
+			}
+
+			participate(i);
+
+			{
+				boost::lock_guard<boost::mutex> guard(_lock);
+				_pending--;
+			}
+			_finished.notify_all();
+		}
+	}
+
+	BatchExecutor(const BatchExecutor&);
+	BatchExecutor& operator = (const BatchExecutor&);
+};
+
+#endif
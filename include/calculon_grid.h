@@ -0,0 +1,164 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_GRID_H
+#define CALCULON_GRID_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* A Grid layout batch function (a grid kernel) evaluates a script over one
+ * tile of a regular grid of up to three dimensions, working out the
+ * coordinates of each point itself. Dimension 0 is x, which varies
+ * fastest. Point i along dimension d has the coordinate
+ * origin[d] + step[d]*i, and its outputs are written to element
+ * sum(i[d] * pitch[d]) of each output array; outputs[] holds one array per
+ * output, laid out as for the Rows layout. Only points from begin (inclusive)
+ * to end (exclusive) are evaluated. */
+
+struct GridTile
+{
+	Real origin[3];
+	Real step[3];
+	size_t begin[3];
+	size_t end[3];
+	size_t pitch[3];
+};
+
+typedef void GridFunction(const GridTile* tile, void* const* outputs);
+
+/* Describes a whole grid, and cuts it up into tiles for a grid kernel. The
+ * grid spans [min, max) along each dimension with the given number of
+ * points; by default the output arrays are packed, so a 2D grid's pitch is
+ * 1 and its width, but a larger row pitch can be set for padded images.
+ * Tiles are sized to keep their outputs in cache. */
+
+class Grid
+{
+public:
+	unsigned dimensions;
+	Real min[3];
+	Real max[3];
+	size_t resolution[3];
+	size_t pitch[3];
+	size_t tile[3];
+
+	Grid(Real minx, Real maxx, size_t width)
+	{
+		init(1);
+		set(0, minx, maxx, width);
+		tile[0] = 4096;
+		pack();
+	}
+
+	Grid(Real minx, Real miny, Real maxx, Real maxy,
+			size_t width, size_t height)
+	{
+		init(2);
+		set(0, minx, maxx, width);
+		set(1, miny, maxy, height);
+		tile[0] = tile[1] = 64;
+		pack();
+	}
+
+	Grid(Real minx, Real miny, Real minz, Real maxx, Real maxy, Real maxz,
+			size_t width, size_t height, size_t depth)
+	{
+		init(3);
+		set(0, minx, maxx, width);
+		set(1, miny, maxy, height);
+		set(2, minz, maxz, depth);
+		tile[0] = tile[1] = tile[2] = 16;
+		pack();
+	}
+
+	/* Sets the distance, in elements, between the starts of consecutive
+	 * rows of the output arrays. */
+
+	void setRowPitch(size_t rowpitch)
+	{
+		pitch[1] = rowpitch;
+		if (dimensions > 2)
+			pitch[2] = rowpitch * resolution[1];
+	}
+
+	void setTileSize(size_t x, size_t y = 1, size_t z = 1)
+	{
+		tile[0] = x ? x : 1;
+		tile[1] = y ? y : 1;
+		tile[2] = z ? z : 1;
+	}
+
+	size_t tiles() const
+	{
+		size_t n = 1;
+		for (unsigned d = 0; d < 3; d++)
+			n *= tilesAlong(d);
+		return n;
+	}
+
+	/* Fills in the description of the given tile (numbered from 0 to
+	 * tiles()-1, x fastest) for the kernel. */
+
+	void getTile(size_t index, GridTile& t) const
+	{
+		for (unsigned d = 0; d < 3; d++)
+		{
+			size_t n = tilesAlong(d);
+			size_t i = index % n;
+			index /= n;
+
+			t.origin[d] = min[d];
+			t.step[d] = (max[d] - min[d]) / (Real) resolution[d];
+			t.begin[d] = i * tile[d];
+			t.end[d] = std::min(resolution[d], t.begin[d] + tile[d]);
+			t.pitch[d] = pitch[d];
+		}
+	}
+
+	/* Evaluates the whole grid on this thread, a tile at a time. (See
+	 * BatchExecutor::runGrid() for doing it on several.) */
+
+	void evaluate(GridFunction* kernel, void* const* outputs) const
+	{
+		GridTile t;
+		for (size_t i = 0, n = tiles(); i < n; i++)
+		{
+			getTile(i, t);
+			kernel(&t, outputs);
+		}
+	}
+
+private:
+	void init(unsigned n)
+	{
+		dimensions = n;
+		for (unsigned d = 0; d < 3; d++)
+			set(d, 0, 1, 1);
+	}
+
+	void set(unsigned d, Real lo, Real hi, size_t n)
+	{
+		min[d] = lo;
+		max[d] = hi;
+		resolution[d] = n;
+		tile[d] = 1;
+	}
+
+	void pack()
+	{
+		pitch[0] = 1;
+		pitch[1] = resolution[0];
+		pitch[2] = resolution[0] * resolution[1];
+	}
+
+	size_t tilesAlong(unsigned d) const
+	{
+		return (resolution[d] + tile[d] - 1) / tile[d];
+	}
+};
+
+#endif
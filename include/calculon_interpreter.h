@@ -0,0 +1,917 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_INTERPRETER_H
+#define CALCULON_INTERPRETER_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Runs a script without generating any machine code. The compiler front end
+ * produces unoptimised IR as usual; that's lowered into a simple register
+ * bytecode, and the IR is then thrown away. Every value gets a fixed slot
+ * (one cell per element) in its function's frame, and constants are
+ * preloaded into the frame image, so most IR instructions become a single
+ * operation. Because the bytecode is made from the same IR the JIT would
+ * compile, the results are the same.
+ *
+ * External functions may only take and return scalars of a single floating
+ * point type, which covers the C library; anything else is rejected at
+ * compile time. Multiply-adds (llvm.fmuladd) are never fused, as in
+ * StrictIEEE code. run() is reentrant, so an interpreted program may be
+ * called from several threads at once. */
+
+class Interpreter
+{
+	union Cell
+	{
+		int64_t i;
+		double d;
+		float f;
+		Real r;
+		void* p;
+	};
+
+	enum Opcode
+	{
+		Move,
+		FAdd, FSub, FMul, FDiv, FMulAdd,
+		FCmpOLT, FCmpOLE, FCmpOGT, FCmpOGE, FCmpOEQ, FCmpONE, FCmpUNE,
+		ICmpEQ, ICmpNE, ICmpSLT, ICmpSLE, ICmpSGT, ICmpSGE,
+		And, Or, Xor,
+		Add32, Sub32, Mul32, SDiv32, SRem32, URem32, Shl32, AShr32,
+		FPToUI32, FPToSI32, SIToFP, FPExt, FPTrunc,
+		Select, SelectVector, ExtractElement, InsertElement,
+		LoadD, LoadF, LoadB, LoadI, StoreD, StoreF, StoreB, StoreI,
+		Jump, JumpIfFalse,
+		Call, TailCall, CallExternalD, CallExternalF,
+		Ret
+	};
+
+	/* Operands are frame slots, except where noted. Vector operations work
+	 * on n consecutive cells. Ints are kept zero extended from 32 bits, so
+	 * the signed operations sign extend them first. */
+
+	struct Operation
+	{
+		Opcode op;
+		unsigned a, b, c, d;
+		unsigned n;
+	};
+
+	enum ArgumentKind
+	{
+		DoubleArgument,
+		FloatArgument,
+		BooleanArgument,
+		IntArgument,
+		PointerArgument
+	};
+
+	struct Function
+	{
+		unsigned entry;
+		vector<Cell> image;
+		vector<unsigned> parameters;
+		vector<unsigned> sizes;
+	};
+
+	/* A call in progress: where to go back to, and where the result goes. */
+
+	struct Return
+	{
+		unsigned pc;
+		unsigned base;
+		unsigned result;
+	};
+
+	/* Translation state for one function. */
+
+	struct Frame
+	{
+		vector<Cell> image;
+		map<llvm::Value*, unsigned> slots;
+		map<llvm::BasicBlock*, unsigned> blocks;
+		vector<pair<unsigned, llvm::BasicBlock*> > fixups;
+	};
+
+	typedef void (*ExternalFunction)();
+
+	SymbolTable& _symbols;
+	vector<Operation> _code;
+	vector<unsigned> _operands;
+	vector<Function> _functions;
+	vector<ExternalFunction> _externals;
+	vector<ArgumentKind> _arguments;
+	vector<llvm::Function*> _pending;
+	map<llvm::Function*, unsigned> _indices;
+
+public:
+	/* Translates the entrypoint and everything it calls. The IR isn't
+	 * needed afterwards. */
+
+	Interpreter(llvm::Function* entrypoint, SymbolTable& symbols):
+		_symbols(symbols)
+	{
+		Calculon::initialize();
+
+		for (llvm::Function::arg_iterator i = entrypoint->arg_begin(),
+				e = entrypoint->arg_end(); i != e; i++)
+		{
+			llvm::Type* t = i->getType();
+			if (t->isDoubleTy())
+				_arguments.push_back(DoubleArgument);
+			else if (t->isFloatTy())
+				_arguments.push_back(FloatArgument);
+			else if (t->isIntegerTy(1))
+				_arguments.push_back(BooleanArgument);
+			else if (t->isIntegerTy(32))
+				_arguments.push_back(IntArgument);
+			else if (t->isPointerTy())
+				_arguments.push_back(PointerArgument);
+			else
+				unsupported("entrypoint parameter type");
+		}
+
+		function_index(entrypoint);
+		for (unsigned i = 0; i < _pending.size(); i++)
+			translate(i);
+
+		_pending.clear();
+		_indices.clear();
+	}
+
+	/* Calls the entrypoint; arguments points at each of its parameters in
+	 * turn. */
+
+	void run(void* const* arguments) const
+	{
+		const Function& entry = _functions[0];
+		vector<Cell> stack(entry.image);
+
+		for (unsigned i = 0; i < _arguments.size(); i++)
+		{
+			Cell& c = stack[entry.parameters[i]];
+			switch (_arguments[i])
+			{
+				case DoubleArgument:
+					c.d = *(const double*) arguments[i];
+					break;
+
+				case FloatArgument:
+					c.f = *(const float*) arguments[i];
+					break;
+
+				case BooleanArgument:
+					c.i = *(const bool*) arguments[i];
+					break;
+
+				case IntArgument:
+					c.i = (uint32_t) *(const int32_t*) arguments[i];
+					break;
+
+				case PointerArgument:
+					c.p = *(void* const*) arguments[i];
+					break;
+			}
+		}
+
+		execute(stack);
+	}
+
+	/* Returns (approximately) how much memory the bytecode uses. */
+
+	size_t size() const
+	{
+		size_t bytes = (_code.size() * sizeof(Operation)) +
+				(_operands.size() * sizeof(unsigned)) +
+				(_externals.size() * sizeof(ExternalFunction));
+		for (typename vector<Function>::const_iterator i = _functions.begin(),
+				e = _functions.end(); i != e; i++)
+		{
+			bytes += sizeof(Function) + (i->image.size() * sizeof(Cell)) +
+					(i->parameters.size() * 2 * sizeof(unsigned));
+		}
+		return bytes;
+	}
+
+private:
+	void execute(vector<Cell>& stack) const
+	{
+		const Operation* code = &_code[0];
+		const unsigned* operands = _operands.empty() ? NULL : &_operands[0];
+		vector<Return> returns;
+		unsigned base = 0;
+		unsigned pc = _functions[0].entry;
+
+		for (;;)
+		{
+			const Operation& o = code[pc++];
+			Cell* r = &stack[base];
+
+			switch (o.op)
+			{
+				case Move:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k] = r[o.b+k];
+					break;
+
+				#define BINARY(opcode, field, expr) \
+					case opcode: \
+						for (unsigned k = 0; k < o.n; k++) \
+						{ \
+							const Cell& x = r[o.b+k]; \
+							const Cell& y = r[o.c+k]; \
+							r[o.a+k].field = (expr); \
+						} \
+						break;
+
+				BINARY(FAdd, r, x.r + y.r)
+				BINARY(FSub, r, x.r - y.r)
+				BINARY(FMul, r, x.r * y.r)
+				BINARY(FDiv, r, x.r / y.r)
+				BINARY(FCmpOLT, i, x.r < y.r)
+				BINARY(FCmpOLE, i, x.r <= y.r)
+				BINARY(FCmpOGT, i, x.r > y.r)
+				BINARY(FCmpOGE, i, x.r >= y.r)
+				BINARY(FCmpOEQ, i, x.r == y.r)
+				BINARY(FCmpONE, i, (x.r < y.r) || (x.r > y.r))
+				BINARY(FCmpUNE, i, !(x.r == y.r))
+				BINARY(ICmpEQ, i, x.i == y.i)
+				BINARY(ICmpNE, i, x.i != y.i)
+				BINARY(ICmpSLT, i, sext(x) < sext(y))
+				BINARY(ICmpSLE, i, sext(x) <= sext(y))
+				BINARY(ICmpSGT, i, sext(x) > sext(y))
+				BINARY(ICmpSGE, i, sext(x) >= sext(y))
+				BINARY(And, i, x.i & y.i)
+				BINARY(Or, i, x.i | y.i)
+				BINARY(Xor, i, x.i ^ y.i)
+				BINARY(Add32, i, (uint32_t) (x.i + y.i))
+				BINARY(Sub32, i, (uint32_t) (x.i - y.i))
+				BINARY(Mul32, i, (uint32_t) (x.i * y.i))
+				BINARY(SDiv32, i, (uint32_t) (sext(x) / sext(y)))
+				BINARY(SRem32, i, (uint32_t) (sext(x) % sext(y)))
+				BINARY(URem32, i, (uint32_t) x.i % (uint32_t) y.i)
+				BINARY(Shl32, i, (uint32_t) (x.i << (y.i & 31)))
+				BINARY(AShr32, i, (uint32_t) (sext(x) >> (y.i & 31)))
+				#undef BINARY
+
+				case FMulAdd:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].r = (r[o.b+k].r * r[o.c+k].r) + r[o.d+k].r;
+					break;
+
+				case FPToUI32:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].i = (uint32_t) (int64_t) r[o.b+k].r;
+					break;
+
+				case FPToSI32:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].i = (uint32_t) (int32_t) r[o.b+k].r;
+					break;
+
+				case SIToFP:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].r = (Real) sext(r[o.b+k]);
+					break;
+
+				case FPExt:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].d = r[o.b+k].f;
+					break;
+
+				case FPTrunc:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].f = (float) r[o.b+k].d;
+					break;
+
+				case Select:
+				{
+					unsigned from = r[o.b].i ? o.c : o.d;
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k] = r[from+k];
+					break;
+				}
+
+				case SelectVector:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k] = r[(r[o.b+k].i ? o.c : o.d) + k];
+					break;
+
+				case ExtractElement:
+					r[o.a] = r[o.b + (r[o.c].i % o.n)];
+					break;
+
+				case InsertElement:
+					r[o.a + (r[o.c].i % o.n)] = r[o.b];
+					break;
+
+				case LoadD:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].d = ((const double*) r[o.b].p)[k];
+					break;
+
+				case LoadF:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].f = ((const float*) r[o.b].p)[k];
+					break;
+
+				case LoadB:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].i = ((const bool*) r[o.b].p)[k];
+					break;
+
+				case LoadI:
+					for (unsigned k = 0; k < o.n; k++)
+						r[o.a+k].i = (uint32_t) ((const int32_t*) r[o.b].p)[k];
+					break;
+
+				case StoreD:
+					for (unsigned k = 0; k < o.n; k++)
+						((double*) r[o.b].p)[k] = r[o.a+k].d;
+					break;
+
+				case StoreF:
+					for (unsigned k = 0; k < o.n; k++)
+						((float*) r[o.b].p)[k] = r[o.a+k].f;
+					break;
+
+				case StoreB:
+					for (unsigned k = 0; k < o.n; k++)
+						((bool*) r[o.b].p)[k] = r[o.a+k].i;
+					break;
+
+				case StoreI:
+					for (unsigned k = 0; k < o.n; k++)
+						((int32_t*) r[o.b].p)[k] = (int32_t) r[o.a+k].i;
+					break;
+
+				case Jump:
+					pc = o.a;
+					break;
+
+				case JumpIfFalse:
+					if (!r[o.b].i)
+						pc = o.a;
+					break;
+
+				case Call:
+				case TailCall:
+				{
+					/* The new frame always goes on the top of the stack. A
+					 * tail call then slides it down over the caller's. */
+
+					const Function& f = _functions[o.b];
+					unsigned top = stack.size();
+					stack.insert(stack.end(), f.image.begin(), f.image.end());
+
+					const unsigned* args = operands + o.c;
+					for (unsigned i = 0; i < o.n; i++)
+						for (unsigned k = 0; k < f.sizes[i]; k++)
+							stack[top + f.parameters[i] + k] = stack[base + args[i] + k];
+
+					if (o.op == TailCall)
+					{
+						std::copy(stack.begin() + top, stack.end(),
+								stack.begin() + base);
+						stack.resize(base + f.image.size());
+					}
+					else
+					{
+						Return ret = { pc, base, o.a };
+						returns.push_back(ret);
+						base = top;
+					}
+					pc = f.entry;
+					break;
+				}
+
+				case CallExternalD:
+				{
+					double args[4];
+					for (unsigned i = 0; i < o.n; i++)
+						args[i] = r[operands[o.c + i]].d;
+					r[o.a].d = callExternal(_externals[o.b], o.n, args);
+					break;
+				}
+
+				case CallExternalF:
+				{
+					float args[4];
+					for (unsigned i = 0; i < o.n; i++)
+						args[i] = r[operands[o.c + i]].f;
+					r[o.a].f = callExternal(_externals[o.b], o.n, args);
+					break;
+				}
+
+				case Ret:
+				{
+					if (returns.empty())
+						return;
+
+					Return ret = returns.back();
+					returns.pop_back();
+					for (unsigned k = 0; k < o.n; k++)
+						stack[ret.base + ret.result + k] = r[o.a+k];
+					stack.resize(base);
+					base = ret.base;
+					pc = ret.pc;
+					break;
+				}
+			}
+		}
+	}
+
+	static int32_t sext(const Cell& c)
+	{
+		return (int32_t) (uint32_t) c.i;
+	}
+
+	template <typename T>
+	static T callExternal(ExternalFunction f, unsigned arity, const T* args)
+	{
+		switch (arity)
+		{
+			case 0: return ((T (*)()) f)();
+			case 1: return ((T (*)(T)) f)(args[0]);
+			case 2: return ((T (*)(T, T)) f)(args[0], args[1]);
+			case 3: return ((T (*)(T, T, T)) f)(args[0], args[1], args[2]);
+			default: return ((T (*)(T, T, T, T)) f)(args[0], args[1], args[2],
+					args[3]);
+		}
+	}
+
+	void unsupported(const string& what)
+	{
+		throw CompilationException(
+				"the interpreter can't run this script (" + what + ")");
+	}
+
+	static bool isReal(llvm::Type* t)
+	{
+		t = t->getScalarType();
+		return S::chooseDoubleOrFloat(t->isDoubleTy(), t->isFloatTy());
+	}
+
+	static unsigned cells(llvm::Type* t)
+	{
+		if (t->isVoidTy())
+			return 0;
+		if (t->isVectorTy())
+			return t->getVectorNumElements();
+		return 1;
+	}
+
+	unsigned function_index(llvm::Function* f)
+	{
+		map<llvm::Function*, unsigned>::const_iterator i = _indices.find(f);
+		if (i != _indices.end())
+			return i->second;
+
+		unsigned index = _functions.size();
+		_indices[f] = index;
+		_functions.push_back(Function());
+		_pending.push_back(f);
+		return index;
+	}
+
+	unsigned emit(Opcode op, unsigned a = 0, unsigned b = 0, unsigned c = 0,
+			unsigned d = 0, unsigned n = 1)
+	{
+		Operation o = { op, a, b, c, d, n };
+		_code.push_back(o);
+		return _code.size() - 1;
+	}
+
+	unsigned allocate(Frame& frame, unsigned size)
+	{
+		unsigned slot = frame.image.size();
+		frame.image.resize(slot + size);
+		return slot;
+	}
+
+	/* Returns the frame slot holding a value, allocating one if necessary.
+	 * Constants are written into the frame image. */
+
+	unsigned slot(Frame& frame, llvm::Value* value)
+	{
+		map<llvm::Value*, unsigned>::const_iterator i = frame.slots.find(value);
+		if (i != frame.slots.end())
+			return i->second;
+
+		llvm::Type* t = value->getType();
+		unsigned s = allocate(frame, cells(t));
+		frame.slots[value] = s;
+
+		if (llvm::isa<llvm::Constant>(value))
+		{
+			llvm::Constant* c = llvm::cast<llvm::Constant>(value);
+			if (t->isVectorTy())
+			{
+				for (unsigned k = 0; k < cells(t); k++)
+					frame.image[s+k] = constant(c->getAggregateElement(k));
+			}
+			else
+				frame.image[s] = constant(c);
+		}
+
+		return s;
+	}
+
+	Cell constant(llvm::Constant* c)
+	{
+		Cell cell;
+		cell.i = 0;
+
+		if (llvm::isa<llvm::UndefValue>(c) || c->isNullValue())
+			return cell;
+
+		llvm::ConstantFP* fp = llvm::dyn_cast<llvm::ConstantFP>(c);
+		if (fp && fp->getType()->isDoubleTy())
+			cell.d = fp->getValueAPF().convertToDouble();
+		else if (fp && fp->getType()->isFloatTy())
+			cell.f = fp->getValueAPF().convertToFloat();
+		else if (llvm::isa<llvm::ConstantInt>(c))
+			cell.i = llvm::cast<llvm::ConstantInt>(c)->getZExtValue();
+		else
+			unsupported("constant expression");
+
+		return cell;
+	}
+
+	void translate(unsigned index)
+	{
+		llvm::Function* f = _pending[index];
+		Frame frame;
+		Function result;
+		result.entry = _code.size();
+
+		for (llvm::Function::arg_iterator i = f->arg_begin(),
+				e = f->arg_end(); i != e; i++)
+		{
+			result.parameters.push_back(slot(frame, i));
+			result.sizes.push_back(cells(i->getType()));
+		}
+
+		for (llvm::Function::iterator bi = f->begin(), be = f->end();
+				bi != be; bi++)
+		{
+			frame.blocks[bi] = _code.size();
+			for (llvm::BasicBlock::iterator ii = bi->begin(), ie = bi->end();
+					ii != ie; ii++)
+			{
+				if (lower(frame, ii))
+					ii++;
+			}
+		}
+
+		for (unsigned i = 0; i < frame.fixups.size(); i++)
+			_code[frame.fixups[i].first].a = frame.blocks[frame.fixups[i].second];
+
+		result.image = frame.image;
+		_functions[index] = result;
+	}
+
+	/* Lowers one instruction. Returns true if the next instruction (the
+	 * return after a tail call) has been dealt with too. */
+
+	bool lower(Frame& frame, llvm::Instruction* i)
+	{
+		llvm::Type* t = i->getType();
+
+		switch (i->getOpcode())
+		{
+			case llvm::Instruction::FAdd: return real(frame, i, FAdd);
+			case llvm::Instruction::FSub: return real(frame, i, FSub);
+			case llvm::Instruction::FMul: return real(frame, i, FMul);
+			case llvm::Instruction::FDiv: return real(frame, i, FDiv);
+
+			case llvm::Instruction::FCmp:
+			{
+				if (!isReal(i->getOperand(0)->getType()))
+					unsupported("comparison type");
+
+				switch (llvm::cast<llvm::FCmpInst>(i)->getPredicate())
+				{
+					case llvm::CmpInst::FCMP_OLT: return binary(frame, i, FCmpOLT);
+					case llvm::CmpInst::FCMP_OLE: return binary(frame, i, FCmpOLE);
+					case llvm::CmpInst::FCMP_OGT: return binary(frame, i, FCmpOGT);
+					case llvm::CmpInst::FCMP_OGE: return binary(frame, i, FCmpOGE);
+					case llvm::CmpInst::FCMP_OEQ: return binary(frame, i, FCmpOEQ);
+					case llvm::CmpInst::FCMP_ONE: return binary(frame, i, FCmpONE);
+					case llvm::CmpInst::FCMP_UNE: return binary(frame, i, FCmpUNE);
+					default: unsupported("comparison");
+				}
+			}
+
+			case llvm::Instruction::ICmp:
+				switch (llvm::cast<llvm::ICmpInst>(i)->getPredicate())
+				{
+					case llvm::CmpInst::ICMP_EQ: return binary(frame, i, ICmpEQ);
+					case llvm::CmpInst::ICMP_NE: return binary(frame, i, ICmpNE);
+					case llvm::CmpInst::ICMP_SLT: return binary(frame, i, ICmpSLT);
+					case llvm::CmpInst::ICMP_SLE: return binary(frame, i, ICmpSLE);
+					case llvm::CmpInst::ICMP_SGT: return binary(frame, i, ICmpSGT);
+					case llvm::CmpInst::ICMP_SGE: return binary(frame, i, ICmpSGE);
+					default: unsupported("comparison");
+				}
+
+			case llvm::Instruction::And: return binary(frame, i, And);
+			case llvm::Instruction::Or:  return binary(frame, i, Or);
+			case llvm::Instruction::Xor: return binary(frame, i, Xor);
+
+			case llvm::Instruction::Add:  return integer(frame, i, Add32);
+			case llvm::Instruction::Sub:  return integer(frame, i, Sub32);
+			case llvm::Instruction::Mul:  return integer(frame, i, Mul32);
+			case llvm::Instruction::SDiv: return integer(frame, i, SDiv32);
+			case llvm::Instruction::SRem: return integer(frame, i, SRem32);
+			case llvm::Instruction::URem: return integer(frame, i, URem32);
+			case llvm::Instruction::Shl:  return integer(frame, i, Shl32);
+			case llvm::Instruction::AShr: return integer(frame, i, AShr32);
+
+			case llvm::Instruction::FPToUI:
+				if (!isReal(i->getOperand(0)->getType()) ||
+						!t->getScalarType()->isIntegerTy(32))
+					unsupported("conversion");
+				return unary(frame, i, FPToUI32);
+
+			case llvm::Instruction::FPToSI:
+				if (!isReal(i->getOperand(0)->getType()) ||
+						!t->getScalarType()->isIntegerTy(32))
+					unsupported("conversion");
+				return unary(frame, i, FPToSI32);
+
+			case llvm::Instruction::SIToFP:
+				if (!isReal(t) ||
+						!i->getOperand(0)->getType()->getScalarType()->isIntegerTy(32))
+					unsupported("conversion");
+				return unary(frame, i, SIToFP);
+
+			case llvm::Instruction::FPExt:  return unary(frame, i, FPExt);
+			case llvm::Instruction::FPTrunc: return unary(frame, i, FPTrunc);
+
+			case llvm::Instruction::Select:
+				emit(i->getOperand(0)->getType()->isVectorTy() ?
+							SelectVector : Select,
+						slot(frame, i), slot(frame, i->getOperand(0)),
+						slot(frame, i->getOperand(1)),
+						slot(frame, i->getOperand(2)), cells(t));
+				return false;
+
+			case llvm::Instruction::ExtractElement:
+				emit(ExtractElement, slot(frame, i),
+						slot(frame, i->getOperand(0)),
+						slot(frame, i->getOperand(1)), 0,
+						cells(i->getOperand(0)->getType()));
+				return false;
+
+			case llvm::Instruction::InsertElement:
+			{
+				unsigned s = slot(frame, i);
+				emit(Move, s, slot(frame, i->getOperand(0)), 0, 0, cells(t));
+				emit(InsertElement, s, slot(frame, i->getOperand(1)),
+						slot(frame, i->getOperand(2)), 0, cells(t));
+				return false;
+			}
+
+			case llvm::Instruction::ShuffleVector:
+			{
+				llvm::ShuffleVectorInst* shuffle =
+						llvm::cast<llvm::ShuffleVectorInst>(i);
+				unsigned s = slot(frame, i);
+				unsigned width = cells(i->getOperand(0)->getType());
+				for (unsigned k = 0; k < cells(t); k++)
+				{
+					int m = shuffle->getMaskValue(k);
+					if (m < 0)
+						continue;
+					if ((unsigned) m < width)
+						emit(Move, s+k, slot(frame, i->getOperand(0)) + m);
+					else
+						emit(Move, s+k, slot(frame, i->getOperand(1)) + m - width);
+				}
+				return false;
+			}
+
+			case llvm::Instruction::PHI:
+				/* Filled in by the branches which lead here. */
+				slot(frame, i);
+				return false;
+
+			case llvm::Instruction::Br:
+			{
+				llvm::BranchInst* br = llvm::cast<llvm::BranchInst>(i);
+				llvm::BasicBlock* from = i->getParent();
+				if (br->isConditional())
+				{
+					unsigned test = emit(JumpIfFalse, 0,
+							slot(frame, br->getCondition()));
+					edge(frame, from, br->getSuccessor(0));
+					_code[test].a = _code.size();
+					edge(frame, from, br->getSuccessor(1));
+				}
+				else
+					edge(frame, from, br->getSuccessor(0));
+				return false;
+			}
+
+			case llvm::Instruction::Ret:
+			{
+				llvm::Value* v = llvm::cast<llvm::ReturnInst>(i)->getReturnValue();
+				if (v)
+					emit(Ret, slot(frame, v), 0, 0, 0, cells(v->getType()));
+				else
+					emit(Ret, 0, 0, 0, 0, 0);
+				return false;
+			}
+
+			case llvm::Instruction::Call:
+				return call(frame, llvm::cast<llvm::CallInst>(i));
+
+			case llvm::Instruction::Load:
+				emit(memory(t, LoadD, LoadF, LoadB, LoadI), slot(frame, i),
+						slot(frame, i->getOperand(0)), 0, 0, cells(t));
+				return false;
+
+			case llvm::Instruction::Store:
+			{
+				llvm::Value* v = i->getOperand(0);
+				emit(memory(v->getType(), StoreD, StoreF, StoreB, StoreI),
+						slot(frame, v), slot(frame, i->getOperand(1)), 0, 0,
+						cells(v->getType()));
+				return false;
+			}
+
+			default:
+				unsupported(string(i->getOpcodeName()) + " instruction");
+		}
+
+		return false;
+	}
+
+	bool unary(Frame& frame, llvm::Instruction* i, Opcode op)
+	{
+		emit(op, slot(frame, i), slot(frame, i->getOperand(0)), 0, 0,
+				cells(i->getType()));
+		return false;
+	}
+
+	bool binary(Frame& frame, llvm::Instruction* i, Opcode op)
+	{
+		emit(op, slot(frame, i), slot(frame, i->getOperand(0)),
+				slot(frame, i->getOperand(1)), 0, cells(i->getType()));
+		return false;
+	}
+
+	bool real(Frame& frame, llvm::Instruction* i, Opcode op)
+	{
+		if (!isReal(i->getType()))
+			unsupported("arithmetic type");
+		return binary(frame, i, op);
+	}
+
+	bool integer(Frame& frame, llvm::Instruction* i, Opcode op)
+	{
+		if (!i->getType()->getScalarType()->isIntegerTy(32))
+			unsupported("integer type");
+		return binary(frame, i, op);
+	}
+
+	Opcode memory(llvm::Type* t, Opcode d, Opcode f, Opcode b, Opcode i)
+	{
+		t = t->getScalarType();
+		if (t->isDoubleTy())
+			return d;
+		if (t->isFloatTy())
+			return f;
+		if (t->isIntegerTy(1))
+			return b;
+		if (t->isIntegerTy(32))
+			return i;
+		unsupported("memory access type");
+		return d;
+	}
+
+	/* Takes a branch from one block to another, first setting any phis in
+	 * the destination. If there are several, they're all read before any
+	 * are written, as they may refer to each other. */
+
+	void edge(Frame& frame, llvm::BasicBlock* from, llvm::BasicBlock* to)
+	{
+		vector<llvm::PHINode*> phis;
+		for (llvm::BasicBlock::iterator i = to->begin(), e = to->end();
+				(i != e) && llvm::isa<llvm::PHINode>(&*i); i++)
+			phis.push_back(llvm::cast<llvm::PHINode>(&*i));
+
+		if (phis.size() == 1)
+		{
+			llvm::PHINode* phi = phis[0];
+			emit(Move, slot(frame, phi),
+					slot(frame, phi->getIncomingValueForBlock(from)), 0, 0,
+					cells(phi->getType()));
+		}
+		else if (!phis.empty())
+		{
+			vector<unsigned> temporaries;
+			for (unsigned k = 0; k < phis.size(); k++)
+			{
+				unsigned n = cells(phis[k]->getType());
+				unsigned s = allocate(frame, n);
+				emit(Move, s,
+						slot(frame, phis[k]->getIncomingValueForBlock(from)), 0,
+						0, n);
+				temporaries.push_back(s);
+			}
+
+			for (unsigned k = 0; k < phis.size(); k++)
+				emit(Move, slot(frame, phis[k]), temporaries[k], 0, 0,
+						cells(phis[k]->getType()));
+		}
+
+		frame.fixups.push_back(std::make_pair(emit(Jump), to));
+	}
+
+	bool call(Frame& frame, llvm::CallInst* i)
+	{
+		llvm::Function* f = i->getCalledFunction();
+		if (!f)
+			unsupported("indirect call");
+
+		if (f->getIntrinsicID() == llvm::Intrinsic::fmuladd)
+		{
+			if (!isReal(i->getType()))
+				unsupported("arithmetic type");
+			emit(FMulAdd, slot(frame, i), slot(frame, i->getArgOperand(0)),
+					slot(frame, i->getArgOperand(1)),
+					slot(frame, i->getArgOperand(2)), cells(i->getType()));
+			return false;
+		}
+
+		unsigned operands = _operands.size();
+		for (unsigned k = 0; k < i->getNumArgOperands(); k++)
+			_operands.push_back(slot(frame, i->getArgOperand(k)));
+
+		if (!f->isDeclaration())
+		{
+			/* A call whose result is returned straight away reuses the
+			 * caller's frame, so tail recursion runs in constant space. */
+
+			llvm::BasicBlock::iterator next = i;
+			next++;
+			llvm::ReturnInst* ret = llvm::dyn_cast<llvm::ReturnInst>(&*next);
+			bool tail = ret && (ret->getReturnValue() == i);
+
+			emit(tail ? TailCall : Call, slot(frame, i), function_index(f),
+					operands, 0, i->getNumArgOperands());
+			return tail;
+		}
+
+		llvm::FunctionType* ft = f->getFunctionType();
+		llvm::Type* t = ft->getReturnType();
+		bool shape = (t->isDoubleTy() || t->isFloatTy()) &&
+				(ft->getNumParams() <= 4);
+		for (unsigned k = 0; k < ft->getNumParams(); k++)
+			shape = shape && (ft->getParamType(k) == t);
+		if (!shape)
+			unsupported("call to '" + f->getName().str() + "'");
+
+		unsigned index = _externals.size();
+		_externals.push_back(external(f->getName().str()));
+		emit(t->isDoubleTy() ? CallExternalD : CallExternalF, slot(frame, i),
+				index, operands, 0, i->getNumArgOperands());
+		return false;
+	}
+
+	/* Registered functions are looked up in the symbol table; anything else
+	 * (i.e. the C library) in the process itself. */
+
+	ExternalFunction external(const string& name)
+	{
+		string prefix = ExternalFunctionSymbol::mangledName("");
+		if (name.compare(0, prefix.size(), prefix) == 0)
+		{
+			Symbol* symbol = _symbols.resolve(name.substr(prefix.size()));
+			if (symbol && symbol->isExternalFunction())
+				return (ExternalFunction)
+						symbol->isExternalFunction()->getPointer();
+		}
+		else
+		{
+			void* p = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(name);
+			if (p)
+				return (ExternalFunction) p;
+		}
+
+		unsupported("can't find function '" + name + "'");
+		return NULL;
+	}
+
+	Interpreter(const Interpreter&);
+	Interpreter& operator = (const Interpreter&);
+};
+
+#endif
@@ -36,65 +36,73 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 	}
 	_notMethod;
 
-	class LTMethod : public BitcodeRealComparisonSymbol
+	class LTMethod : public BitcodeOrderedComparisonSymbol
 	{
 	public:
 		LTMethod():
-			BitcodeRealComparisonSymbol("method <")
+			BitcodeOrderedComparisonSymbol("method <")
 		{
 		}
 
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
+			if (parameters[0]->getType()->getScalarType()->isIntegerTy())
+				return state.builder.CreateICmpSLT(parameters[0], parameters[1]);
 			return state.builder.CreateFCmpOLT(parameters[0], parameters[1]);
 		}
 	}
 	_ltMethod;
 
-	class LEMethod : public BitcodeRealComparisonSymbol
+	class LEMethod : public BitcodeOrderedComparisonSymbol
 	{
 	public:
 		LEMethod():
-			BitcodeRealComparisonSymbol("method <=")
+			BitcodeOrderedComparisonSymbol("method <=")
 		{
 		}
 
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
+			if (parameters[0]->getType()->getScalarType()->isIntegerTy())
+				return state.builder.CreateICmpSLE(parameters[0], parameters[1]);
 			return state.builder.CreateFCmpOLE(parameters[0], parameters[1]);
 		}
 	}
 	_leMethod;
 
-	class GTMethod : public BitcodeRealComparisonSymbol
+	class GTMethod : public BitcodeOrderedComparisonSymbol
 	{
 	public:
 		GTMethod():
-			BitcodeRealComparisonSymbol("method >")
+			BitcodeOrderedComparisonSymbol("method >")
 		{
 		}
 
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
+			if (parameters[0]->getType()->getScalarType()->isIntegerTy())
+				return state.builder.CreateICmpSGT(parameters[0], parameters[1]);
 			return state.builder.CreateFCmpOGT(parameters[0], parameters[1]);
 		}
 	}
 	_gtMethod;
 
-	class GEMethod : public BitcodeRealComparisonSymbol
+	class GEMethod : public BitcodeOrderedComparisonSymbol
 	{
 	public:
 		GEMethod():
-			BitcodeRealComparisonSymbol("method >=")
+			BitcodeOrderedComparisonSymbol("method >=")
 		{
 		}
 
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
+			if (parameters[0]->getType()->getScalarType()->isIntegerTy())
+				return state.builder.CreateICmpSGE(parameters[0], parameters[1]);
 			return state.builder.CreateFCmpOGE(parameters[0], parameters[1]);
 		}
 	}
@@ -115,11 +123,12 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 			if (type == state.realType)
 				return state.builder.CreateFCmpOEQ(parameters[0], parameters[1]);
-			else if (type == state.booleanType)
+			else if ((type == state.booleanType) || (type == state.integerType))
 				return state.builder.CreateICmpEQ(parameters[0], parameters[1]);
 			else if (type->asVector())
 			{
 				VectorType* vtype = type->asVector();
+				bool integer = type->isInteger();
 
 				llvm::Value* v = llvm::ConstantInt::getTrue(state.booleanType->llvm);
 
@@ -127,7 +136,9 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 				{
 					llvm::Value* x0 = vtype->getElement(parameters[0], i);
 					llvm::Value* x1 = vtype->getElement(parameters[1], i);
-					llvm::Value* x = state.builder.CreateFCmpOEQ(x0, x1);
+					llvm::Value* x = integer ?
+							state.builder.CreateICmpEQ(x0, x1) :
+							state.builder.CreateFCmpOEQ(x0, x1);
 					v = state.builder.CreateAnd(v, x);
 				}
 
@@ -157,11 +168,12 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 			if (type == state.realType)
 				return state.builder.CreateFCmpONE(parameters[0], parameters[1]);
-			else if (type == state.booleanType)
+			else if ((type == state.booleanType) || (type == state.integerType))
 				return state.builder.CreateICmpNE(parameters[0], parameters[1]);
 			else if (type->asVector())
 			{
 				VectorType* vtype = type->asVector();
+				bool integer = type->isInteger();
 
 				llvm::Value* v = llvm::ConstantInt::getFalse(state.booleanType->llvm);
 
@@ -169,7 +181,9 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 				{
 					llvm::Value* x0 = vtype->getElement(parameters[0], i);
 					llvm::Value* x1 = vtype->getElement(parameters[1], i);
-					llvm::Value* x = state.builder.CreateFCmpONE(x0, x1);
+					llvm::Value* x = integer ?
+							state.builder.CreateICmpNE(x0, x1) :
+							state.builder.CreateFCmpONE(x0, x1);
 					v = state.builder.CreateOr(v, x);
 				}
 
@@ -184,13 +198,14 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 	}
 	_neMethod;
 
-	class AddMethod : public BitcodeRealOrVectorArraySymbol
+	class AddMethod : public BitcodeArithmeticSymbol
 	{
-		using BitcodeRealOrVectorArraySymbol::convertRHS;
+		using BitcodeArithmeticSymbol::convertRHS;
+		using BitcodeArithmeticSymbol::isInteger;
 
 	public:
 		AddMethod():
-			BitcodeRealOrVectorArraySymbol("method +", 2)
+			BitcodeArithmeticSymbol("method +", 2)
 		{
 		}
 
@@ -201,18 +216,21 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			llvm::Value* rhs = parameters[1];
 			rhs = convertRHS(state, lhs, rhs);
 
+			if (isInteger(lhs))
+				return state.builder.CreateAdd(lhs, rhs);
 			return state.builder.CreateFAdd(lhs, rhs);
 		}
 	}
 	_addMethod;
 
-	class SubMethod : public BitcodeRealOrVectorArraySymbol
+	class SubMethod : public BitcodeArithmeticSymbol
 	{
-		using BitcodeRealOrVectorArraySymbol::convertRHS;
+		using BitcodeArithmeticSymbol::convertRHS;
+		using BitcodeArithmeticSymbol::isInteger;
 
 	public:
 		SubMethod():
-			BitcodeRealOrVectorArraySymbol("method -", -1)
+			BitcodeArithmeticSymbol("method -", -1)
 		{
 		}
 
@@ -223,7 +241,7 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 				return;
 
 			/* Otherwise, let the superclass produce the error. */
-			BitcodeRealOrVectorArraySymbol::checkParameterCount(
+			BitcodeArithmeticSymbol::checkParameterCount(
 					state, calledwith);
 		}
 
@@ -233,6 +251,8 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			switch (parameters.size())
 			{
 				case 1:
+					if (isInteger(parameters[0]))
+						return state.builder.CreateNeg(parameters[0]);
 					return state.builder.CreateFNeg(parameters[0]);
 
 				case 2:
@@ -241,6 +261,8 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 					llvm::Value* rhs = parameters[1];
 					rhs = convertRHS(state, lhs, rhs);
 
+					if (isInteger(lhs))
+						return state.builder.CreateSub(lhs, rhs);
 					return state.builder.CreateFSub(lhs, rhs);
 				}
 
@@ -252,13 +274,14 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 	}
 	_subMethod;
 
-	class MulMethod : public BitcodeRealOrVectorArraySymbol
+	class MulMethod : public BitcodeArithmeticSymbol
 	{
-		using BitcodeRealOrVectorArraySymbol::convertRHS;
+		using BitcodeArithmeticSymbol::convertRHS;
+		using BitcodeArithmeticSymbol::isInteger;
 
 	public:
 		MulMethod():
-			BitcodeRealOrVectorArraySymbol("method *", 2)
+			BitcodeArithmeticSymbol("method *", 2)
 		{
 		}
 
@@ -269,18 +292,22 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			llvm::Value* rhs = parameters[1];
 			rhs = convertRHS(state, lhs, rhs);
 
+			if (isInteger(lhs))
+				return state.builder.CreateMul(lhs, rhs);
 			return state.builder.CreateFMul(lhs, rhs);
 		}
 	}
 	_mulMethod;
 
-	class DivMethod : public BitcodeRealOrVectorArraySymbol
+	class DivMethod : public BitcodeArithmeticSymbol
 	{
-		using BitcodeRealOrVectorArraySymbol::convertRHS;
+		using BitcodeArithmeticSymbol::convertRHS;
+		using BitcodeArithmeticSymbol::isInteger;
+		using BitcodeArithmeticSymbol::divide;
 
 	public:
 		DivMethod():
-			BitcodeRealOrVectorArraySymbol("method /", 2)
+			BitcodeArithmeticSymbol("method /", 2)
 		{
 		}
 
@@ -291,11 +318,231 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			llvm::Value* rhs = parameters[1];
 			rhs = convertRHS(state, lhs, rhs);
 
+			if (isInteger(lhs))
+				return divide(state, lhs, rhs, false);
 			return state.builder.CreateFDiv(lhs, rhs);
 		}
 	}
 	_divMethod;
 
+	class ModMethod : public BitcodeArithmeticSymbol
+	{
+		using BitcodeArithmeticSymbol::convertRHS;
+		using BitcodeArithmeticSymbol::divide;
+
+	public:
+		ModMethod():
+			BitcodeArithmeticSymbol("method %", 2, true)
+		{
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* lhs = parameters[0];
+			llvm::Value* rhs = parameters[1];
+			rhs = convertRHS(state, lhs, rhs);
+
+			return divide(state, lhs, rhs, true);
+		}
+	}
+	_modMethod;
+
+	/* The bitwise operators. Shift counts only use their bottom five bits,
+	 * so they're always in range; >> is an arithmetic shift. */
+
+	class BitwiseMethod : public BitcodeArithmeticSymbol
+	{
+		llvm::Instruction::BinaryOps _opcode;
+
+		using BitcodeArithmeticSymbol::convertRHS;
+
+	public:
+		BitwiseMethod(const string& name, llvm::Instruction::BinaryOps opcode):
+			BitcodeArithmeticSymbol("method " + name, 2, true),
+			_opcode(opcode)
+		{
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* lhs = parameters[0];
+			llvm::Value* rhs = parameters[1];
+			rhs = convertRHS(state, lhs, rhs);
+
+			if ((_opcode == llvm::Instruction::Shl) ||
+					(_opcode == llvm::Instruction::AShr))
+				rhs = state.builder.CreateAnd(rhs,
+						llvm::ConstantInt::get(rhs->getType(), 31));
+			return state.builder.CreateBinOp(_opcode, lhs, rhs);
+		}
+	};
+
+	class AndMethod : public BitwiseMethod
+	{
+	public:
+		AndMethod():
+			BitwiseMethod("&", llvm::Instruction::And)
+		{
+		}
+	}
+	_andMethod;
+
+	class OrMethod : public BitwiseMethod
+	{
+	public:
+		OrMethod():
+			BitwiseMethod("|", llvm::Instruction::Or)
+		{
+		}
+	}
+	_orMethod;
+
+	class XorMethod : public BitwiseMethod
+	{
+	public:
+		XorMethod():
+			BitwiseMethod("^", llvm::Instruction::Xor)
+		{
+		}
+	}
+	_xorMethod;
+
+	class ShlMethod : public BitwiseMethod
+	{
+	public:
+		ShlMethod():
+			BitwiseMethod("<<", llvm::Instruction::Shl)
+		{
+		}
+	}
+	_shlMethod;
+
+	class ShrMethod : public BitwiseMethod
+	{
+	public:
+		ShrMethod():
+			BitwiseMethod(">>", llvm::Instruction::AShr)
+		{
+		}
+	}
+	_shrMethod;
+
+	class ComplementMethod : public BitcodeArithmeticSymbol
+	{
+	public:
+		ComplementMethod():
+			BitcodeArithmeticSymbol("method ~", 1, true)
+		{
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateNot(parameters[0]);
+		}
+	}
+	_complementMethod;
+
+	/* int(x) converts reals to ints, truncating towards zero. Out of range
+	 * values saturate, and NaN becomes 0. Booleans become 0 or 1. Vectors
+	 * are converted element by element. */
+
+	class IntFunction : public BitcodeSymbol
+	{
+	public:
+		IntFunction():
+			BitcodeSymbol("int", 1)
+		{
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return state.integerType->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* v = parameters[0];
+			Type* type = state.types->find(v->getType());
+			if (type->isInteger())
+				return v;
+
+			llvm::Type* t = state.integerType->llvm;
+			if (type->asVector())
+			{
+				std::stringstream s;
+				s << "int*" << type->asVector()->size;
+				t = state.types->find(s.str())->llvm;
+			}
+
+			if (type->equals(state.booleanType))
+				return state.builder.CreateSelect(v,
+						llvm::ConstantInt::get(t, 1),
+						llvm::ConstantInt::get(t, 0));
+
+			llvm::Type* rt = v->getType();
+			llvm::Value* lo = llvm::ConstantFP::get(rt, -2147483648.0);
+			llvm::Value* hi = llvm::ConstantFP::get(rt, 2147483648.0);
+			llvm::Value* inrange = state.builder.CreateAnd(
+					state.builder.CreateFCmpOGE(v, lo),
+					state.builder.CreateFCmpOLT(v, hi));
+
+			llvm::Value* i = state.builder.CreateFPToSI(
+					state.builder.CreateSelect(inrange, v,
+						llvm::ConstantFP::get(rt, 0)), t);
+			i = state.builder.CreateSelect(state.builder.CreateFCmpOGE(v, hi),
+					llvm::ConstantInt::get(t, 0x7fffffff), i);
+			return state.builder.CreateSelect(state.builder.CreateFCmpOLT(v, lo),
+					llvm::ConstantInt::get(t, 0x80000000), i);
+		}
+	}
+	_intFunction;
+
+	/* real(x) converts ints (and booleans, and int vectors) to reals. */
+
+	class RealFunction : public BitcodeSymbol
+	{
+	public:
+		RealFunction():
+			BitcodeSymbol("real", 1)
+		{
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return state.realType->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* v = parameters[0];
+			Type* type = state.types->find(v->getType());
+			if (!type->isInteger() && !type->equals(state.booleanType))
+				return v;
+
+			llvm::Type* t = state.realType->llvm;
+			if (type->asVector())
+			{
+				std::stringstream s;
+				s << "vector*" << type->asVector()->size;
+				t = state.types->find(s.str())->llvm;
+			}
+
+			if (type->equals(state.booleanType))
+				return state.builder.CreateSelect(v,
+						llvm::ConstantFP::get(t, 1),
+						llvm::ConstantFP::get(t, 0));
+			return state.builder.CreateSIToFP(v, t);
+		}
+	}
+	_realFunction;
+
 	class LengthMethod : public BitcodeVectorSymbol
 	{
 	public:
@@ -334,6 +581,13 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		}
 
 	private:
+		llvm::Value* add(CompilerState& state, llvm::Value* v1, llvm::Value* v2)
+		{
+			if (v1->getType()->getScalarType()->isIntegerTy())
+				return state.builder.CreateAdd(v1, v2);
+			return state.builder.CreateFAdd(v1, v2);
+		}
+
 		llvm::Value* sum_power_of_2(CompilerState& state, llvm::Value* source,
 				int minelement, int maxelement)
 		{
@@ -356,7 +610,7 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 						llvm::ConstantInt::get(state.intType, minelement+0));
 				llvm::Value* v2 = state.builder.CreateExtractElement(source,
 						llvm::ConstantInt::get(state.intType, minelement+1));
-				return state.builder.CreateFAdd(v1, v2);
+				return add(state, v1, v2);
 			}
 			else
 			{
@@ -391,7 +645,7 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 				llvm::Value* v2 = state.builder.CreateShuffleVector(source,
 						llvm::UndefValue::get(source->getType()), mask2);
 
-				llvm::Value* v = state.builder.CreateFAdd(v1, v2);
+				llvm::Value* v = add(state, v1, v2);
 
 				/* Now sum the vector we've just created (recursively). */
 
@@ -430,13 +684,13 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 				return results[0];
 
 			if (results.size() == 2)
-				return state.builder.CreateFAdd(results[0], results[1]);
+				return add(state, results[0], results[1]);
 
 			/* There are many results, so marshal them back into a vector and
 			 * try again.
 			 */
 
-			llvm::Type* desttype = llvm::VectorType::get(state.realType->llvm,
+			llvm::Type* desttype = llvm::VectorType::get(results[0]->getType(),
 					results.size());
 			llvm::Value* v = llvm::UndefValue::get(desttype);
 
@@ -571,8 +825,9 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 					break;
 
 				default:
-					if (!t->equals(state.realType))
-						typeError(state, index, argument, type);
+					if (!t->equals(state.realType) &&
+							!t->equals(state.integerType))
+						typeError(state, index, argument, "real or int");
 					break;
 			}
 		}
@@ -583,6 +838,16 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			return state.realType->llvm;
 		}
 
+		/* Real indices are converted to unsigned ints (so they had better
+		 * not be negative); int indices are used as they are. */
+
+		llvm::Value* index(CompilerState& state, llvm::Value* v)
+		{
+			if (v->getType()->isIntegerTy())
+				return v;
+			return state.builder.CreateFPToUI(v, state.intType);
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 				const vector<llvm::Value*>& parameters)
 		{
@@ -594,8 +859,7 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 			{
 				case 2:
 				{
-					element = state.builder.CreateFPToUI(parameters[1],
-							state.intType);
+					element = index(state, parameters[1]);
 					break;
 				}
 
@@ -615,10 +879,8 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 						throw CompilationException(state.position.formatError(s.str()));
 					}
 
-					llvm::Value* x = state.builder.CreateFPToUI(parameters[1],
-							state.intType);
-					llvm::Value* y = state.builder.CreateFPToUI(parameters[2],
-							state.intType);
+					llvm::Value* x = index(state, parameters[1]);
+					llvm::Value* y = index(state, parameters[2]);
 					element = state.builder.CreateMul(y,
 							llvm::ConstantInt::get(state.intType, root));
 					element = state.builder.CreateAdd(element, x);
@@ -629,13 +891,207 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 					assert(false);
 			}
 
-			element = state.builder.CreateURem(element,
-					llvm::ConstantInt::get(state.intType, t->size));
+			/* Out of range indices wrap round. If any index was an int the
+			 * element number is signed, and negative ones count back from
+			 * the end. */
+
+			llvm::Value* size = llvm::ConstantInt::get(state.intType, t->size);
+			bool integer = false;
+			for (unsigned i = 1; i < parameters.size(); i++)
+				integer = integer || parameters[i]->getType()->isIntegerTy();
+
+			if (integer)
+			{
+				element = state.builder.CreateSRem(element, size);
+				element = state.builder.CreateSelect(
+						state.builder.CreateICmpSLT(element,
+							llvm::ConstantInt::get(state.intType, 0)),
+						state.builder.CreateAdd(element, size), element);
+			}
+			else
+				element = state.builder.CreateURem(element, size);
 			return state.builder.CreateExtractElement(vector, element);
 		}
 	}
 	_vectorSquareBracketMethod;
 
+	/* m.transpose swaps the rows and columns of a square vector. */
+
+	class TransposeMethod : public BitcodeMatrixSymbol
+	{
+		using BitcodeMatrixSymbol::root;
+		using BitcodeMatrixSymbol::matrixSizeError;
+		using BitcodeMatrixSymbol::shuffle;
+
+	public:
+		TransposeMethod():
+			BitcodeMatrixSymbol("method transpose", 1)
+		{
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			VectorType* t = state.types->find(parameters[0]->getType())->asVector();
+			unsigned n = root(t->size);
+			if (!n)
+			{
+				std::stringstream s;
+				s << "you can only transpose square vectors, and this one is a "
+				  << t->name;
+				matrixSizeError(state, s.str());
+			}
+
+			vector<unsigned> mask;
+			for (unsigned y = 0; y < n; y++)
+				for (unsigned x = 0; x < n; x++)
+					mask.push_back(x*n + y);
+			return shuffle(state, parameters[0], mask);
+		}
+	}
+	_transposeMethod;
+
+	/* a.outer(b) is the outer product of two vectors, with a row for each
+	 * element of a and a column for each element of b. */
+
+	class OuterMethod : public BitcodeMatrixSymbol
+	{
+		using BitcodeMatrixSymbol::shuffle;
+		using BitcodeMatrixSymbol::multiplyAdd;
+
+	public:
+		OuterMethod():
+			BitcodeMatrixSymbol("method outer", 2)
+		{
+		}
+
+		unsigned resultSize(CompilerState& state,
+				const vector<VectorType*>& types)
+		{
+			return types[0]->size * types[1]->size;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			unsigned rows = state.types->find(
+					parameters[0]->getType())->asVector()->size;
+			unsigned columns = state.types->find(
+					parameters[1]->getType())->asVector()->size;
+
+			vector<unsigned> amask;
+			vector<unsigned> bmask;
+			for (unsigned y = 0; y < rows; y++)
+				for (unsigned x = 0; x < columns; x++)
+				{
+					amask.push_back(y);
+					bmask.push_back(x);
+				}
+
+			return multiplyAdd(state, shuffle(state, parameters[0], amask),
+					shuffle(state, parameters[1], bmask), NULL);
+		}
+	}
+	_outerMethod;
+
+	/* a @ b is the matrix product. Two vectors of the same size are square
+	 * matrices; otherwise the bigger one is a matrix and the smaller one a
+	 * column vector (on the right) or a row vector (on the left). Each term
+	 * of the sum is one whole-vector multiply-add. */
+
+	class MatrixMultiplyMethod : public BitcodeMatrixSymbol
+	{
+		using BitcodeMatrixSymbol::root;
+		using BitcodeMatrixSymbol::matrixSizeError;
+		using BitcodeMatrixSymbol::shuffle;
+		using BitcodeMatrixSymbol::multiplyAdd;
+
+	public:
+		MatrixMultiplyMethod():
+			BitcodeMatrixSymbol("method @", 2)
+		{
+		}
+
+		/* The result is rows by columns, and each element of it is the sum
+		 * of terms products. */
+
+		void dimensions(CompilerState& state, VectorType* at, VectorType* bt,
+				unsigned& rows, unsigned& columns, unsigned& terms)
+		{
+			rows = columns = terms = 0;
+			if (at->size == bt->size)
+			{
+				rows = columns = terms = root(at->size);
+				if (!rows)
+				{
+					std::stringstream s;
+					s << "you can only multiply two vectors of the same size "
+					  << "if they're square, and these are " << at->name << "s";
+					matrixSizeError(state, s.str());
+				}
+			}
+			else if ((at->size % bt->size) == 0)
+			{
+				rows = at->size / bt->size;
+				columns = 1;
+				terms = bt->size;
+			}
+			else if ((bt->size % at->size) == 0)
+			{
+				rows = 1;
+				columns = bt->size / at->size;
+				terms = at->size;
+			}
+			else
+			{
+				std::stringstream s;
+				s << "you can't multiply a " << at->name << " by a "
+				  << bt->name << ", as neither size divides the other";
+				matrixSizeError(state, s.str());
+			}
+		}
+
+		unsigned resultSize(CompilerState& state,
+				const vector<VectorType*>& types)
+		{
+			unsigned rows;
+			unsigned columns;
+			unsigned terms;
+			dimensions(state, types[0], types[1], rows, columns, terms);
+			return rows * columns;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			VectorType* at = state.types->find(parameters[0]->getType())->asVector();
+			VectorType* bt = state.types->find(parameters[1]->getType())->asVector();
+
+			unsigned rows;
+			unsigned columns;
+			unsigned terms;
+			dimensions(state, at, bt, rows, columns, terms);
+
+			llvm::Value* v = NULL;
+			for (unsigned k = 0; k < terms; k++)
+			{
+				vector<unsigned> amask;
+				vector<unsigned> bmask;
+				for (unsigned y = 0; y < rows; y++)
+					for (unsigned x = 0; x < columns; x++)
+					{
+						amask.push_back(y*terms + k);
+						bmask.push_back(k*columns + x);
+					}
+
+				v = multiplyAdd(state, shuffle(state, parameters[0], amask),
+						shuffle(state, parameters[1], bmask), v);
+			}
+			return v;
+		}
+	}
+	_matrixMultiplyMethod;
+
 	class SimpleRealExternal : public IntrinsicFunctionSymbol
 	{
 		using Symbol::name;
@@ -794,6 +1250,15 @@ public:
 		add(&_subMethod);
 		add(&_mulMethod);
 		add(&_divMethod);
+		add(&_modMethod);
+		add(&_andMethod);
+		add(&_orMethod);
+		add(&_xorMethod);
+		add(&_shlMethod);
+		add(&_shrMethod);
+		add(&_complementMethod);
+		add(&_intFunction);
+		add(&_realFunction);
 		add(&_lengthMethod);
 		add(&_sumMethod);
 		add(&_xMethod);
@@ -801,6 +1266,9 @@ public:
 		add(&_zMethod);
 		add(&_wMethod);
 		add(&_vectorSquareBracketMethod);
+		add(&_transposeMethod);
+		add(&_outerMethod);
+		add(&_matrixMultiplyMethod);
 
 		#define REAL1(n) add(&_##n);
 		#define REAL2(n) add(&_##n);
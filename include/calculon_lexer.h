@@ -277,9 +277,16 @@ private:
 				}
 				break;
 
-			case '=':
 			case '<':
 			case '>':
+				if (p == c)
+				{
+					consume();
+					_idValue += (char) c;
+					break;
+				}
+				/* fall through */
+			case '=':
 			case '!':
 				if (p == '=')
 				{
@@ -0,0 +1,249 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_LIBRARY_H
+#define CALCULON_LIBRARY_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* A Library is compiled from a script which exports several entrypoints,
+ * each with its own signature, all sharing the functions defined before
+ * them:
+ *
+ *   let sq(x) = x*x in
+ *   export value(x, y): (r) = let r = sq(x) + sq(y) in return
+ *   export gradient(x, y): (dx, dy) = let dx = 2*x in let dy = 2*y in return
+ *
+ * Everything goes into one module, so it's only compiled (and optimised)
+ * once, and the shared functions can be inlined into every entrypoint which
+ * uses them. Libraries are always compiled to machine code and keep their
+ * IR; batches, lanes, tiering, caching, compact mode and the interpreter are
+ * only available to Programs. */
+
+class Library
+{
+	auto_ptr<Session> _ownsession;
+	llvm::LLVMContext* _context;
+	SymbolTable& _symbols;
+	llvm::Module* _module;
+	llvm::ExecutionEngine* _engine;
+	map<string, llvm::Function*> _functions;
+	map<string, void*> _pointers;
+	vector<llvm::Function*> _compiled;
+	size_t _codesize;
+	CompileStats _stats;
+
+public:
+	Library(SymbolTable& symbols, const string& code,
+				const map<string, string>& typealiases = map<string, string>(),
+				const CompileOptions& options = CompileOptions()):
+			_symbols(symbols)
+	{
+		std::istringstream stream(code);
+		init(NULL, stream, typealiases, options);
+	}
+
+	Library(SymbolTable& symbols, std::istream& code,
+				const map<string, string>& typealiases = map<string, string>(),
+				const CompileOptions& options = CompileOptions()):
+			_symbols(symbols)
+	{
+		init(NULL, code, typealiases, options);
+	}
+
+	/* These compile the library into an existing session. */
+
+	Library(Session& session, SymbolTable& symbols, const string& code,
+				const map<string, string>& typealiases = map<string, string>(),
+				const CompileOptions& options = CompileOptions()):
+			_symbols(symbols)
+	{
+		std::istringstream stream(code);
+		init(&session, stream, typealiases, options);
+	}
+
+	Library(Session& session, SymbolTable& symbols, std::istream& code,
+				const map<string, string>& typealiases = map<string, string>(),
+				const CompileOptions& options = CompileOptions()):
+			_symbols(symbols)
+	{
+		init(&session, code, typealiases, options);
+	}
+
+	~Library()
+	{
+		release();
+	}
+
+	bool exports(const string& name) const
+	{
+		return _pointers.find(name) != _pointers.end();
+	}
+
+	vector<string> names() const
+	{
+		vector<string> names;
+		for (map<string, void*>::const_iterator i = _pointers.begin(),
+				e = _pointers.end(); i != e; i++)
+			names.push_back(i->first);
+		return names;
+	}
+
+	/* Returns the named entrypoint. FuncType is its C type, just as for a
+	 * Program; only the number of parameters can be checked, so make sure
+	 * the types match the export's signature. */
+
+	template <typename FuncType>
+	FuncType* get(const string& name) const
+	{
+		map<string, void*>::const_iterator i = _pointers.find(name);
+		if (i == _pointers.end())
+		{
+			std::stringstream s;
+			s << "'" << name << "' is not exported by this library";
+			throw CompilationException(s.str());
+		}
+
+		llvm::Function* f = _functions.find(name)->second;
+		if (f->arg_size() != boost::function_traits<FuncType>::arity)
+		{
+			std::stringstream s;
+			s << "'" << name << "' takes " << f->arg_size()
+			  << " parameters, but was asked for as a function taking "
+			  << boost::function_traits<FuncType>::arity;
+			throw CompilationException(s.str());
+		}
+
+		return (FuncType*) i->second;
+	}
+
+	void dump()
+	{
+		_module->dump();
+	}
+
+	const CompileStats& stats() const
+	{
+		return _stats;
+	}
+
+	/* As Program::retainedBytes(). */
+
+	size_t retainedBytes() const
+	{
+		return _codesize + Impl::irBytes(_module);
+	}
+
+private:
+	void init(Session* session, std::istream& codestream,
+			const map<string, string>& typealiases,
+			const CompileOptions& compileoptions)
+	{
+		_module = NULL;
+		_codesize = 0;
+		_stats.start();
+
+		if (!session)
+		{
+			CompileStats::Timer timer(&_stats, "session");
+			_ownsession.reset(new Session(compileoptions));
+			session = _ownsession.get();
+		}
+		_context = &session->context();
+		_engine = session->engine();
+		_module = new llvm::Module("Calculon Library", *_context);
+		_engine->addModule(_module);
+
+		try
+		{
+			compile(codestream, typealiases, compileoptions);
+		}
+		catch (...)
+		{
+			release();
+			throw;
+		}
+	}
+
+	void compile(std::istream& codestream,
+			const map<string, string>& typealiases,
+			const CompileOptions& compileoptions)
+	{
+		{
+			Compiler compiler(*_context, _module, _engine, typealiases);
+			compiler.stats = &_stats;
+
+			vector<ToplevelSymbol*> exports = compiler.compileLibrary(
+					codestream, &_symbols);
+			for (typename vector<ToplevelSymbol*>::const_iterator i = exports.begin(),
+					e = exports.end(); i != e; i++)
+				_functions[(*i)->name] = (*i)->function;
+		}
+		_stats.irInstructions = Impl::irInstructions(_module);
+
+		/* Same passes as a Program; every entrypoint gets the function
+		 * passes. */
+
+		{
+			vector<llvm::Function*> functions;
+			for (map<string, llvm::Function*>::const_iterator i = _functions.begin(),
+					e = _functions.end(); i != e; i++)
+				functions.push_back(i->second);
+
+			Impl::optimise(_module, functions, compileoptions, &_stats);
+		}
+		_stats.optimisedIRInstructions = Impl::irInstructions(_module);
+
+		{
+			CompileStats::Timer timer(&_stats, "emit");
+			Impl::CodeSizeListener listener;
+			_engine->RegisterJITEventListener(&listener);
+
+			for (llvm::Module::iterator i = _module->begin(),
+					e = _module->end(); i != e; i++)
+			{
+				if (!i->isDeclaration())
+					_compiled.push_back(i);
+			}
+
+			for (map<string, llvm::Function*>::const_iterator i = _functions.begin(),
+					e = _functions.end(); i != e; i++)
+			{
+				void* p = _engine->getPointerToFunction(i->second);
+				assert(p);
+				_pointers[i->first] = p;
+			}
+
+			_engine->UnregisterJITEventListener(&listener);
+			_codesize += listener.size;
+		}
+		_stats.codeBytes = _codesize;
+	}
+
+	/* Give the machine code and the module back to the session (which might
+	 * be our own). */
+
+	void release()
+	{
+		if (!_module)
+			return;
+
+		for (typename vector<llvm::Function*>::const_iterator i = _compiled.begin(),
+				e = _compiled.end(); i != e; i++)
+		{
+			_engine->freeMachineCodeForFunction(*i);
+		}
+		_engine->removeModule(_module);
+		delete _module;
+		_module = NULL;
+	}
+
+	Library(const Library&);
+	Library& operator = (const Library&);
+};
+
+#endif
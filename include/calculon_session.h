@@ -0,0 +1,101 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_SESSION_H
+#define CALCULON_SESSION_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* A Session holds the LLVM state which can be shared between Programs: the
+ * context and the JIT, along with the JIT's target machine. Each Program
+ * compiled into a session just adds a module to it, which makes Programs
+ * much cheaper to create and to keep around. The session must outlive all
+ * the Programs compiled into it. Unlike Programs with their own sessions, a
+ * session may only be used by one thread at a time.
+ *
+ * The code generator settings in the CompileOptions belong to the target
+ * machine, so they're taken from the session's options rather than from
+ * each Program's. */
+
+class Session
+{
+	llvm::LLVMContext _context;
+	llvm::ExecutionEngine* _engine;
+
+public:
+	Session(const CompileOptions& compileoptions = CompileOptions())
+	{
+		Calculon::initialize();
+
+		/* The JIT has to be created with a module; this one stays empty. */
+
+		llvm::EngineBuilder builder(new llvm::Module("Calculon Session", _context));
+		_engine = createEngine(builder, compileoptions);
+	}
+
+	~Session()
+	{
+		delete _engine;
+	}
+
+	llvm::LLVMContext& context()
+	{
+		return _context;
+	}
+
+	llvm::ExecutionEngine* engine()
+	{
+		return _engine;
+	}
+
+	/* Applies the code generator settings to an engine builder. (This is
+	 * also used to get a target machine for ahead-of-time compilation, so
+	 * that both generate the same code.) */
+
+	static void configure(llvm::EngineBuilder& builder,
+			const CompileOptions& compileoptions)
+	{
+		llvm::TargetOptions options;
+//		options.PrintMachineCode = true;
+		options.UnsafeFPMath = compileoptions.unsafeFPMath;
+		options.RealignStack = true;
+		options.LessPreciseFPMADOption = compileoptions.lessPreciseFPMAD;
+		options.GuaranteedTailCallOpt = true;
+		options.AllowFPOpFusion = compileoptions.fpOpFusion;
+
+		builder
+			.setMCPU(compileoptions.targetCPU())
+			.setOptLevel(compileoptions.codeGenOptLevel)
+			.setTargetOptions(options);
+	}
+
+	/* Finishes configuring an engine the way Calculon wants it and creates
+	 * it. */
+
+	static llvm::ExecutionEngine* createEngine(llvm::EngineBuilder& builder,
+			const CompileOptions& compileoptions)
+	{
+		configure(builder, compileoptions);
+
+		string s;
+		llvm::ExecutionEngine* engine = builder
+			.setErrorStr(&s)
+			.create();
+		if (!engine)
+			throw CompilationException(s);
+		engine->DisableLazyCompilation();
+//		engine->DisableSymbolSearching();
+
+		return engine;
+	}
+
+private:
+	Session(const Session&);
+	Session& operator = (const Session&);
+};
+
+#endif
@@ -0,0 +1,228 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_STATS_H
+#define CALCULON_STATS_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Describes where the time and memory went while compiling a Program. Each
+ * phase is recorded as it finishes; times are in microseconds, with start
+ * times measured from the beginning of the compilation. Memory is the growth
+ * in the process's malloc usage, sampled at the end of each phase, so it's
+ * approximate (and includes anything other threads were doing). */
+
+struct CompileStats
+{
+	struct Phase
+	{
+		string name;
+		uint64_t start;
+		uint64_t duration;
+	};
+
+	vector<Phase> phases;
+
+	/* IR instructions in the module before and after optimisation. */
+
+	size_t irInstructions;
+	size_t optimisedIRInstructions;
+
+	/* Machine code (or bytecode) generated. */
+
+	size_t codeBytes;
+
+	size_t peakMemory;
+
+	CompileStats():
+		irInstructions(0),
+		optimisedIRInstructions(0),
+		codeBytes(0),
+		peakMemory(0),
+		_startmemory(0)
+	{
+	}
+
+	/* Records the phase which lasts as long as the timer does. Timers
+	 * without any stats do nothing. */
+
+	class Timer
+	{
+		CompileStats* _stats;
+		const char* _name;
+		llvm::sys::TimeValue _start;
+
+	public:
+		Timer(CompileStats* stats, const char* name):
+			_stats(stats),
+			_name(name)
+		{
+			if (_stats)
+				_start = llvm::sys::TimeValue::now();
+		}
+
+		~Timer()
+		{
+			if (_stats)
+				_stats->record(_name, _start, llvm::sys::TimeValue::now());
+		}
+	};
+
+	/* Called once, at the very beginning of the compilation. */
+
+	void start()
+	{
+		_origin = llvm::sys::TimeValue::now();
+		_startmemory = llvm::sys::Process::GetMallocUsage();
+	}
+
+	uint64_t total() const
+	{
+		uint64_t end = 0;
+		for (vector<Phase>::const_iterator i = phases.begin(),
+				e = phases.end(); i != e; i++)
+			end = std::max(end, i->start + i->duration);
+		return end;
+	}
+
+	/* Adds up all the time spent in phases with this name. */
+
+	uint64_t time(const string& name) const
+	{
+		uint64_t t = 0;
+		for (vector<Phase>::const_iterator i = phases.begin(),
+				e = phases.end(); i != e; i++)
+			if (i->name == name)
+				t += i->duration;
+		return t;
+	}
+
+	void write(std::ostream& s) const
+	{
+		for (vector<Phase>::const_iterator i = phases.begin(),
+				e = phases.end(); i != e; i++)
+			s << i->name << ": " << i->duration << "us\n";
+
+		s << "total: " << total() << "us\n"
+		  << "IR instructions: " << irInstructions << " ("
+		  << optimisedIRInstructions << " after optimisation)\n"
+		  << "code size: " << codeBytes << " bytes\n"
+		  << "peak memory: " << peakMemory << " bytes\n";
+	}
+
+	/* Writes the phases out in the Chrome trace event format (load the
+	 * file into chrome://tracing). Give each Program a different tid if
+	 * you're going to merge several traces. */
+
+	void writeTrace(std::ostream& s, unsigned tid = 1) const
+	{
+		s << "[\n";
+		for (vector<Phase>::const_iterator i = phases.begin(),
+				e = phases.end(); i != e; i++)
+		{
+			s << "{\"name\":\"" << i->name << "\",\"cat\":\"calculon\","
+			  << "\"ph\":\"X\",\"ts\":" << i->start
+			  << ",\"dur\":" << i->duration
+			  << ",\"pid\":1,\"tid\":" << tid << "},\n";
+		}
+
+		s << "{\"name\":\"compile\",\"cat\":\"calculon\",\"ph\":\"X\","
+		  << "\"ts\":0,\"dur\":" << total()
+		  << ",\"pid\":1,\"tid\":" << tid << ",\"args\":{"
+		  << "\"irInstructions\":" << irInstructions << ","
+		  << "\"optimisedIRInstructions\":" << optimisedIRInstructions << ","
+		  << "\"codeBytes\":" << codeBytes << ","
+		  << "\"peakMemory\":" << peakMemory << "}}\n"
+		  << "]\n";
+	}
+
+private:
+	llvm::sys::TimeValue _origin;
+	size_t _startmemory;
+
+	void record(const char* name, const llvm::sys::TimeValue& start,
+			const llvm::sys::TimeValue& end)
+	{
+		Phase phase;
+		phase.name = name;
+		phase.start = (start - _origin).usec();
+		phase.duration = (end - start).usec();
+		phases.push_back(phase);
+
+		size_t memory = llvm::sys::Process::GetMallocUsage();
+		if (memory > _startmemory)
+			peakMemory = std::max(peakMemory, memory - _startmemory);
+	}
+};
+
+namespace Impl
+{
+	/* Watches the JIT to find out how much machine code we get. */
+
+	class CodeSizeListener : public llvm::JITEventListener
+	{
+	public:
+		size_t size;
+
+		CodeSizeListener():
+			size(0)
+		{
+		}
+
+		void NotifyFunctionEmitted(const llvm::Function& f, void* code,
+				size_t size, const EmittedFunctionDetails& details)
+		{
+			this->size += size;
+		}
+
+		void NotifyObjectEmitted(const llvm::ObjectImage& object)
+		{
+			size += object.getData().size();
+		}
+	};
+
+	inline size_t irInstructions(llvm::Module* module)
+	{
+		size_t count = 0;
+		for (llvm::Module::iterator fi = module->begin(),
+				fe = module->end(); fi != fe; fi++)
+		{
+			for (llvm::Function::iterator bi = fi->begin(),
+					be = fi->end(); bi != be; bi++)
+				count += bi->size();
+		}
+		return count;
+	}
+
+	/* Roughly how much memory a module's IR takes up. */
+
+	inline size_t irBytes(llvm::Module* module)
+	{
+		size_t bytes = 0;
+
+		for (llvm::Module::iterator fi = module->begin(),
+				fe = module->end(); fi != fe; fi++)
+		{
+			bytes += sizeof(llvm::Function);
+			for (llvm::Function::iterator bi = fi->begin(),
+					be = fi->end(); bi != be; bi++)
+			{
+				bytes += sizeof(llvm::BasicBlock);
+				for (llvm::BasicBlock::iterator ii = bi->begin(),
+						ie = bi->end(); ii != ie; ii++)
+				{
+					bytes += sizeof(llvm::Instruction) +
+							(ii->getNumOperands() * sizeof(llvm::Use));
+				}
+			}
+		}
+
+		return bytes;
+	}
+}
+
+#endif
@@ -15,6 +15,7 @@ class ValuedSymbol;
 class VariableSymbol;
 class FunctionSymbol;
 class ToplevelSymbol;
+class ExternalFunctionSymbol;
 
 class Symbol : public Object
 {
@@ -55,6 +56,21 @@ public:
 	{
 		return NULL;
 	}
+
+	virtual ExternalFunctionSymbol* isExternalFunction()
+	{
+		return NULL;
+	}
+
+	/* Writes out everything about this symbol which can affect the code
+	 * generated by using it; this is used to key the code cache. If
+	 * addresses is set, anything which depends on where things are in this
+	 * process is included too. */
+
+	virtual void describe(std::ostream& s, bool addresses)
+	{
+		s << name << "\n";
+	}
 };
 
 class ValuedSymbol : public Symbol
@@ -76,6 +92,7 @@ public:
 class ExternalRealConstantSymbol : public ValuedSymbol
 {
 public:
+	using Symbol::name;
 	double value;
 
 	ExternalRealConstantSymbol(const string& name, double value):
@@ -88,11 +105,18 @@ public:
 	{
 		return llvm::ConstantFP::get(state.realType->llvm, value);
 	}
+
+	void describe(std::ostream& s, bool addresses)
+	{
+		s.precision(17);
+		s << name << "=" << value << "\n";
+	}
 };
 
 class ExternalVectorConstantSymbol : public ValuedSymbol
 {
 public:
+	using Symbol::name;
 	vector<double> value;
 	string typenm;
 
@@ -119,6 +143,15 @@ public:
 
 		return v;
 	}
+
+	void describe(std::ostream& s, bool addresses)
+	{
+		s.precision(17);
+		s << name << "=";
+		for (unsigned i = 0; i < value.size(); i++)
+			s << value[i] << ",";
+		s << "\n";
+	}
 };
 
 class VariableSymbol : public ValuedSymbol
@@ -178,6 +211,14 @@ public:
 
 	virtual void checkParameterCount(CompilerState& state, int calledwith) = 0;
 
+	/* Operators let a literal number stand in for an int when one of the
+	 * other parameters is an int (see ASTFunctionCall). */
+
+	virtual bool convertsConstants()
+	{
+		return false;
+	}
+
 	void typeError(CompilerState& state,
 			int index, llvm::Value* argument, Type* type)
 	{
@@ -362,22 +403,22 @@ public:
 		CallableSymbol::checkParameterCount(state, calledwith, arguments);
 	}
 
-	llvm::Value* emitCall(CompilerState& state,
+	/* Symbols live in symbol tables which may be shared between threads,
+	 * so checks which need to look at more than one parameter do it here
+	 * rather than by remembering things between calls to
+	 * typeCheckParameter(). */
+
+	virtual void typeCheckParameters(CompilerState& state,
 			const vector<llvm::Value*>& parameters)
 	{
-		int i = 1;
-		vector<llvm::Value*>::const_iterator pi = parameters.begin();
-		vector<llvm::Type*> llvmtypes;
-		while (pi != parameters.end())
-		{
-			llvm::Value* v = *pi;
-			typeCheckParameter(state, i, v, NULL);
-			llvmtypes.push_back(v->getType());
-
-			i++;
-			pi++;
-		}
+		for (unsigned i = 0; i < parameters.size(); i++)
+			typeCheckParameter(state, i+1, parameters[i], NULL);
+	}
 
+	llvm::Value* emitCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		typeCheckParameters(state, parameters);
 		return emitBitcode(state, parameters);
 	}
 
@@ -407,6 +448,37 @@ public:
 	{
 	}
 
+	ExternalFunctionSymbol* isExternalFunction()
+	{
+		return this;
+	}
+
+	void describe(std::ostream& s, bool addresses)
+	{
+		s << name << "(";
+		for (unsigned i = 0; i < inputtypenames.size(); i++)
+			s << inputtypenames[i] << ",";
+		s << "):" << returntypename;
+		if (addresses)
+			s << "@" << getPointer();
+		s << "\n";
+	}
+
+	/* External functions are called by name rather than by address, so
+	 * that the generated code doesn't depend on where they happen to be in
+	 * this process. The JIT (or the interpreter) maps the name back to the
+	 * pointer. */
+
+	static string mangledName(const string& name)
+	{
+		return "calculon.external." + name;
+	}
+
+	void* getPointer() const
+	{
+		return (void*) pointer;
+	}
+
 	void checkParameterCount(CompilerState& state, int calledwith)
 	{
 		CallableSymbol::checkParameterCount(state, calledwith, inputtypenames.size());
@@ -428,10 +500,63 @@ private:
 		return t;
 	}
 
+	llvm::Value* functionPointer(CompilerState& state, llvm::FunctionType* ft)
+	{
+		llvm::Constant* f = state.module->getOrInsertFunction(
+				mangledName(name), ft);
+		if (state.engine)
+			state.engine->updateGlobalMapping(llvm::cast<llvm::GlobalValue>(f),
+					getPointer());
+		return f;
+	}
+
+	/* C functions only take scalars, so in lane-parallel code we call the
+	 * function once per lane. (Vectors can't appear here.) */
+
+	llvm::Value* emitLaneCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		vector<llvm::Value*> llvmvalues;
+		vector<llvm::Type*> llvmtypes;
+
+		Type* returntype = lookup_type(state, returntypename);
+
+		for (unsigned i = 0; i < parameters.size(); i++)
+		{
+			Type* internalctype = lookup_type(state, inputtypenames[i]);
+			typeCheckParameter(state, i+1, parameters[i], internalctype);
+
+			llvm::Value* value = internalctype->convertToExternal(parameters[i]);
+			llvmvalues.push_back(value);
+			llvmtypes.push_back(value->getType()->getScalarType());
+		}
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				returntype->llvmx->getScalarType(), llvmtypes, false);
+		llvm::Value* fptr = functionPointer(state, ft);
+
+		llvm::Value* retval = llvm::UndefValue::get(returntype->llvmx);
+		for (unsigned lane = 0; lane < state.lanes; lane++)
+		{
+			llvm::Value* l = llvm::ConstantInt::get(state.intType, lane);
+			vector<llvm::Value*> args;
+			for (unsigned i = 0; i < llvmvalues.size(); i++)
+				args.push_back(state.builder.CreateExtractElement(llvmvalues[i], l));
+
+			llvm::Value* v = state.builder.CreateCall(fptr, args);
+			retval = state.builder.CreateInsertElement(retval, v, l);
+		}
+
+		return returntype->convertToInternal(retval);
+	}
+
 public:
 	llvm::Value* emitCall(CompilerState& state,
 			const vector<llvm::Value*>& parameters)
 	{
+		if (state.lanes > 1)
+			return emitLaneCall(state, parameters);
+
 		int i = 0;
 		vector<llvm::Value*>::const_iterator pi = parameters.begin();
 		vector<llvm::Value*> llvmvalues;
@@ -486,11 +611,7 @@ public:
 
 		/* Create the function. */
 
-		llvm::Constant* iptr = llvm::ConstantInt::get(
-				state.engine->getDataLayout()->getIntPtrType(state.context, 0),
-				(uint64_t) pointer);
-		llvm::Value* fptr = llvm::ConstantExpr::getIntToPtr(iptr,
-				llvm::PointerType::get(ft, 0));
+		llvm::Value* fptr = functionPointer(state, ft);
 
 		llvm::Value* retval = state.builder.CreateCall(fptr, llvmvalues);
 		if (returntype->asVector())
@@ -538,21 +659,32 @@ public:
 	}
 };
 
-class BitcodeRealComparisonSymbol : public BitcodeSymbol
+/* Ordered comparisons: both sides must be reals, or both ints. */
+
+class BitcodeOrderedComparisonSymbol : public BitcodeSymbol
 {
 	using CallableSymbol::typeError;
 
 public:
-	BitcodeRealComparisonSymbol(string id):
+	BitcodeOrderedComparisonSymbol(string id):
 		BitcodeSymbol(id, 2)
 	{
 	}
 
-	void typeCheckParameter(CompilerState& state,
-				int index, llvm::Value* argument, Type* type)
+	bool convertsConstants()
 	{
-		if (argument->getType() != state.realType->llvm)
-			typeError(state, index, argument, "real");
+		return true;
+	}
+
+	void typeCheckParameters(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		Type* firsttype = state.types->find(parameters[0]->getType());
+		if (!firsttype->equals(state.realType) &&
+				!firsttype->equals(state.integerType))
+			typeError(state, 1, parameters[0], "real or int");
+		if (parameters[1]->getType() != parameters[0]->getType())
+			typeError(state, 2, parameters[1], firsttype);
 	}
 
 	llvm::Type* returnType(CompilerState& state,
@@ -607,26 +739,21 @@ public:
 
 class BitcodeHomogeneousSymbol : public BitcodeSymbol
 {
-	llvm::Type* firsttype;
-
 	using Symbol::name;
 public:
 	BitcodeHomogeneousSymbol(string id, int parameters):
-		BitcodeSymbol(id, parameters),
-		firsttype(NULL)
+		BitcodeSymbol(id, parameters)
 	{
 	}
 
-	void typeCheckParameter(CompilerState& state,
-				int index, llvm::Value* argument, Type* type)
+	void typeCheckParameters(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
 	{
-		if (index == 1)
-		{
-			firsttype = argument->getType();
-		}
-		else
+		BitcodeSymbol::typeCheckParameters(state, parameters);
+
+		for (unsigned i = 1; i < parameters.size(); i++)
 		{
-			if (argument->getType() != firsttype)
+			if (parameters[i]->getType() != parameters[0]->getType())
 			{
 				std::stringstream s;
 				s << "parameters to " << name
@@ -645,6 +772,11 @@ public:
 	{
 	}
 
+	bool convertsConstants()
+	{
+		return true;
+	}
+
 	llvm::Type* returnType(CompilerState& state,
 			const vector<llvm::Type*>& inputTypes)
 	{
@@ -668,9 +800,6 @@ public:
 		Type* at = state.types->find(argument->getType());
 		if (!at->equals(state.realType) && !at->asVector())
 			typeError(state, index, argument, "real or vector");
-
-		return BitcodeHomogeneousSymbol::typeCheckParameter(state, index,
-				argument, type);
 	}
 
 	llvm::Type* returnType(CompilerState& state,
@@ -680,38 +809,49 @@ public:
 	}
 };
 
-class BitcodeRealOrVectorArraySymbol : public BitcodeSymbol
+/* Arithmetic operators. The first parameter is a real, an int or a vector
+ * of either; the others must be the same type or, for vectors, a scalar of
+ * the element type, which applies to every element. If integer is set,
+ * only ints and int vectors are allowed. */
+
+class BitcodeArithmeticSymbol : public BitcodeSymbol
 {
-	Type* _firsttype;
+	bool _integer;
 
 	using CallableSymbol::typeError;
 
 public:
-	BitcodeRealOrVectorArraySymbol(const string& id, int parameters):
-		BitcodeSymbol(id, parameters)
+	BitcodeArithmeticSymbol(const string& id, int parameters,
+			bool integer = false):
+		BitcodeSymbol(id, parameters),
+		_integer(integer)
 	{
 	}
 
-	void typeCheckParameter(CompilerState& state,
-				int index, llvm::Value* argument, Type* type)
+	bool convertsConstants()
 	{
-		Type* t = state.types->find(argument->getType());
-		switch (index)
+		return true;
+	}
+
+	void typeCheckParameters(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		Type* firsttype = state.types->find(parameters[0]->getType());
+		VectorType* vectortype = firsttype->asVector();
+		Type* elementtype = vectortype ? vectortype->element : firsttype;
+		if (_integer && !elementtype->equals(state.integerType))
+			typeError(state, 1, parameters[0], "int or int vector");
+		if (!elementtype->equals(state.realType) &&
+				!elementtype->equals(state.integerType))
+			typeError(state, 1, parameters[0], "real, int or vector");
+
+		for (unsigned i = 1; i < parameters.size(); i++)
 		{
-			case 1:
-				_firsttype = t;
-				if (!t->equals(state.realType) && !t->asVector())
-					typeError(state, index, argument, "real or vector");
-				break;
-
-			default:
-				if (_firsttype->asVector() && t->equals(_firsttype))
-					break;
-				if (t->equals(state.realType))
-					break;
-
-				typeError(state, index, argument, _firsttype);
-				break;
+			Type* t = state.types->find(parameters[i]->getType());
+			if (t->equals(firsttype) || t->equals(elementtype))
+				continue;
+
+			typeError(state, i+1, parameters[i], firsttype);
 		}
 	}
 
@@ -721,12 +861,17 @@ public:
 		return inputTypes[0];
 	}
 
+	static bool isInteger(llvm::Value* v)
+	{
+		return v->getType()->getScalarType()->isIntegerTy();
+	}
+
 	llvm::Value* convertRHS(CompilerState& state, llvm::Value* lhs,
 			llvm::Value* rhs)
 	{
 		Type* lhst = state.types->find(lhs->getType());
 		Type* rhst = state.types->find(rhs->getType());
-		if (lhst->asVector() && (rhst == state.realType))
+		if (lhst->asVector() && !rhst->asVector())
 		{
 			VectorType* lhsvt = lhst->asVector();
 			llvm::Value* v = llvm::UndefValue::get(lhst->llvm);
@@ -739,6 +884,159 @@ public:
 
 		return rhs;
 	}
+
+	/* Integer division (or remainder), truncating towards zero as in C.
+	 * LLVM leaves dividing by zero, and the lowest int by -1, undefined
+	 * (and x86 traps), so those get their own results: x/0 is 0 and x%0
+	 * is x, while x/-1 is -x (wrapping) and x%-1 is 0. */
+
+	llvm::Value* divide(CompilerState& state, llvm::Value* lhs,
+			llvm::Value* rhs, bool remainder)
+	{
+		llvm::Type* t = lhs->getType();
+		llvm::Value* zero = llvm::Constant::getNullValue(t);
+		llvm::Value* byzero = state.builder.CreateICmpEQ(rhs, zero);
+		llvm::Value* byminusone = state.builder.CreateICmpEQ(rhs,
+				llvm::Constant::getAllOnesValue(t));
+		llvm::Value* divisor = state.builder.CreateSelect(
+				state.builder.CreateOr(byzero, byminusone),
+				llvm::ConstantInt::get(t, 1), rhs);
+
+		if (remainder)
+			return state.builder.CreateSelect(byzero, lhs,
+					state.builder.CreateSRem(lhs, divisor));
+
+		llvm::Value* v = state.builder.CreateSelect(byminusone,
+				state.builder.CreateNeg(lhs),
+				state.builder.CreateSDiv(lhs, divisor));
+		return state.builder.CreateSelect(byzero, zero, v);
+	}
+};
+
+/* Square vectors double as matrices, stored in row-major order (as m[x, y]
+ * reads them), and a vector whose size is a multiple of another's as a
+ * matrix with that many columns. Matrix operations are built from shuffles
+ * which line each element of the result up with the operand elements it
+ * needs, followed by whole-vector multiplies and accumulates; LLVM then
+ * splits these into whatever the target's vector registers hold. */
+
+class BitcodeMatrixSymbol : public BitcodeSymbol
+{
+	using CallableSymbol::typeError;
+
+public:
+	BitcodeMatrixSymbol(const string& id, int parameters):
+		BitcodeSymbol(id, parameters)
+	{
+	}
+
+	void typeCheckParameters(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		VectorType* firsttype = NULL;
+		for (unsigned i = 0; i < parameters.size(); i++)
+		{
+			VectorType* t = state.types->find(
+					parameters[i]->getType())->asVector();
+			if (!t)
+				typeError(state, i+1, parameters[i], "vector");
+
+			if (!firsttype)
+				firsttype = t;
+			else if (!t->element->equals(firsttype->element))
+				typeError(state, i+1, parameters[i],
+						firsttype->element->isInteger() ? "int vector" : "vector");
+		}
+	}
+
+	/* The result is the same kind of vector as the first parameter, but
+	 * with resultSize() elements. */
+
+	llvm::Type* returnType(CompilerState& state,
+			const vector<llvm::Type*>& inputTypes)
+	{
+		vector<VectorType*> types;
+		for (unsigned i = 0; i < inputTypes.size(); i++)
+			types.push_back(state.types->find(inputTypes[i])->asVector());
+		return resize(state, types[0], resultSize(state, types))->llvm;
+	}
+
+	virtual unsigned resultSize(CompilerState& state,
+			const vector<VectorType*>& types)
+	{
+		return types[0]->size;
+	}
+
+	/* Returns a vector type with the same elements as t but a different
+	 * size (registering it if need be). */
+
+	Type* resize(CompilerState& state, VectorType* t, unsigned size)
+	{
+		std::stringstream s;
+		s << (t->element->isInteger() ? "int*" : "vector*") << size;
+		return state.types->find(s.str());
+	}
+
+	/* Returns the number of rows in a square vector, or 0 if it isn't
+	 * square. */
+
+	static unsigned root(unsigned size)
+	{
+		unsigned r = (unsigned)sqrt(size);
+		return ((r*r) == size) ? r : 0;
+	}
+
+	void matrixSizeError(CompilerState& state, const string& what)
+	{
+		throw CompilationException(state.position.formatError(what));
+	}
+
+	/* Shuffles the elements of v into a new vector, element i of which is
+	 * element mask[i] of v (and this also registers the type of the
+	 * result). A shuffle which would leave v unchanged isn't done. */
+
+	llvm::Value* shuffle(CompilerState& state, llvm::Value* v,
+			const vector<unsigned>& mask)
+	{
+		VectorType* t = state.types->find(v->getType())->asVector();
+		resize(state, t, mask.size());
+
+		bool identity = (mask.size() == t->size);
+		vector<llvm::Constant*> constants;
+		for (unsigned i = 0; i < mask.size(); i++)
+		{
+			identity = identity && (mask[i] == i);
+			constants.push_back(llvm::ConstantInt::get(state.intType, mask[i]));
+		}
+		if (identity)
+			return v;
+
+		return state.builder.CreateShuffleVector(v,
+				llvm::UndefValue::get(v->getType()),
+				llvm::ConstantVector::get(constants));
+	}
+
+	/* Returns acc + a*b, or just a*b if acc is NULL. Reals use
+	 * llvm.fmuladd, which becomes a fused multiply-add on targets which
+	 * have one unless the optimisation profile forbids fusing. */
+
+	llvm::Value* multiplyAdd(CompilerState& state, llvm::Value* a,
+			llvm::Value* b, llvm::Value* acc)
+	{
+		if (a->getType()->getScalarType()->isIntegerTy())
+		{
+			llvm::Value* v = state.builder.CreateMul(a, b);
+			return acc ? state.builder.CreateAdd(acc, v) : v;
+		}
+
+		if (!acc)
+			return state.builder.CreateFMul(a, b);
+
+		llvm::Type* t = a->getType();
+		llvm::Function* f = llvm::Intrinsic::getDeclaration(state.module,
+				llvm::Intrinsic::fmuladd, t);
+		return state.builder.CreateCall3(f, a, b, acc);
+	}
 };
 
 class IntrinsicFunctionSymbol : public CallableSymbol
@@ -776,6 +1074,9 @@ public:
 			pi++;
 		}
 
+		if (state.lanes > 1)
+			return emitLaneCall(state, parameters, llvmtypes);
+
 		llvm::FunctionType* ft = llvm::FunctionType::get(
 				returnType(state, llvmtypes), llvmtypes, false);
 
@@ -788,6 +1089,42 @@ public:
 		return state.builder.CreateCall(f, parameters);
 	}
 
+	/* The C library only has scalar versions of these, so in lane-parallel
+	 * code call them once per lane. */
+
+	llvm::Value* emitLaneCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters,
+			const vector<llvm::Type*>& llvmtypes)
+	{
+		vector<llvm::Type*> scalartypes;
+		for (unsigned i = 0; i < llvmtypes.size(); i++)
+			scalartypes.push_back(llvmtypes[i]->getScalarType());
+
+		llvm::Type* returntype = returnType(state, llvmtypes);
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				returntype->getScalarType(), scalartypes, false);
+
+		llvm::Constant* f = state.module->getOrInsertFunction(
+				intrinsicName(scalartypes), ft,
+				llvm::AttributeSet().addAttribute(state.context,
+							llvm::AttributeSet::FunctionIndex,
+							llvm::Attribute::ReadNone));
+
+		llvm::Value* retval = llvm::UndefValue::get(returntype);
+		for (unsigned lane = 0; lane < state.lanes; lane++)
+		{
+			llvm::Value* l = llvm::ConstantInt::get(state.intType, lane);
+			vector<llvm::Value*> args;
+			for (unsigned i = 0; i < parameters.size(); i++)
+				args.push_back(state.builder.CreateExtractElement(parameters[i], l));
+
+			llvm::Value* v = state.builder.CreateCall(f, args);
+			retval = state.builder.CreateInsertElement(retval, v, l);
+		}
+
+		return retval;
+	}
+
 	virtual llvm::Type* returnType(CompilerState& state,
 			const vector<llvm::Type*>& inputTypes) = 0;
 	virtual string intrinsicName(const vector<llvm::Type*>& inputTypes) = 0;
@@ -820,6 +1157,15 @@ public:
 			return _next->resolve(name);
 		return NULL;
 	}
+
+	/* Describes every symbol visible through this table (see
+	 * Symbol::describe()). */
+
+	virtual void describe(std::ostream& s, bool addresses)
+	{
+		if (_next)
+			_next->describe(s, addresses);
+	}
 };
 
 class SingletonSymbolTable : public SymbolTable
@@ -845,6 +1191,13 @@ public:
 			return _symbol;
 		return SymbolTable::resolve(name);
 	}
+
+	void describe(std::ostream& s, bool addresses)
+	{
+		if (_symbol)
+			_symbol->describe(s, addresses);
+		SymbolTable::describe(s, addresses);
+	}
 };
 
 class MultipleSymbolTable : public SymbolTable
@@ -874,6 +1227,16 @@ public:
 			return SymbolTable::resolve(name);
 		return i->second;
 	}
+
+	void describe(std::ostream& s, bool addresses)
+	{
+		for (typename Symbols::const_iterator i = _symbols.begin(),
+				e = _symbols.end(); i != e; i++)
+		{
+			i->second->describe(s, addresses);
+		}
+		SymbolTable::describe(s, addresses);
+	}
 };
 
 #endif
@@ -0,0 +1,345 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_THREADS_H
+#define CALCULON_THREADS_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Programs which have their own session (i.e. all of them, unless you pass
+ * one in) can be compiled on any thread, several at a time, and can share
+ * symbol tables while doing so; just don't add anything to a symbol table
+ * while it's in use. A CompileService uses this to compile Programs on a
+ * pool of worker threads. It needs Boost.Thread, so it's only available if
+ * CALCULON_THREADS is defined before calculon.h is included. */
+
+class CompileService;
+
+class CompileJob
+{
+	friend class CompileService;
+
+	boost::mutex _lock;
+	boost::condition_variable _done;
+	bool _finished;
+
+public:
+	CompileJob():
+		_finished(false)
+	{
+	}
+
+	virtual ~CompileJob()
+	{
+	}
+
+	/* Returns true once the job has been run. */
+
+	bool ready()
+	{
+		boost::lock_guard<boost::mutex> guard(_lock);
+		return _finished;
+	}
+
+	/* Waits for just this job. */
+
+	void wait()
+	{
+		boost::unique_lock<boost::mutex> guard(_lock);
+		while (!_finished)
+			_done.wait(guard);
+	}
+
+protected:
+	/* Called on a worker thread. This mustn't throw. */
+
+	virtual void run() = 0;
+
+private:
+	/* The job may be destroyed as soon as this has been called, so the
+	 * notification has to happen with the lock still held. */
+
+	void finish()
+	{
+		boost::lock_guard<boost::mutex> guard(_lock);
+		_finished = true;
+		_done.notify_all();
+	}
+
+	CompileJob(const CompileJob&);
+	CompileJob& operator = (const CompileJob&);
+};
+
+/* Compiles one Program of type P. Once the service has finished with it,
+ * either program() returns the compiled Program or error() says why it
+ * couldn't be compiled. */
+
+template <class P>
+class Compilation : public CompileJob
+{
+	SymbolTable& _symbols;
+	string _code;
+	string _signature;
+	map<string, string> _typealiases;
+	CompileOptions _options;
+	auto_ptr<P> _program;
+	string _error;
+
+public:
+	using CompileJob::wait;
+
+	Compilation(SymbolTable& symbols, const string& code,
+			const string& signature,
+			const map<string, string>& typealiases = map<string, string>(),
+			const CompileOptions& options = CompileOptions()):
+		_symbols(symbols),
+		_code(code),
+		_signature(signature),
+		_typealiases(typealiases),
+		_options(options)
+	{
+	}
+
+	P* program()
+	{
+		return _program.get();
+	}
+
+	/* Hands ownership of the Program to the caller. */
+
+	P* release()
+	{
+		return _program.release();
+	}
+
+	const string& error() const
+	{
+		return _error;
+	}
+
+	/* Returns the Program once it's ready, waiting if necessary, or throws
+	 * if it couldn't be compiled. */
+
+	P& get()
+	{
+		wait();
+		if (!_program.get())
+			throw CompilationException(_error);
+		return *_program;
+	}
+
+protected:
+	void run()
+	{
+		try
+		{
+			_program.reset(new P(_symbols, _code, _signature, _typealiases,
+					_options));
+		}
+		catch (const std::exception& e)
+		{
+			_error = e.what();
+		}
+		catch (...)
+		{
+			/* Some of LLVM (and a few internal errors) throw things which
+			 * aren't exceptions; they mustn't escape the worker. */
+
+			_error = "internal error while compiling";
+		}
+	}
+};
+
+/* A handle to a Program being compiled by CompileService::compileAsync().
+ * Handles can be copied freely; the Program lives until the last one goes
+ * away (even if that's before it's been compiled). */
+
+template <class P>
+class Future
+{
+	boost::shared_ptr<Compilation<P> > _compilation;
+
+public:
+	Future()
+	{
+	}
+
+	explicit Future(const boost::shared_ptr<Compilation<P> >& compilation):
+		_compilation(compilation)
+	{
+	}
+
+	bool valid() const
+	{
+		return _compilation.get() != NULL;
+	}
+
+	/* Doesn't wait for the compilation, so this is fine to call from
+	 * latency-sensitive threads. */
+
+	bool ready() const
+	{
+		return _compilation->ready();
+	}
+
+	void wait() const
+	{
+		_compilation->wait();
+	}
+
+	/* Waits for the Program and returns it. If it couldn't be compiled,
+	 * this throws a CompilationException saying why. */
+
+	P& get() const
+	{
+		return _compilation->get();
+	}
+};
+
+class CompileService
+{
+	boost::mutex _lock;
+	boost::condition_variable _queued;
+	boost::condition_variable _finished;
+	std::deque<boost::shared_ptr<CompileJob> > _queue;
+	unsigned _running;
+	bool _stopping;
+	boost::thread_group _threads;
+
+public:
+	/* By default there's one worker per core. */
+
+	CompileService(unsigned threads = 0):
+		_running(0),
+		_stopping(false)
+	{
+		Calculon::initialize();
+
+		if (threads == 0)
+			threads = boost::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+
+		for (unsigned i = 0; i < threads; i++)
+			_threads.create_thread(Worker(*this));
+	}
+
+	/* Anything still queued is compiled before the workers exit. */
+
+	~CompileService()
+	{
+		{
+			boost::lock_guard<boost::mutex> guard(_lock);
+			_stopping = true;
+		}
+		_queued.notify_all();
+		_threads.join_all();
+	}
+
+	/* Queues a job and returns immediately. The job must stay alive until
+	 * it's been run; wait() for it (or for the service) before looking at
+	 * the result. Any thread may submit jobs. */
+
+	void submit(CompileJob& job)
+	{
+		enqueue(boost::shared_ptr<CompileJob>(&job, Unowned()));
+	}
+
+	/* Starts compiling a Program in the background and returns a handle to
+	 * it straight away. The symbol table must outlive the compilation. */
+
+	template <class P>
+	Future<P> compileAsync(SymbolTable& symbols, const string& code,
+			const string& signature,
+			const map<string, string>& typealiases = map<string, string>(),
+			const CompileOptions& options = CompileOptions())
+	{
+		boost::shared_ptr<Compilation<P> > compilation(
+				new Compilation<P>(symbols, code, signature, typealiases,
+						options));
+		enqueue(compilation);
+		return Future<P>(compilation);
+	}
+
+	/* Waits until every job submitted so far has been run. */
+
+	void wait()
+	{
+		boost::unique_lock<boost::mutex> guard(_lock);
+		while (!_queue.empty() || _running)
+			_finished.wait(guard);
+	}
+
+private:
+	/* Jobs passed to submit() belong to the caller. */
+
+	struct Unowned
+	{
+		void operator () (CompileJob*)
+		{
+		}
+	};
+
+	void enqueue(const boost::shared_ptr<CompileJob>& job)
+	{
+		{
+			boost::lock_guard<boost::mutex> guard(_lock);
+			_queue.push_back(job);
+		}
+		_queued.notify_one();
+	}
+
+	struct Worker
+	{
+		CompileService& service;
+
+		Worker(CompileService& service):
+			service(service)
+		{
+		}
+
+		void operator () ()
+		{
+			service.worker();
+		}
+	};
+
+	void worker()
+	{
+		for (;;)
+		{
+			boost::shared_ptr<CompileJob> job;
+
+			{
+				boost::unique_lock<boost::mutex> guard(_lock);
+				while (_queue.empty() && !_stopping)
+					_queued.wait(guard);
+				if (_queue.empty())
+					return;
+
+				job = _queue.front();
+				_queue.pop_front();
+				_running++;
+			}
+
+			job->run();
+			job->finish();
+			job.reset();
+
+			{
+				boost::lock_guard<boost::mutex> guard(_lock);
+				_running--;
+			}
+			_finished.notify_all();
+		}
+	}
+
+	CompileService(const CompileService&);
+	CompileService& operator = (const CompileService&);
+};
+
+#endif
@@ -34,6 +34,13 @@ public:
 		return llvm == other->llvm;
 	}
 
+	/* True for int and for vectors of ints. */
+
+	bool isInteger() const
+	{
+		return llvm->getScalarType()->isIntegerTy(32);
+	}
+
 	virtual RealType* asReal()
 	{
 		return NULL;
@@ -74,7 +81,7 @@ public:
 	RealType(CompilerState& state, const string& name):
 		Type(state, name)
 	{
-		llvm = llvmx = S::createRealType(state.context);
+		llvm = llvmx = state.laneType(S::createRealType(state.context));
 
 		_llvmdouble = llvm::Type::getDoubleTy(state.context);
 		_llvmfloat = llvm::Type::getFloatTy(state.context);
@@ -108,7 +115,7 @@ public:
 	DoubleType(CompilerState& state, const string& name):
 		RealType(state, name)
 	{
-		llvmx = llvm::Type::getDoubleTy(state.context);
+		llvmx = state.laneType(llvm::Type::getDoubleTy(state.context));
 	}
 
 	llvm::Value* convertToExternal(llvm::Value* value)
@@ -127,7 +134,7 @@ public:
 	FloatType(CompilerState& state, const string& name):
 		RealType(state, name)
 	{
-		llvmx = llvm::Type::getFloatTy(state.context);
+		llvmx = state.laneType(llvm::Type::getFloatTy(state.context));
 	}
 
 	llvm::Value* convertToExternal(llvm::Value* value)
@@ -142,26 +149,44 @@ public:
 	BooleanType(CompilerState& state, const string& name):
 		Type(state, name)
 	{
-		this->llvm = this->llvmx = llvm::IntegerType::get(state.context, 1);
+		this->llvm = this->llvmx = state.laneType(
+				llvm::IntegerType::get(state.context, 1));
+	}
+};
+
+/* Ints are 32 bits and signed, and arithmetic on them wraps. */
+
+class IntType : public Type
+{
+public:
+	IntType(CompilerState& state, const string& name):
+		Type(state, name)
+	{
+		this->llvm = this->llvmx = state.laneType(
+				llvm::IntegerType::get(state.context, 32));
 	}
 };
 
+/* Vectors are either of reals (vector*N) or of ints (int*N). */
+
 class VectorType : public Type
 {
 public:
 	unsigned size;
+	Type* element;
 
 	using Type::state;
 	using Type::llvm;
 	using Type::llvmx;
 
 public:
-	VectorType(CompilerState& state, const string& name, unsigned size):
+	VectorType(CompilerState& state, const string& name, unsigned size,
+			Type* element):
 		Type(state, name),
-		size(size)
+		size(size),
+		element(element)
 	{
-		llvm::Type* t = state.types->find("real")->llvm;
-		llvm = llvm::VectorType::get(t, size);
+		llvm = llvm::VectorType::get(element->llvm, size);
 
 		llvmx = llvm::PointerType::get(llvm, 0);
 	}
@@ -260,11 +285,21 @@ public:
 			type = _compiler.retain(new FloatType(_compiler, name));
 		else if (name == "!double")
 			type = _compiler.retain(new DoubleType(_compiler, name));
+		else if (name == "int")
+			type = _compiler.retain(new IntType(_compiler, name));
+		else if (((name.substr(0, 6) == "vector") ||
+					(name.substr(0, 4) == "int*")) && (_compiler.lanes > 1))
+			throw CompilationException(
+					"vectors can't be used in lane-parallel code");
 		else if (name == "vector")
-			type = _compiler.retain(new VectorType(_compiler, name, 3));
+			type = _compiler.retain(new VectorType(_compiler, name, 3,
+					find("real")));
 		else if (name.substr(0, 7) == "vector*")
 			type = _compiler.retain(new VectorType(_compiler, name,
-					atoi(name.c_str() + 7)));
+					atoi(name.c_str() + 7), find("real")));
+		else if (name.substr(0, 4) == "int*")
+			type = _compiler.retain(new VectorType(_compiler, name,
+					atoi(name.c_str() + 4), find("int")));
 		else
 			return NULL;
 
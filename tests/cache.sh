@@ -0,0 +1,20 @@
+# The first run compiles the script and fills the cache; the second loads the
+# machine code back out of it without parsing anything, which means resolving
+# sin() and pow() all over again. Both must give the same results as
+# compiling without a cache.
+
+cache=$(mktemp -d)
+trap 'rm -rf $cache' EXIT
+
+../demo/filter -p $1 -f cache.cal < testdata > $cache/uncached
+../demo/filter -p $1 -f cache.cal --cache $cache --trace $cache/miss.json \
+	< testdata > $cache/miss
+../demo/filter -p $1 -f cache.cal --cache $cache --trace $cache/hit.json \
+	< testdata > $cache/hit
+
+echo "cache entries: $(ls $cache/*.o | wc -l | tr -d ' ')"
+grep -q '"name":"parse"' $cache/miss.json && echo "miss compiled the script"
+grep -q '"name":"parse"' $cache/hit.json || echo "hit loaded machine code"
+test -s $cache/uncached && echo "results produced"
+cmp -s $cache/miss $cache/uncached && echo "miss matches uncached"
+cmp -s $cache/hit $cache/miss && echo "hit matches miss"
@@ -0,0 +1,21 @@
+/* Calls a script compiled ahead of time by calculonc; see calculonc.sh.
+ * REAL is the precision it was compiled with. */
+
+#include <stdio.h>
+
+extern void formula(REAL in, REAL* out);
+
+int main(void)
+{
+	static const REAL inputs[] = { 0, 1, 2, 3, 10 };
+	unsigned i;
+
+	for (i = 0; i < sizeof(inputs)/sizeof(*inputs); i++)
+	{
+		REAL out;
+		formula(inputs[i], &out);
+		printf("%g\n", (double) out);
+	}
+
+	return 0;
+}
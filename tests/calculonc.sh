@@ -0,0 +1,21 @@
+# calculonc's output can be linked into a C program with nothing from
+# Calculon or LLVM, both as an object file and as a shared library. The
+# shared library has to bring libm with it, so the driver is linked without.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+script='let sq(x) = x*x in let out = pow(2, in) + sq(in) in return'
+signature='(in: real): (out: real)'
+
+echo "object file:"
+../tools/calculonc -p $1 -s "$script" -S "$signature" -n formula \
+	-o $dir/formula.o &&
+	cc -DREAL=$1 -o $dir/static calculonc-driver.c $dir/formula.o -lm &&
+	$dir/static
+
+echo "shared library:"
+../tools/calculonc -p $1 -s "$script" -S "$signature" -n formula \
+	-o $dir/libformula.so &&
+	cc -DREAL=$1 -o $dir/dynamic calculonc-driver.c -L$dir -lformula &&
+	LD_LIBRARY_PATH=$dir $dir/dynamic
@@ -0,0 +1,17 @@
+# Compact mode should keep hold of less memory than a normal compilation of
+# the same script.
+
+retained()
+{
+	../demo/filter -p $1 -f compact.cal --retained $2 < testdata 2>&1 >/dev/null |
+		sed -n -e 's/^retained: //p'
+}
+
+full=$(retained $1)
+compact=$(retained $1 --compact)
+
+if [ -n "$compact" ] && [ "$compact" -lt "$full" ]; then
+	echo "compact mode retains less"
+else
+	echo "compact mode retains $compact bytes, but normal compilation $full"
+fi
@@ -0,0 +1,23 @@
+# Each baseline instruction set gets its own entry in the cache, keyed on the
+# CPU it was compiled for, and Dispatch reuses whichever of them the host
+# supports. Nothing is run while the cache is being filled, as the host may
+# not be able to run all of them.
+
+cache=$(mktemp -d)
+trap 'rm -rf $cache' EXIT
+
+for isa in sse2 avx avx2 sse2 dispatch; do
+	../demo/filter -p $1 -f isa.cal --isa $isa --cache $cache < /dev/null
+done
+
+echo "cache entries: $(ls $cache | wc -l | tr -d ' ')"
+for f in $cache/*.o; do
+	grep -a '^cpu ' $f
+done | sort
+
+# The baseline code gets the same results as the native code (given strict
+# IEEE semantics, so that neither can reassociate or fuse anything).
+
+../demo/filter -p $1 -f isa.cal -P strict-ieee --isa sse2 < testdata > $cache/sse2
+../demo/filter -p $1 -f isa.cal -P strict-ieee < testdata > $cache/native
+cmp -s $cache/sse2 $cache/native && echo "sse2 and native results match"
@@ -0,0 +1,14 @@
+# Rounding to the nearest integer mustn't round up the number just below a
+# half, as adding a half and truncating does. Which number that is depends on
+# the precision. Halves themselves round away from zero.
+
+case $1 in
+	float) below=0.49999997 ;;
+	*)     below=0.49999999999999994 ;;
+esac
+
+for type in u8 i16 i32; do
+	echo "$type: $(printf '%s\n' $below -$below 0.5 -0.5 1.5 2.5 -2.5 |
+		../demo/filter -p $1 --batch --output-type $type \
+			-s 'let out = in in return' | tr '\n' ' ')"
+done
@@ -0,0 +1,32 @@
+# The threaded build of filter compiles with CompileService::compileAsync()
+# and runs batches, grids and reductions through a BatchExecutor, a row (or
+# a tile) at a time. Each must give exactly the same results as the
+# single-threaded build.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+compare()
+{
+	name=$1
+	input=$2
+	shift 2
+	../demo/filter -p $precision "$@" < $input > $dir/single 2>&1
+	../demo/filter-threads -p $precision --threads 4 "$@" < $input \
+		> $dir/threaded 2>&1
+	echo "exit status $?"
+	cat $dir/threaded
+	cmp -s $dir/single $dir/threaded && echo "$name: same as single-threaded"
+}
+
+precision=$1
+compare batch testdata --batch -s 'let out = in*2 + 1 in return'
+compare grid /dev/null --grid 7x5 --tile 2 -s 'let out = x + y*10 in return'
+compare sum intdata --reduce sum -s 'let out = in*in in return'
+compare max intdata --reduce max -s 'let out = in - 100 in return'
+compare count testdata --reduce count -s 'let out = in in return'
+
+# Compilation errors come back through the Future.
+
+compare error testdata --batch -s 'let out = in + in in' 2>&1 |
+	sed -e '/^Calculon compilation error/d'
@@ -0,0 +1,16 @@
+# Tiered programs switch to the optimised code during the call which reaches
+# the threshold (testdata has ten numbers), and not before. Either way they
+# give the same results as an ordinary program.
+
+dir=$(mktemp -d)
+trap 'rm -rf $dir' EXIT
+
+../demo/filter -p $1 -f tiered.cal < testdata > $dir/untiered
+cat $dir/untiered
+
+for tier in 4 10 11; do
+	../demo/filter -p $1 -f tiered.cal --tier $tier --promoted < testdata \
+		> $dir/tiered 2> $dir/promoted
+	echo "tier $tier: $(cat $dir/promoted)"
+	cmp -s $dir/tiered $dir/untiered && echo "tier $tier: results match"
+done
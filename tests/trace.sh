@@ -0,0 +1,23 @@
+# --trace writes a Chrome trace of the compilation: a JSON array with an
+# event for each phase and a final compile event carrying the counters. The
+# normal output must be unaffected.
+
+trace=$(mktemp)
+trap 'rm -f $trace' EXIT
+
+../demo/filter -p $1 --batch --trace $trace -s 'let out = in*2 in return' < testdata
+
+if [ "$(sed -n '1p' $trace)" != "[" ] || [ "$(sed -n '$p' $trace)" != "]" ]; then
+	echo "trace isn't a JSON array"
+fi
+if grep -v '^\[$' $trace | grep -v '^\]$' | grep -v '^{"name":"[^"]*","cat":"calculon","ph":"X","ts":[0-9]*,"dur":[0-9]*,"pid":1,"tid":1[,}]' > /dev/null; then
+	echo "trace has malformed events"
+fi
+
+sed -n 's/^{"name":"\([^"]*\)".*/\1/p' $trace | LC_ALL=C sort -u
+printf "args: "
+sed -n 's/^{"name":"compile".*"args":{\(.*\)}}$/\1/p' $trace |
+	tr ',' '\n' |
+	sed 's/^"\([A-Za-z]*\)":[0-9]*$/\1/' |
+	LC_ALL=C sort |
+	paste -sd' ' -
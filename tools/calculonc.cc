@@ -0,0 +1,309 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <iostream>
+#include <fstream>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+
+#include "calculon.h"
+
+using std::string;
+using std::vector;
+using std::map;
+namespace po = boost::program_options;
+
+static bool parsenumber(const string& s, double& d)
+{
+    const char* p = s.c_str();
+    char* endp;
+    d = strtod(p, &endp);
+    if (*endp)
+        return false;
+    return true;
+}
+
+static void usage(const string& message)
+{
+    std::cerr << "calculonc: " << message << "\n"
+              << "(try --help)\n";
+    exit(1);
+}
+
+template <typename Settings>
+static void compile(std::istream& codestream, const string& name,
+        const string& signature, bool library, bool dump,
+        const string& objectfilename, const string& manifestfilename,
+        const map<string, double>& realvariables,
+        const map<string, vector<double> >& vectorvariables,
+        const map<string, string>& typealiases,
+        const Calculon::CompileOptions& options)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+
+    typename Compiler::StandardSymbolTable symbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		for (map<string, vector<double> >::const_iterator i = vectorvariables.begin(),
+				e = vectorvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		typename Compiler::ObjectCompiler compiler(symbols, options);
+		if (library)
+			compiler.addLibrary(codestream, typealiases);
+		else
+			compiler.addProgram(name, codestream, signature, typealiases);
+
+		std::ofstream objectstream(objectfilename.c_str(),
+				std::ios::out | std::ios::binary);
+		std::ofstream manifeststream(manifestfilename.c_str());
+		if (!objectstream || !manifeststream)
+		{
+			std::cerr << "calculonc: couldn't open output files\n";
+			exit(1);
+		}
+
+		compiler.write(objectstream, manifeststream);
+		if (dump)
+			compiler.dump();
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+    string precision = "double";
+    string profile = "max-throughput";
+    string isa = "sse2";
+    string name = "entrypoint";
+
+    po::options_description options("Allowed options");
+    options.add_options()
+        ("help,h",
+                "produce help message")
+        ("file,f",   po::value<string>(),
+                "input Calculon script name")
+        ("script,s", po::value<string>(),
+                "literal Calculon script")
+        ("signature,S", po::value<string>(),
+                "the script's signature, e.g. '(x: real): (y: real)'")
+        ("name,n", po::value(&name),
+                "the name of the C function to generate")
+        ("library,L",
+                "the script is a library; generate a function for each export")
+        ("output,o", po::value<string>(),
+                "output file; if it ends in .so, a shared library is linked")
+        ("manifest,m", po::value<string>(),
+                "write the list of symbols the object needs here (default: output.manifest)")
+        ("precision,p", po::value(&precision),
+                "specifies whether to use double or float precision")
+        ("dump,d",
+                "dump LLVM bitcode after compilation")
+        ("profile,P", po::value(&profile),
+                "optimisation profile: max-throughput, fast-compile or strict-ieee")
+        ("isa", po::value(&isa),
+                "instruction set: native, sse2, avx or avx2")
+        ("cpu", po::value<string>(),
+                "generate code for this CPU (overrides --isa)")
+        ("define,D", po::value< vector<string> >(),
+                "defines a global real variable")
+        ("vector,V", po::value< vector<string> >(),
+                "defines a global vector variable")
+        ("type,T", po::value< vector<string> >(),
+                "defines a type alias")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, options), vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << "calculonc: compiles a Calculon script ahead of time into an object file\n"
+                     "or shared library which doesn't need LLVM to run.\n"
+                  << options <<
+                     "\n"
+                     "Try: calculonc -s 'let y = sin(x) in return' -S '(x): (y)' -n f -o f.o\n";
+
+        exit(1);
+    }
+
+    if (!vm.count("file") && !vm.count("script"))
+        usage("you must specify the Calculon script to use!");
+    if (vm.count("file") && vm.count("script"))
+        usage("you can't specify *both* a file and a literal script!");
+    if (!vm.count("output"))
+        usage("you must specify an output file");
+
+    bool library = (vm.count("library") > 0);
+    if (library == (vm.count("signature") > 0))
+        usage("you must specify either a signature or --library (but not both)");
+
+    map<string, double> realvariables;
+    if (vm.count("define") > 0)
+    {
+        const vector<string>& variableparams = vm["define"].as< vector<string> >();
+        for (vector<string>::const_iterator i = variableparams.begin(),
+                e = variableparams.end(); i != e; i++)
+        {
+            const string& definition = *i;
+            string::size_type equals = definition.find('=');
+            if (equals == string::npos)
+                usage("malformed variable definition (use -D NAME=REAL)");
+
+            double value;
+            if (!parsenumber(definition.substr(equals+1), value))
+                usage("malformed real");
+
+            realvariables[definition.substr(0, equals)] = value;
+        }
+    }
+
+    map<string, vector<double> > vectorvariables;
+    if (vm.count("vector") > 0)
+    {
+        const vector<string>& variableparams = vm["vector"].as< vector<string> >();
+        for (vector<string>::const_iterator i = variableparams.begin(),
+                e = variableparams.end(); i != e; i++)
+        {
+            const string& definition = *i;
+            string::size_type equals = definition.find('=');
+            if (equals == string::npos)
+                usage("malformed variable definition (use -V NAME=REAL,REAL...)");
+
+            vector<string> elements;
+            string s = definition.substr(equals+1);
+            boost::algorithm::split(elements, s, boost::algorithm::is_any_of(","));
+
+            vector<double> value;
+            for (vector<string>::const_iterator i = elements.begin(),
+                    e = elements.end(); i != e; i++)
+            {
+                double v;
+                if (!parsenumber(*i, v))
+                    usage("malformed real");
+                value.push_back(v);
+            }
+
+            vectorvariables[definition.substr(0, equals)] = value;
+        }
+    }
+
+    map<string, string> typealiases;
+    if (vm.count("type") > 0)
+    {
+        const vector<string>& params = vm["type"].as< vector<string> >();
+        for (vector<string>::const_iterator i = params.begin(),
+                e = params.end(); i != e; i++)
+        {
+            const string& definition = *i;
+            string::size_type equals = definition.find('=');
+            if (equals == string::npos)
+                usage("malformed type alias definition (use -T NAME=NAME)");
+
+            typealiases[definition.substr(0, equals)] = definition.substr(equals+1);
+        }
+    }
+
+    Calculon::CompileOptions compileoptions;
+    if (profile == "max-throughput")
+        compileoptions.setProfile(Calculon::CompileOptions::MaxThroughput);
+    else if (profile == "fast-compile")
+        compileoptions.setProfile(Calculon::CompileOptions::FastCompile);
+    else if (profile == "strict-ieee")
+        compileoptions.setProfile(Calculon::CompileOptions::StrictIEEE);
+    else
+        usage("unknown optimisation profile");
+
+    /* Dispatch relies on the JIT picking the CPU at run time, which doesn't
+     * make sense here. */
+
+    if (isa == "native")
+        compileoptions.instructionSet = Calculon::CompileOptions::Native;
+    else if (isa == "sse2")
+        compileoptions.instructionSet = Calculon::CompileOptions::SSE2;
+    else if (isa == "avx")
+        compileoptions.instructionSet = Calculon::CompileOptions::AVX;
+    else if (isa == "avx2")
+        compileoptions.instructionSet = Calculon::CompileOptions::AVX2;
+    else
+        usage("unknown instruction set");
+    if (vm.count("cpu"))
+        compileoptions.cpu = vm["cpu"].as<string>();
+
+    if ((precision != "float") && (precision != "double"))
+        usage("precision must be 'double' or 'float'");
+
+    std::istream* codestream;
+    if (vm.count("file"))
+    {
+        string scriptfilename = vm["file"].as<string>();
+        codestream = new std::ifstream(scriptfilename.c_str());
+        if (!*codestream)
+            usage("couldn't open the script");
+    }
+    else
+        codestream = new std::stringstream(vm["script"].as<string>());
+
+    string output = vm["output"].as<string>();
+    bool shared = boost::algorithm::ends_with(output, ".so");
+    string objectfilename = shared ? (output + ".o") : output;
+    string manifestfilename = output + ".manifest";
+    if (vm.count("manifest"))
+        manifestfilename = vm["manifest"].as<string>();
+
+    string signature;
+    if (vm.count("signature"))
+        signature = vm["signature"].as<string>();
+    bool dump = (vm.count("dump") > 0);
+
+    if (precision == "double")
+        compile<Calculon::RealIsDouble>(*codestream, name, signature, library,
+                dump, objectfilename, manifestfilename,
+                realvariables, vectorvariables, typealiases, compileoptions);
+    else
+        compile<Calculon::RealIsFloat>(*codestream, name, signature, library,
+                dump, objectfilename, manifestfilename,
+                realvariables, vectorvariables, typealiases, compileoptions);
+
+    /* The object is position independent, so the system compiler can turn
+     * it straight into a shared library. Most of what it needs comes from
+     * libm, so the library depends on that. */
+
+    if (shared)
+    {
+        const char* cc = getenv("CC");
+        string command = string(cc ? cc : "cc") + " -shared -o '" + output +
+                "' '" + objectfilename + "' -lm";
+        int status = system(command.c_str());
+        remove(objectfilename.c_str());
+        if (status != 0)
+        {
+            std::cerr << "calculonc: couldn't link " << output << "\n";
+            exit(1);
+        }
+    }
+
+    return 0;
+}